@@ -0,0 +1,476 @@
+#include "platform.h"
+
+#ifdef PLATFORM_POSIX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dataarea.h"
+#include "fileio.h"
+#include "rules.h"
+#include "optimizer.h"
+#include "labels.h"
+#include "batch.h"
+
+/*
+ * Host batch mode. The rules are loaded once and shared read-only; each
+ * worker thread owns an OptimizerContext and takes the next task from a
+ * shared counter. A task is either a whole file or, when a single file
+ * is given, one chunk of it.
+ */
+
+typedef void (*TaskFn)(OptimizerContext* ctx, int task, void* arg);
+
+typedef struct Pool {
+    TaskFn fn;
+    void* arg;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+} Pool;
+
+static void* pool_worker(void* arg) {
+    Pool* p = (Pool*)arg;
+    OptimizerContext* ctx = malloc(sizeof(OptimizerContext));
+    if (!ctx) error(ERROR_OUT_OF_MEMORY, 0);
+    init_context(ctx);
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        int i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (i >= p->count) break;
+        p->fn(ctx, i, p->arg);
+    }
+    free_context(ctx);
+    free(ctx);
+    return NULL;
+}
+
+/* Run tasks 0..count-1 on up to `jobs` threads and wait for them. */
+static void run_pool(int jobs, int count, TaskFn fn, void* arg) {
+    Pool p;
+    p.fn = fn;
+    p.arg = arg;
+    p.count = count;
+    p.next = 0;
+    pthread_mutex_init(&p.lock, NULL);
+
+    if (jobs > count) jobs = count;
+    pthread_t threads[MAX_JOBS];
+    int started = 0;
+    for (; started < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, pool_worker, &p) != 0) break;
+    }
+    /* Without any worker thread the tasks are run here */
+    if (started == 0) pool_worker(&p);
+    for (int i = 0; i < started; ++i) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&p.lock);
+}
+
+/* ---- Many files ---- */
+
+typedef struct FileList {
+    char** files;
+    uint8_t window;
+    uint8_t* failed;    /* per file, so workers never share a flag */
+} FileList;
+
+static void file_task(OptimizerContext* ctx, int task, void* arg) {
+    FileList* list = (FileList*)arg;
+    const char* filename = list->files[task];
+    char* tmpname = malloc(strlen(filename) + 5);
+    if (!tmpname) error(ERROR_OUT_OF_MEMORY, 0);
+    if (optimize_file(ctx, filename, tmpname, list->window))
+        list->failed[task] = 1;
+    free(tmpname);
+}
+
+/* ---- One file in chunks ----
+ *
+ * The file is cut at line boundaries into one chunk per job. Each chunk
+ * is optimized into its own temporary file, and every chunk but the last
+ * reads SPLIT_OVERLAP lines past its end. Because a rule may match across
+ * a cut, neighbouring chunks are joined at a line where both reached the
+ * same state: the window full of unmodified input lines headed by that
+ * line (see OptimizerContext.on_sync). From there both runs, and a serial
+ * run, write the same output, so the joined file is byte-identical to
+ * optimizing it in one piece. If a seam has no such line within the
+ * overlap, the file is optimized serially instead.
+ *
+ * Label rules also depend on the reference counts of the whole file. Its
+ * label table is built once and shared; each chunk keeps its own counts
+ * and logs where it read and changed them. A chunk's part of the output
+ * is only kept if every count it read after its seam is the one a serial
+ * run would have had, which is the table's count with the changes of the
+ * kept parts before it. Otherwise the chunk is optimized again from its
+ * seam, which it was in sync at, with those counts.
+ */
+#define SPLIT_OVERLAP 1024
+#define SPLIT_MIN_LINES 16384
+
+typedef struct Chunk {
+    uint32_t first_line;
+    uint32_t start;         /* byte range read by the chunk */
+    uint32_t length;
+    uint32_t next_line;     /* first line of the next chunk, relative */
+    uint32_t* head_sync;    /* output offset + 1 at line k of the chunk */
+    uint32_t* tail_sync;    /* output offset + 1 at line next_line + k */
+    LabelCounts* counts;    /* own label reference counts, with label rules */
+    char* tmpname;
+    uint8_t failed;
+} Chunk;
+
+typedef struct Split {
+    const char* filename;
+    Chunk* chunks;
+    LabelTable* labels;     /* of the whole file, with label rules */
+    uint8_t window;
+} Split;
+
+static void record_sync(OptimizerContext* ctx, uint32_t line) {
+    Chunk* c = (Chunk*)ctx->sync_data;
+    if (c->head_sync && line < SPLIT_OVERLAP)
+        c->head_sync[line] = ctx->bytes_out + 1;
+    if (c->tail_sync && line >= c->next_line && line - c->next_line < SPLIT_OVERLAP)
+        c->tail_sync[line - c->next_line] = ctx->bytes_out + 1;
+}
+
+static void chunk_task(OptimizerContext* ctx, int task, void* arg) {
+    Split* s = (Split*)arg;
+    Chunk* c = &s->chunks[task];
+    int8_t in_fd = open_file_range(s->filename, c->start, c->length);
+    int8_t out_fd = in_fd < 0 ? -1 : create_file(c->tmpname);
+    if (in_fd < 0 || out_fd < 0) {
+        if (in_fd >= 0) close_file(in_fd);
+        c->failed = 1;
+        return;
+    }
+    ctx->on_sync = record_sync;
+    ctx->sync_data = c;
+    if (s->labels) {
+        if (!c->counts) c->counts = label_counts_new(s->labels);
+        ctx->labels = s->labels;
+        ctx->label_counts = c->counts;
+    }
+    if (optimize(ctx, in_fd, out_fd, s->window) < 0) c->failed = 1;
+    ctx->on_sync = NULL;
+    ctx->sync_data = NULL;
+    ctx->labels = NULL;
+    ctx->label_counts = NULL;
+    close_file(in_fd);
+    if (close_file(out_fd) < 0) c->failed = 1;
+}
+
+/* Byte offsets of the given ascending line numbers; lines past the end
+   map to `size`. Lines end at "\n", "\r" or "\r\n" as in read_line_grow.
+   Returns the number of lines when `count` is 0. */
+static uint32_t line_offsets(const char* data, uint32_t size, const uint32_t* lines, uint32_t* offsets, int count) {
+    uint32_t line = 0;
+    uint32_t pos = 0;
+    int i = 0;
+    while (pos < size) {
+        while (i < count && lines[i] == line) offsets[i++] = pos;
+        const char* p = memchr(data + pos, '\n', size - pos);
+        const char* cr = memchr(data + pos, '\r', (p ? (uint32_t)(p - data) : size) - pos);
+        if (cr) p = cr;
+        if (!p) {
+            pos = size;
+        }
+        else {
+            pos = (uint32_t)(p - data) + 1;
+            if (*p == '\r' && pos < size && data[pos] == '\n') ++pos;
+        }
+        ++line;
+    }
+    while (i < count) offsets[i++] = size;
+    return line;
+}
+
+/* Copy bytes [from, to) of a chunk's output to out_fd; UINT32_MAX for
+   `to` copies to the end. */
+static int8_t append_output(int8_t out_fd, const char* tmpname, uint32_t from, uint32_t to) {
+    uint32_t size = 0;
+    char* data = load_file(tmpname, &size);
+    if (to == UINT32_MAX) to = size;
+    if (from >= to) {
+        unload_file(data, size);
+        return 0;
+    }
+    if (!data || to > size) {
+        unload_file(data, size);
+        return -1;
+    }
+    int8_t result = 0;
+    while (from < to && result == 0) {
+        uint16_t n = (to - from) > 0x4000 ? 0x4000 : (uint16_t)(to - from);
+        if (write_block(out_fd, data + from, n) != (int16_t)n) result = -1;
+        from += n;
+    }
+    unload_file(data, size);
+    return result;
+}
+
+/* Find the seam after chunk i: the first line of the overlap where it
+   and chunk i + 1 reached the same state. Returns 1 when there is none. */
+static int8_t find_seam(const Chunk* chunks, int i, int n, uint32_t* cut, uint32_t* end, uint32_t* seam) {
+    if (i + 1 == n) {
+        end[i] = UINT32_MAX;
+        seam[n] = UINT32_MAX;
+        return 0;
+    }
+    int k = 0;
+    while (k < SPLIT_OVERLAP && !(chunks[i].tail_sync[k] && chunks[i + 1].head_sync[k])) ++k;
+    if (k == SPLIT_OVERLAP) return 1;
+    end[i] = chunks[i].tail_sync[k] - 1;
+    cut[i + 1] = chunks[i + 1].head_sync[k] - 1;
+    seam[i + 1] = chunks[i + 1].first_line + k;
+    return 0;
+}
+
+/* Whether every label count chunk `c` read at the input lines [from, to)
+   is the one a serial run read, `serial` being the counts of that run at
+   line `from` */
+static uint8_t reads_agree(const LabelTable* labels, const LabelCounts* serial, const Chunk* c, uint32_t from, uint32_t to) {
+    from -= c->first_line;
+    to -= c->first_line;
+    /* the chunk's counts at `from`, from the lines it read before */
+    LabelCounts* own = label_counts_new(labels);
+    label_counts_apply(own, c->counts, 0, from);
+    uint8_t agree = 1;
+    for (size_t k = 0; k < c->counts->log_count && agree; ++k) {
+        const LabelLog* e = &c->counts->log[k];
+        if (e->delta == 0 && e->line >= from && e->line < to && own->refs[e->id] != serial->refs[e->id])
+            agree = 0;
+    }
+    label_counts_free(own);
+    return agree;
+}
+
+/* Optimize chunk `task` again from its input line `line`, a line it was
+   in sync at, starting from the label counts of a serial run there. Its
+   output then begins with that line. */
+static void rerun_chunk(OptimizerContext* ctx, Split* s, int task, uint32_t line, const LabelCounts* serial) {
+    Chunk* c = &s->chunks[task];
+    uint32_t size = 0;
+    char* data = load_file(s->filename, &size);
+    if (!data) {
+        c->failed = 1;
+        return;
+    }
+    uint32_t skip = line - c->first_line;
+    uint32_t offset = 0;
+    line_offsets(data + c->start, c->length, &skip, &offset, 1);
+    unload_file(data, size);
+
+    c->first_line = line;
+    c->start += offset;
+    c->length -= offset;
+    free(c->head_sync);
+    c->head_sync = NULL;
+    if (c->tail_sync) {
+        c->next_line -= skip;
+        memset(c->tail_sync, 0, SPLIT_OVERLAP * sizeof(uint32_t));
+    }
+    memcpy(c->counts->refs, serial->refs, s->labels->count * sizeof(uint32_t));
+    c->counts->log_count = 0;
+    chunk_task(ctx, task, s);
+}
+
+/* Join the chunk outputs into `tmpname`. A chunk that read a label count
+   other than a serial run would have is optimized again from its seam
+   first. Returns 0 on success, 1 when a seam has no common sync line and
+   -1 on an I/O error. */
+static int8_t join_chunks(Split* s, int n, const char* tmpname) {
+    Chunk* chunks = s->chunks;
+    /* chunk i contributes its output bytes [cut[i], end[i]), which come
+       from the input lines [seam[i], seam[i + 1]) */
+    uint32_t* cut = malloc(n * sizeof(uint32_t));
+    uint32_t* end = malloc(n * sizeof(uint32_t));
+    uint32_t* seam = malloc((n + 1) * sizeof(uint32_t));
+    if (!cut || !end || !seam) error(ERROR_OUT_OF_MEMORY, 0);
+    cut[0] = 0;
+    seam[0] = 0;
+    /* label counts of a serial run at seam[i] */
+    LabelCounts* serial = s->labels ? label_counts_new(s->labels) : NULL;
+    OptimizerContext* ctx = NULL;
+    int8_t result = 0;
+    for (int i = 0; i < n && result == 0; ++i) {
+        Chunk* c = &chunks[i];
+        for (uint8_t again = 0; ; again = 1) {
+            result = find_seam(chunks, i, n, cut, end, seam);
+            if (result || !serial || again || reads_agree(s->labels, serial, c, seam[i], seam[i + 1])) break;
+            if (!ctx) {
+                ctx = malloc(sizeof(OptimizerContext));
+                if (!ctx) error(ERROR_OUT_OF_MEMORY, 0);
+                init_context(ctx);
+            }
+            rerun_chunk(ctx, s, i, seam[i], serial);
+            if (c->failed) {
+                result = -1;
+                break;
+            }
+            cut[i] = 0;
+        }
+        if (result == 0 && serial)
+            label_counts_apply(serial, c->counts, seam[i] - c->first_line, seam[i + 1] - c->first_line);
+    }
+    if (ctx) {
+        free_context(ctx);
+        free(ctx);
+    }
+    label_counts_free(serial);
+
+    if (result == 0) {
+        int8_t out_fd = create_file(tmpname);
+        if (out_fd < 0) result = -1;
+        for (int i = 0; i < n && result == 0; ++i) {
+            if (append_output(out_fd, chunks[i].tmpname, cut[i], end[i]) < 0) result = -1;
+        }
+        if (out_fd >= 0 && close_file(out_fd) < 0) result = -1;
+    }
+    free(cut);
+    free(end);
+    free(seam);
+    return result;
+}
+
+static int split_file(int jobs, const char* filename, uint8_t window) {
+    char* tmpname = malloc(strlen(filename) + 16);
+    if (!tmpname) error(ERROR_OUT_OF_MEMORY, 0);
+
+    uint32_t size = 0;
+    char* data = load_file(filename, &size);
+    uint32_t lines = data ? line_offsets(data, size, NULL, NULL, 0) : 0;
+    int n = jobs;
+    if (lines / SPLIT_MIN_LINES < (uint32_t)n) n = lines / SPLIT_MIN_LINES;
+    if (n < 2) {
+        unload_file(data, size);
+        OptimizerContext* ctx = malloc(sizeof(OptimizerContext));
+        if (!ctx) error(ERROR_OUT_OF_MEMORY, 0);
+        init_context(ctx);
+        int result = optimize_file(ctx, filename, tmpname, window);
+        free_context(ctx);
+        free(ctx);
+        free(tmpname);
+        return result;
+    }
+
+    /* chunk i + 1 starts at line starts[2i] and chunk i reads up to
+       line starts[2i + 1], SPLIT_OVERLAP lines further on */
+    uint32_t* starts = malloc(2 * (n - 1) * sizeof(uint32_t));
+    uint32_t* offsets = malloc(2 * (n - 1) * sizeof(uint32_t));
+    Chunk* chunks = calloc(n, sizeof(Chunk));
+    if (!starts || !offsets || !chunks) error(ERROR_OUT_OF_MEMORY, 0);
+    for (int i = 1; i < n; ++i) {
+        starts[2 * (i - 1)] = (uint32_t)((uint64_t)lines * i / n);
+        starts[2 * (i - 1) + 1] = starts[2 * (i - 1)] + SPLIT_OVERLAP;
+    }
+    line_offsets(data, size, starts, offsets, 2 * (n - 1));
+    unload_file(data, size);
+
+    for (int i = 0; i < n; ++i) {
+        Chunk* c = &chunks[i];
+        c->first_line = i ? starts[2 * (i - 1)] : 0;
+        c->start = i ? offsets[2 * (i - 1)] : 0;
+        c->length = (i + 1 < n ? offsets[2 * i + 1] : size) - c->start;
+        c->next_line = i + 1 < n ? starts[2 * i] - c->first_line : 0;
+        if (i > 0) c->head_sync = calloc(SPLIT_OVERLAP, sizeof(uint32_t));
+        if (i + 1 < n) c->tail_sync = calloc(SPLIT_OVERLAP, sizeof(uint32_t));
+        c->tmpname = malloc(strlen(filename) + 16);
+        if ((i > 0 && !c->head_sync) || (i + 1 < n && !c->tail_sync) || !c->tmpname)
+            error(ERROR_OUT_OF_MEMORY, 0);
+        sprintf(c->tmpname, "%s.%d.tmp", filename, i);
+    }
+
+    Split s;
+    s.filename = filename;
+    s.chunks = chunks;
+    s.labels = NULL;
+    s.window = window;
+    if (label_rules) {
+        int8_t scan_fd = open_file(filename);
+        if (scan_fd >= 0) {
+            s.labels = label_scan(scan_fd);
+            close_file(scan_fd);
+        }
+    }
+
+    printf("Optimizing %s in %d parts\n", filename, n);
+    run_pool(jobs, n, chunk_task, &s);
+
+    int result = 0;
+    for (int i = 0; i < n; ++i) {
+        if (chunks[i].failed) result = -1;
+    }
+    strcpy(tmpname, filename);
+    strcat(tmpname, ".tmp");
+    if (result == 0) result = join_chunks(&s, n, tmpname);
+
+    for (int i = 0; i < n; ++i) {
+        delete_file(chunks[i].tmpname);
+        label_counts_free(chunks[i].counts);
+        free(chunks[i].tmpname);
+        free(chunks[i].head_sync);
+        free(chunks[i].tail_sync);
+    }
+    free(chunks);
+    free(starts);
+    free(offsets);
+    label_free(s.labels);
+
+    if (result == 0) {
+        rename_file(tmpname, filename);
+    }
+    else if (result > 0) {
+        /* No safe seam: fall back to a single pass */
+        OptimizerContext* ctx = malloc(sizeof(OptimizerContext));
+        if (!ctx) error(ERROR_OUT_OF_MEMORY, 0);
+        init_context(ctx);
+        result = optimize_file(ctx, filename, tmpname, window);
+        free_context(ctx);
+        free(ctx);
+    }
+    else {
+        printf("Error optimizing %s\n", filename);
+        delete_file(tmpname);
+        result = 1;
+    }
+    free(tmpname);
+    return result;
+}
+
+int optimize_batch(int jobs, const char* rule_filename, char** files, int count) {
+    printf("Loading rules\n");
+    Rule* rules = load_rules(rule_filename);
+    if (!rules) return 1;
+    uint8_t window = max_pattern_lines(rules, rule_count);
+    /* No stats_init: the workers would share the counters, which are not
+       reported in batch mode anyway */
+
+    int result;
+    if (count == 1) {
+        result = split_file(jobs, files[0], window);
+    }
+    else {
+        FileList list;
+        list.files = files;
+        list.window = window;
+        list.failed = calloc(count, 1);
+        if (!list.failed) error(ERROR_OUT_OF_MEMORY, 0);
+        run_pool(jobs, count, file_task, &list);
+        result = 0;
+        for (int i = 0; i < count; ++i) {
+            if (list.failed[i]) result = 1;
+        }
+        free(list.failed);
+    }
+
+    free_strtbl();
+    free_rules(rules);
+    return result;
+}
+
+#endif //PLATFORM_POSIX
@@ -0,0 +1,18 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include "platform.h"
+
+#ifdef PLATFORM_POSIX
+
+#define MAX_JOBS 16
+
+/* -j N rulefile asmfile...
+   Load the rules once and optimize the files in place on up to `jobs`
+   threads. A single file is split into pieces that are optimized in
+   parallel and joined again. Returns 0 if every file was optimized. */
+int optimize_batch(int jobs, const char* rule_filename, char** files, int count);
+
+#endif
+
+#endif //BATCH_H_
@@ -0,0 +1,186 @@
+/*
+ * Benchmark harness: runs optimize() over each corpus file and prints
+ * one JSON document with, per file, the input line count, wall time,
+ * lines per second, rules tried and rewrites per line and peak heap.
+ *
+ *   zopt-bench <rulefile> <asmfile>...
+ *
+ * Built with -DRULE_STATS -DRULE_STATS_NO_CLOCK so the per-rule counters
+ * supply the tries and rewrites without timing every attempt, and linked
+ * with --wrap for malloc, calloc, realloc and free to track the heap.
+ * Keys and their order are fixed so results can be diffed between runs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <malloc.h>
+
+#include "platform.h"
+#include "dataarea.h"
+#include "fileio.h"
+#include "rules.h"
+#include "rulecache.h"
+#include "ruleindex.h"
+#include "rulestats.h"
+#include "optimizer.h"
+
+static size_t heap_current;
+static size_t heap_peak;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* p, size_t size);
+void __real_free(void* p);
+
+static void heap_add(void* p) {
+    if (!p) return;
+    heap_current += malloc_usable_size(p);
+    if (heap_current > heap_peak) heap_peak = heap_current;
+}
+
+void* __wrap_malloc(size_t size) {
+    void* p = __real_malloc(size);
+    heap_add(p);
+    return p;
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    void* p = __real_calloc(count, size);
+    heap_add(p);
+    return p;
+}
+
+void* __wrap_realloc(void* p, size_t size) {
+    size_t old = p ? malloc_usable_size(p) : 0;
+    void* q = __real_realloc(p, size);
+    if (q || size == 0) {
+        heap_current -= old;
+        heap_add(q);
+    }
+    return q;
+}
+
+void __wrap_free(void* p) {
+    if (p) heap_current -= malloc_usable_size(p);
+    __real_free(p);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long count_lines(const char* filename) {
+    int8_t fd = open_file(filename);
+    if (fd < 0) return 0;
+    char* buf = NULL;
+    linelen_t cap = 0;
+    linelen_t len;
+    unsigned long lines = 0;
+    while (read_line_grow(fd, &buf, &cap, &len) >= 0) ++lines;
+    close_file(fd);
+    free(buf);
+    return lines;
+}
+
+static void print_json_string(const char* s) {
+    putchar('"');
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Optimize one corpus into a scratch file; returns 0 on success. */
+static OptimizerContext ctx;
+
+static int bench_file(const char* filename, Rule* rules, uint8_t window, int first) {
+    unsigned long lines = count_lines(filename);
+    char* output = malloc(strlen(filename) + 5);
+    if (!output) return 1;
+    strcpy(output, filename);
+    strcat(output, ".out");
+
+    int8_t in_fd = open_file(filename);
+    int8_t out_fd = in_fd < 0 ? -1 : create_file(output);
+    if (in_fd < 0 || out_fd < 0) {
+        fprintf(stderr, "Error opening %s\n", in_fd < 0 ? filename : output);
+        if (in_fd >= 0) close_file(in_fd);
+        free(output);
+        return 1;
+    }
+
+    stats_init(rules, rule_count);
+    heap_peak = heap_current;
+    double start = now();
+    if (label_rules) {
+        int8_t scan_fd = open_file(filename);
+        if (scan_fd >= 0) scan_labels(&ctx, scan_fd);
+    }
+    int failed = optimize(&ctx, in_fd, out_fd, window) < 0;
+    if (close_file(out_fd) < 0) failed = 1;
+    double seconds = now() - start;
+    size_t peak = heap_peak;
+    close_file(in_fd);
+    delete_file(output);
+    if (failed) {
+        fprintf(stderr, "Error writing %s\n", output);
+        free(output);
+        stats_free();
+        free_context(&ctx);
+        return 1;
+    }
+    free(output);
+
+    unsigned long long tries = 0;
+    unsigned long long fires = 0;
+    for (int i = 0; i < rule_count; ++i) {
+        tries += rule_stats[i].tries;
+        fires += rule_stats[i].fires;
+    }
+    stats_free();
+    free_context(&ctx);
+
+    double per_line = lines ? 1.0 / lines : 0.0;
+    printf("%s    {\"corpus\": ", first ? "" : ",\n");
+    print_json_string(filename);
+    printf(", \"lines\": %lu, \"seconds\": %.6f, \"lines_per_sec\": %.0f, "
+        "\"rules_tried_per_line\": %.4f, \"rewrites_per_line\": %.4f, \"peak_heap_bytes\": %lu}",
+        lines, seconds, seconds > 0 ? lines / seconds : 0.0,
+        tries * per_line, fires * per_line, (unsigned long)peak);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: zopt-bench <rulefile> <asmfile>...\n");
+        return 1;
+    }
+    init_file_io();
+
+    Rule* rules = load_rules(argv[1]);
+    if (!rules) return 1;
+    uint8_t window = max_pattern_lines(rules, rule_count);
+
+    printf("{\n  \"rules\": ");
+    print_json_string(argv[1]);
+    printf(",\n  \"rule_count\": %d,\n  \"window\": %u,\n  \"results\": [\n", rule_count, (unsigned)window);
+
+    int result = 0;
+    int first = 1;
+    for (int i = 2; i < argc; ++i) {
+        if (bench_file(argv[i], rules, window, first) == 0) first = 0;
+        else result = 1;
+    }
+    printf("\n  ]\n}\n");
+
+    free_strtbl();
+    free_rules(rules);
+    index_free(&key_index);
+    index_free(&mnemonic_index);
+    return result;
+}
@@ -0,0 +1,208 @@
+/*
+ * Synthetic corpus generator for the benchmark.
+ *
+ * Writes about <lines> lines of Z80 assembly shaped like ZNC output:
+ * functions with an IX frame, expression evaluation through push hl /
+ * pop de, local and global loads and stores, byte arithmetic through
+ * ccsxt, comparisons, jp chains to labels, nextreg sequences, comments
+ * and ;#OPT_OFF blocks. The output depends only on the line count and
+ * the seed, so a corpus can be regenerated byte for byte.
+ *
+ *   zopt-gen <lines> [seed] > corpus.asm
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+static uint32_t rng_state;
+static unsigned long lines_out;
+static unsigned label;
+
+static uint32_t rng(void) {
+    /* xorshift32 */
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static unsigned pick(unsigned n) {
+    return rng() % n;
+}
+
+static void emit(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    putchar('\n');
+    ++lines_out;
+}
+
+static unsigned constant(void) {
+    static const unsigned common[] = { 0, 1, 1, 2, 8, 10, 255, 256, 9275, 65535 };
+    return pick(3) ? common[pick(10)] : pick(65536);
+}
+
+/* Leave a 16-bit operand in HL */
+static void operand(void) {
+    unsigned off = 2 + 2 * pick(16);
+    switch (pick(6)) {
+        case 0: emit("  ld hl,%u", constant()); break;
+        case 1: emit("  ld hl,(_g%u)", pick(40)); break;
+        case 2: emit("  ld l,(ix-%u)", off); emit("  ld h,(ix-%u)", off - 1); break;
+        case 3: emit("  ld a,(_b%u)", pick(40)); emit("  call ccsxt"); break;
+        case 4: emit("  ld hl,_arr%u", pick(8)); break;
+        default: emit("  ld l,(ix+%u)", off + 2); emit("  ld h,(ix+%u)", off + 3); break;
+    }
+}
+
+/* HL = HL <op> operand, the way a one-pass compiler evaluates it */
+static void binary(void) {
+    emit("  push hl");
+    operand();
+    emit("  pop de");
+    switch (pick(7)) {
+        case 0: case 1: emit("  add hl,de"); break;
+        case 2: emit("  ex de,hl"); emit("  xor a"); emit("  sbc hl,de"); break;
+        case 3: emit("  call ccmul"); break;
+        case 4: emit("  call cceq"); break;
+        case 5: emit("  call ccult"); break;
+        default: emit("  call ccne"); break;
+    }
+}
+
+static void store(void) {
+    unsigned off = 2 + 2 * pick(16);
+    switch (pick(4)) {
+        case 0: emit("  ld (_g%u),hl", pick(40)); break;
+        case 1: emit("  ld (ix-%u),l", off); emit("  ld (ix-%u),h", off - 1); break;
+        case 2: emit("  ld a,l"); emit("  ld (_b%u),a", pick(40)); break;
+        default: emit("  ex de,hl"); emit("  ld hl,(_p%u)", pick(8)); emit("  ld (hl),e"); emit("  inc hl"); emit("  ld (hl),d"); break;
+    }
+}
+
+static void statement(void) {
+    switch (pick(16)) {
+        case 0: case 1: case 2: case 3:
+            /* assignment of an expression */
+            operand();
+            for (unsigned n = pick(3); n; --n) binary();
+            store();
+            break;
+        case 4:
+            /* if (expr) ... */
+            operand();
+            binary();
+            emit("  ld a,h");
+            emit("  or l");
+            emit("  jp z,_L%u", label + 1 + pick(3));
+            break;
+        case 5:
+            /* jump chain: jp to the label that follows */
+            ++label;
+            emit("  jp _L%u", label);
+            emit("_L%u", label);
+            break;
+        case 6:
+            ++label;
+            emit("_L%u", label);
+            break;
+        case 7:
+            /* call with a pushed argument */
+            operand();
+            emit("  push hl");
+            emit("  call _fn%u", pick(64));
+            emit("  pop bc");
+            break;
+        case 8:
+            /* byte increment */
+            emit("  ld a,(_b%u)", pick(40));
+            emit("  call ccsxt");
+            emit("  push hl");
+            emit("  ld hl,1");
+            emit("  pop de");
+            emit("  add hl,de");
+            emit("  ld a,l");
+            emit("  ld (_b%u),a", pick(40));
+            break;
+        case 9:
+            /* nextreg n,v */
+            emit("  ld de,%u", pick(256));
+            emit("  ld hl,%u", pick(256));
+            emit("  ld bc,9275");
+            emit("  out (c),e");
+            emit("  inc b");
+            emit("  out (c),l");
+            break;
+        case 10:
+            emit("; line %lu", lines_out);
+            break;
+        case 11:
+            emit("  ld hl,0");
+            store();
+            break;
+        case 12:
+            /* loop variable increment */
+            emit("  ld hl,(_g%u)", pick(40));
+            emit("  push hl");
+            emit("  inc hl");
+            emit("  ld (_g%u),hl", pick(40));
+            emit("  pop hl");
+            emit("  jp _L%u", label + 1);
+            break;
+        case 13:
+            if (pick(4) == 0) {
+                /* inline assembly left alone by the optimizer */
+                emit(";#OPT_OFF");
+                emit("  push hl");
+                emit("  pop de");
+                emit("  ex de,hl");
+                emit(";#OPT_ON");
+            }
+            else {
+                emit("  defb %u,%u,%u,%u", pick(256), pick(256), pick(256), pick(256));
+            }
+            break;
+        case 14:
+            emit("  ld hl,%u", constant());
+            emit("  ld c,l");
+            emit("  ld b,h");
+            emit("  ld hl,%u", pick(256));
+            emit("  out (c),l");
+            break;
+        default:
+            operand();
+            emit("  ex de,hl");
+            emit("  ld a,l ; low byte");
+            break;
+    }
+}
+
+static void function(unsigned n) {
+    emit("_fn%u:", n);
+    emit("  push ix");
+    emit("  ld ix,0");
+    emit("  add ix,sp");
+    emit("  ld hl,-%u", 2 + 2 * pick(16));
+    emit("  add hl,sp");
+    emit("  ld sp,hl");
+    for (unsigned i = 8 + pick(40); i; --i) statement();
+    emit("  ld sp,ix");
+    emit("  pop ix");
+    emit("  ret");
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: zopt-gen <lines> [seed]\n");
+        return 1;
+    }
+    unsigned long lines = strtoul(argv[1], NULL, 10);
+    rng_state = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 1;
+    if (rng_state == 0) rng_state = 1;
+
+    for (unsigned n = 0; lines_out < lines; ++n) function(n);
+    return 0;
+}
@@ -7,8 +7,6 @@
 #include "platform.h"
 #include "dataarea.h"
 
-#define STR_TBL_SIZE 509
-
 const char* errmsg[] = {
     "OK",
     "File not found",
@@ -22,18 +20,14 @@ const char* errmsg[] = {
     "Multi-line constraint not supported",
 };
 
-char line[MAX_LINE_LENGTH];
-char tmp_line1[MAX_LINE_LENGTH * 2];
-char tmp_line2[MAX_LINE_LENGTH];
-char output_filename[MAX_LINE_LENGTH];
-char window[MAX_WINDOW_SIZE][MAX_LINE_LENGTH];
+char output_filename[MAX_PATH_LENGTH];
 
-typedef struct HNode {
-    char* str;
-    struct HNode* next;
-} HNode;
+/* Arena block header; the string bytes follow it */
+typedef struct StrBlock {
+    struct StrBlock* next;
+} StrBlock;
 
-HNode* strtbl[STR_TBL_SIZE] = { 0 };
+StringTable strtbl;
 
 char* trim(char* s) {
     char* end = s + strlen(s) - 1;
@@ -47,50 +41,146 @@ char* trim(char* s) {
     return s;
 }
 
-char* hash(const char* s) {
-    /* FNV-1a: good distribution with cheap Z80-friendly ops */
-    uint16_t h = 2166U;
-    const char* p = s;
-    while (*p) {
-        h ^= (uint8_t)*p++;
-        h += (h << 1) + (h << 4);   /* approx * 19, avoids true multiply */
+/* FNV-1a with a final avalanche so the low bits, which pick the slot,
+   depend on every character. The Next build uses a 16-bit variant. */
+strhash_t hash_string(const char* s, uint16_t len) {
+    const char* end = s + len;
+#ifdef PLATFORM_POSIX
+    uint32_t h = 2166136261U;
+    while (s < end) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619U;
+    }
+    h ^= h >> 15;
+    h *= 0x2C1B3C6DU;
+    h ^= h >> 12;
+#else
+    uint16_t h = 0x811CU;
+    while (s < end) {
+        h ^= (uint8_t)*s++;
+        h *= 0x0193U;
+    }
+    h ^= h >> 7;
+    h *= 0x2B5BU;
+    h ^= h >> 9;
+#endif
+    return h;
+}
+
+/* Slot holding `s`, or the empty slot where it would go */
+static StrSlot* find_slot(StringTable* t, const char* s, uint16_t len, strhash_t h) {
+    size_t mask = t->capacity - 1;
+    size_t i = h & mask;
+    for (;;) {
+        StrSlot* slot = &t->slots[i];
+        if (!slot->str) return slot;
+        if (slot->hash == h && strncmp(s, slot->str, len) == 0 && slot->str[len] == '\0')
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static void grow_slots(StringTable* t) {
+    size_t capacity = t->capacity ? t->capacity * 2 : STR_TBL_MIN_SLOTS;
+    StrSlot* slots = calloc(capacity, sizeof(StrSlot));
+    if (!slots) exit(1);
+    for (size_t i = 0; i < t->capacity; ++i) {
+        StrSlot* old = &t->slots[i];
+        if (!old->str) continue;
+        size_t j = old->hash & (capacity - 1);
+        while (slots[j].str) j = (j + 1) & (capacity - 1);
+        slots[j] = *old;
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->capacity = capacity;
+}
+
+/* Find `s` or claim a slot for it, growing the table first if the new
+   entry would take it past 3/4 load. */
+static StrSlot* claim_slot(StringTable* t, const char* s, uint16_t len, strhash_t h) {
+    if (t->capacity) {
+        StrSlot* slot = find_slot(t, s, len, h);
+        if (slot->str || (t->count + 1) * 4 <= t->capacity * 3) return slot;
     }
-    h %= STR_TBL_SIZE;
-
-    HNode* entry = strtbl[h];
-    while (entry) {
-        if (strcmp(s, entry->str) == 0) {
-            return entry->str;
-        }
-        entry = entry->next;
+    grow_slots(t);
+    return find_slot(t, s, len, h);
+}
+
+/* Bump allocate `size` bytes. A string too long for a block gets a block
+   of its own. */
+static char* arena_alloc(StringTable* t, size_t size) {
+    if (size > t->arena_left) {
+        size_t block = size > STR_BLOCK_SIZE ? size : STR_BLOCK_SIZE;
+        StrBlock* b = malloc(sizeof(StrBlock) + block);
+        if (!b) exit(1);
+        b->next = t->blocks;
+        t->blocks = b;
+        t->arena = (char*)(b + 1);
+        t->arena_left = block;
     }
+    char* p = t->arena;
+    t->arena += size;
+    t->arena_left -= size;
+    return p;
+}
+
+char* hash(const char* s) {
+    return hash_n(s, strlen(s));
+}
 
-    entry = malloc(sizeof(HNode));
-    if (!entry) exit(1);
+/* Intern the first `len` characters of `s`; `s` need not be terminated. */
+char* hash_n(const char* s, uint16_t len) {
+    return table_intern(&strtbl, s, len);
+}
 
-    entry->str = malloc(strlen(s) + 1);
-    if (!entry->str) exit(1);
+/* The interned copy of the first `len` characters of `s`, or NULL if there
+   is none. Never adds to the table, so it is safe while optimizing. */
+char* hash_find(const char* s, uint16_t len) {
+    if (!strtbl.capacity) return NULL;
+    return find_slot(&strtbl, s, len, hash_string(s, len))->str;
+}
 
-    entry->next = strtbl[h];
-    strtbl[h] = entry;
+char* table_intern(StringTable* t, const char* s, uint16_t len) {
+    strhash_t h = hash_string(s, len);
+    StrSlot* slot = claim_slot(t, s, len, h);
+    if (slot->str) return slot->str;
+
+    char* str = arena_alloc(t, len + 1);
+    memcpy(str, s, len);
+    str[len] = '\0';
+    slot->str = str;
+    slot->hash = h;
+    ++t->count;
+    return str;
+}
 
-    strcpy(entry->str, s);
-    return entry->str;
+/* Intern a string that lives outside the table (e.g. in a loaded rule
+   image). The table references it in place and never frees it. */
+char* hash_static(char* s) {
+    uint16_t len = strlen(s);
+    strhash_t h = hash_string(s, len);
+    StrSlot* slot = claim_slot(&strtbl, s, len, h);
+    if (slot->str) return slot->str;
+    slot->str = s;
+    slot->hash = h;
+    ++strtbl.count;
+    return s;
 }
 
 void free_strtbl(void) {
-    int size = 0;
-    for (int i = 0; i < STR_TBL_SIZE; ++i) {
-        HNode* p = strtbl[i];
-        while (p) {
-            size += strlen(p->str) + 1;
-            HNode* n = p->next;
-            free(p->str);
-            free(p);
-            p = n;
-        }
-        strtbl[i] = NULL;
+    table_free(&strtbl);
+}
+
+void table_free(StringTable* t) {
+    StrBlock* b = t->blocks;
+    while (b) {
+        StrBlock* next = b->next;
+        free(b);
+        b = next;
     }
+    free(t->slots);
+    memset(t, 0, sizeof(StringTable));
 }
 
 void error(ErrorType e, int lineno) {
@@ -1,8 +1,77 @@
 #ifndef DATAAREA_H_
 #define DATAAREA_H_
 
-#define MAX_LINE_LENGTH 128
-#define MAX_WINDOW_SIZE 15
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fileio.h"
+
+/* Lines have no length limit, in the input or in the rules. A line of up
+   to MAX_LITERAL_LINE characters, spaces left out, is also compared by its
+   interned copy (see LineSig); longer ones always go through the segment
+   matcher. */
+#define MAX_LITERAL_LINE 128
+/* Pattern and replacement lines of one rule, as counted in a uint8_t */
+#define MAX_RULE_LINES 255
+#define MAX_PATH_LENGTH 128
+
+/* The optimization window is a ring of line slots. Logical line i lives in
+   slot (window_head + i) & window_mask, so emitting the first line or
+   replacing the matched lines only moves window_head. optimize() sizes
+   the ring from the loaded rules, to a power of two of at least
+   WINDOW_MIN_SLOTS that holds a full window with the longest replacement
+   in front of it.
+
+   A slot does not hold text itself. Each slot owns a growable input buffer
+   that lines are read into directly, and `text`/`len` view either that
+   buffer or replacement text built in the optimizer's replacement arena.
+   Either way the text is NUL terminated. The ring belongs to an
+   OptimizerContext (optimizer.h).
+
+   A line is parsed once as it enters the window and its signature is
+   kept with it. The first time it heads the window its mnemonic id
+   (opcodes.h) and the two index chains it selects are worked out and
+   kept as well, so the rule loop never scans the text again to find its
+   candidates. While it heads the window, the rules whose first pattern
+   line fails on it are remembered, so that they are not tried again
+   after a rewrite further down the window, nor after one that begins its
+   replacement with the same line. The registers the line reads and writes (liveness.h) are
+   worked out the first time a `dead` constraint looks past a match. */
+#define WINDOW_MIN_SLOTS 32
+#define WINDOW_LINE(ctx, i) (&(ctx)->window[((ctx)->window_head + (i)) & (ctx)->window_mask])
+
+/* Prefilter signature of a line, compared before any string matching.
+   For an input line `mask` has SIG_BIT set for every character other
+   than a space, `len` counts those characters, `lit` is the interned
+   copy of the line with its spaces removed, if it is no longer than
+   MAX_LITERAL_LINE and the rule strings contain one. For a pattern line
+   the same fields describe what a matching line must contain (see
+   match_rule). */
+#define SIG_BIT(c) ((uint32_t)1 << ((uint8_t)(c) & 31))
+
+typedef struct LineSig {
+    uint32_t mask;
+    uint16_t len;
+    const char* lit;
+} LineSig;
+
+typedef struct WindowLine {
+    char* text;
+    linelen_t len;
+    LineSig sig;
+    uint8_t indexed;                /* the fields below are set */
+    uint8_t mnem;                   /* id of the first word */
+    struct RuleNode* key_rules;     /* chain in key_index */
+    struct RuleNode* mnem_rules;    /* chain in mnemonic_index */
+    uint8_t memo;                   /* the context's no_match is this line's */
+    uint8_t effect_known;           /* regs_used and regs_set are set */
+    uint16_t regs_used;
+    uint16_t regs_set;
+    char* buf;
+    linelen_t cap;
+    uint32_t lineno;    /* input line of the text, from 0; a replacement
+                           line has that of the line its match began at */
+} WindowLine;
 
 typedef enum ErrorType {
     ERROR_NONE,
@@ -17,15 +86,49 @@ typedef enum ErrorType {
     ERROR_MULTILINE_CONSTRAINT,
 } ErrorType;
 
-extern char line[];
-extern char tmp_line1[];
-extern char tmp_line2[];
 extern char output_filename[];
-extern char window[][MAX_LINE_LENGTH];
+
+/* String interner. The global table holds the rule strings and is only
+   read while optimizing; table_intern builds other tables the same way.
+
+   Open addressing with linear probing over a power-of-two slot array that
+   doubles at 3/4 load. Each slot keeps the full hash, so a probe only
+   compares strings whose hashes match and growing never rehashes text.
+   The string bytes are bump allocated from a chain of blocks, so freeing
+   a table costs one free per block rather than per string. A zeroed
+   table is empty. */
+#ifdef PLATFORM_POSIX
+typedef uint32_t strhash_t;
+#define STR_BLOCK_SIZE 16384
+#else
+typedef uint16_t strhash_t;
+#define STR_BLOCK_SIZE 512
+#endif
+#define STR_TBL_MIN_SLOTS 64
+
+typedef struct StrSlot {
+    char* str;
+    strhash_t hash;
+} StrSlot;
+
+typedef struct StringTable {
+    StrSlot* slots;
+    size_t capacity;        /* slot count, a power of two (0 when empty) */
+    size_t count;
+    struct StrBlock* blocks;
+    char* arena;            /* free bytes in blocks, the newest block */
+    size_t arena_left;
+} StringTable;
 
 char* trim(char* s);
+strhash_t hash_string(const char* s, uint16_t len);
 char* hash(const char* s);
+char* hash_n(const char* s, uint16_t len);
+char* hash_find(const char* s, uint16_t len);
+char* hash_static(char* s);
 void free_strtbl(void);
+char* table_intern(StringTable* t, const char* s, uint16_t len);
+void table_free(StringTable* t);
 
 void error(ErrorType e, int lineno);
 
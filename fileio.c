@@ -1,13 +1,18 @@
+#include "platform.h"
+
+#ifdef PLATFORM_ZXN
+
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <z80.h>
 #include <arch/zxn.h>
 #include <arch/zxn/esxdos.h>
 #include <errno.h>
 
-#include "platform.h"
 #include "fileio.h"
+#include "dataarea.h"
 
 #define MAX_BUFFER_SIZE 128
 #define MAX_FILES 3
@@ -106,6 +111,42 @@ int16_t read_line(int8_t f, char* buf, int16_t size) MYCC {
     return count;
 }
 
+int8_t read_line_grow(int8_t f, char** buf, linelen_t* cap, linelen_t* len) MYCC {
+    zx_border(1);
+    FileInfo* fi = &files[f];
+    linelen_t count = 0;
+    int8_t result = 0;
+    while (1) {
+        int16_t ch = read_char(fi);
+        if (ch < 0) {
+            if (!count) result = -1;
+            break;
+        }
+        if (ch == '\r' || ch == '\n') {
+            int16_t ch2 = peek_char(fi);
+            if (ch == '\r' && ch2 == '\n') read_char(fi);
+            break;
+        }
+        if (count + 1 >= *cap) {
+            linelen_t newcap = *cap ? *cap * 2 : 64;
+            char* p = realloc(*buf, newcap);
+            if (p == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+            *buf = p;
+            *cap = newcap;
+        }
+        (*buf)[count++] = (char)ch;
+    }
+    if (*buf == NULL) {
+        *buf = malloc(64);
+        if (*buf == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+        *cap = 64;
+    }
+    (*buf)[count] = '\0';
+    *len = count;
+    zx_border(0);
+    return result;
+}
+
 int16_t flush_write_buffer(FileInfo *fi) MYCC {
     errno = 0;
     int16_t byteswritten = esxdos_f_write(fi->handle, fi->writebuf, fi->w_offset);
@@ -122,30 +163,77 @@ uint16_t write_byte(FileInfo *fi, uint8_t b) MYCC {
     return 1;
 }
 
-int16_t write_line(int8_t f, char *buf, int16_t size) MYCC {
+int8_t write_line(int8_t f, char *buf, linelen_t size) MYCC {
     zx_border(1);
     FileInfo *fi = &files[f]; 
-    int16_t byteswritten = 0;
-    int8_t write_count;
-    for(int16_t i=0; i<size; ++i) {
-        write_count = write_byte(fi, buf[i]);
-        if (write_count == -1) return -1;
-        byteswritten += write_count;
+    for(linelen_t i=0; i<size; ++i) {
+        if (write_byte(fi, buf[i]) == (uint16_t)-1) return -1;
     }
-    write_count = write_byte(fi, '\n');
-    if (write_count == -1) return -1;
+    if (write_byte(fi, '\n') == (uint16_t)-1) return -1;
     zx_border(0);
-    return byteswritten;
+    return 0;
 }
 
-void close_file(int8_t f) MYCC {
+int8_t close_file(int8_t f) MYCC {
     FileInfo *fi = &files[f]; 
-    flush_write_buffer(fi);
+    int8_t result = fi->w_offset && flush_write_buffer(fi) == -1 ? -1 : 0;
+    errno = 0;
     esxdos_f_close(fi->handle);
+    if (errno != 0) result = -1;
     fi->handle = 255;
     fi->r_offset = MAX_BUFFER_SIZE;
     fi->w_offset = 0;
     fi->r_bytes = 0;
+    return result;
+}
+
+int16_t write_block(int8_t f, const void* buf, uint16_t size) MYCC {
+    FileInfo *fi = &files[f];
+    if (flush_write_buffer(fi) == -1) return -1;
+    errno = 0;
+    int16_t byteswritten = esxdos_f_write(fi->handle, (void*)buf, size);
+    if (errno != 0) return -1;
+    return byteswritten;
+}
+
+uint32_t file_timestamp(const char* filename) MYCC {
+    struct esx_stat st;
+    errno = 0;
+    esx_f_stat(filename, &st);
+    if (errno) return 0;
+    return ((uint32_t)st.time.date << 16) | st.time.time;
+}
+
+uint32_t file_size(const char* filename) MYCC {
+    struct esx_stat st;
+    errno = 0;
+    esx_f_stat(filename, &st);
+    if (errno) return 0;
+    return st.size;
+}
+
+void* load_file(const char* filename, uint32_t* size) MYCC {
+    struct esx_stat st;
+    errno = 0;
+    uint8_t handle = esx_f_open(filename, ESXDOS_MODE_R | ESXDOS_MODE_OE);
+    if (errno) return NULL;
+    void* data = NULL;
+    esx_f_fstat(handle, &st);
+    if (!errno && st.size && st.size < 0xC000) {
+        data = malloc((uint16_t)st.size);
+        if (data && esxdos_f_read(handle, data, (uint16_t)st.size) != (uint16_t)st.size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    esxdos_f_close(handle);
+    *size = st.size;
+    return data;
+}
+
+void unload_file(void* data, uint32_t size) MYCC {
+    (void)size;
+    free(data);
 }
 
 void delete_file(const char* filename) MYCC {
@@ -156,3 +244,4 @@ void rename_file(const char* origname, const char* newname) MYCC {
     esx_f_rename(origname, newname);
 }
 
+#endif //PLATFORM_ZXN
@@ -3,16 +3,63 @@
 
 #include <stdint.h>
 
+#include "platform.h"
+
 #ifndef _strdup
 #define _strdup strdup
 #endif
 
+/* Length of a line held in a growable buffer. 16 bits is plenty on the
+   Next; host builds accept lines of any practical size. */
+#ifdef PLATFORM_ZXN
+typedef uint16_t linelen_t;
+#else
+typedef uint32_t linelen_t;
+#endif
+
 void init_file_io(void) MYCC;
 int8_t open_file(const char *filename) MYCC;
 int8_t create_file(const char *filename) MYCC;
 int16_t read_line(int8_t f, char *buf, int16_t size) MYCC;
-int16_t write_line(int8_t f, char *buf, int16_t size) MYCC;
-void close_file(int8_t f) MYCC;
+/* Returns 0, or -1 when the line could not be written */
+int8_t write_line(int8_t f, char *buf, linelen_t size) MYCC;
+
+/* Read a whole line into *buf, growing it with realloc as needed; *cap
+   holds the allocated size. The line is NUL terminated and its length
+   stored in *len. Returns -1 at end of file, 0 otherwise. */
+int8_t read_line_grow(int8_t f, char** buf, linelen_t* cap, linelen_t* len) MYCC;
+/* Flushes what is still buffered for writing. Returns 0, or -1 when that
+   or closing the file failed, so the output is incomplete. */
+int8_t close_file(int8_t f) MYCC;
+int16_t write_block(int8_t f, const void* buf, uint16_t size) MYCC;
+
+/* Whole-file helpers used for binary images. file_timestamp returns 0 if
+   the file does not exist; larger values are newer. file_size returns 0
+   for a missing file too. load_file returns a writable copy of the file
+   contents (mapped on the host) which must be released with unload_file. */
+uint32_t file_timestamp(const char* filename) MYCC;
+uint32_t file_size(const char* filename) MYCC;
+void* load_file(const char* filename, uint32_t* size) MYCC;
+void unload_file(void* data, uint32_t size) MYCC;
+
+#ifdef PLATFORM_POSIX
+/* Open `length` bytes of a file starting at byte `start`; reads past the
+   range behave as end of file. */
+int8_t open_file_range(const char* filename, uint32_t start, uint32_t length);
+
+/* Streams for pipeline use. open_stdout also sends later printf output
+   to stderr. */
+int8_t open_stdin(void);
+int8_t open_stdout(void);
+
+/* In-memory streams for the embedding API (zopt.h). open_memory reads
+   `size` bytes at `data`, which must stay valid until the handle is
+   closed. open_writer hands the buffered output to `fn` a block at a time
+   and on close; `fn` returns a negative value to report an error. */
+typedef int (*WriteFn)(void* data, const char* buf, uint32_t size);
+int8_t open_memory(const char* data, uint32_t size);
+int8_t open_writer(WriteFn fn, void* data);
+#endif
 
 void delete_file(const char* filename) MYCC;
 void rename_file(const char* origname, const char* newname) MYCC;
@@ -0,0 +1,371 @@
+#include "platform.h"
+
+#ifdef PLATFORM_POSIX
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fileio.h"
+#include "dataarea.h"
+
+/* Host builds read and write through large buffers so multi-megabyte
+   .asm files stream at disk speed. Override with -DFILEIO_BUFFER_SIZE=n.
+   The buffers are allocated when a file is opened, so the handle table
+   can be sized for the batch mode's worker threads, each of which keeps
+   two files open. Only taking and returning a slot is locked; a handle is
+   used by one thread at a time. */
+#ifndef FILEIO_BUFFER_SIZE
+#define FILEIO_BUFFER_SIZE (64 * 1024)
+#endif
+#define MAX_FILES 40
+
+/* Slot handle of open_memory and open_writer streams; -1 marks a free slot */
+#define MEMORY_HANDLE -2
+
+typedef struct FileInfo {
+    char* readbuf;
+    char* writebuf;
+    int handle;
+    size_t r_offset;
+    size_t w_offset;
+    size_t r_bytes;
+    size_t r_limit;     /* bytes left to read, see open_file_range */
+    WriteFn write_fn;   /* open_writer: takes each full write buffer */
+    void* write_data;
+} FileInfo;
+
+static FileInfo files[MAX_FILES];
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_file_io(void) MYCC {
+    for (int8_t i = 0; i < MAX_FILES; ++i) {
+        files[i].readbuf = NULL;
+        files[i].writebuf = NULL;
+        files[i].handle = -1;
+        files[i].r_offset = 0;
+        files[i].w_offset = 0;
+        files[i].r_bytes = 0;
+        files[i].write_fn = NULL;
+    }
+}
+
+static int8_t find_free_slot(void) {
+    for (int8_t i = 0; i < MAX_FILES; ++i) {
+        if (files[i].handle == -1) return i;
+    }
+    return -1;
+}
+
+static int8_t take_slot(int handle) {
+    pthread_mutex_lock(&files_lock);
+    int8_t fh = find_free_slot();
+    if (fh >= 0) files[fh].handle = handle;
+    pthread_mutex_unlock(&files_lock);
+    return fh;
+}
+
+static ssize_t read_buffer(FileInfo* fi) {
+    size_t want = fi->r_limit < FILEIO_BUFFER_SIZE ? fi->r_limit : FILEIO_BUFFER_SIZE;
+    ssize_t n = 0;
+    if (want) {
+        do {
+            n = read(fi->handle, fi->readbuf, want);
+        } while (n < 0 && errno == EINTR);
+    }
+    fi->r_offset = 0;
+    fi->r_bytes = n > 0 ? (size_t)n : 0;
+    fi->r_limit -= fi->r_bytes;
+    return n;
+}
+
+/* Give an open descriptor a slot; the slot owns it from here on. */
+static int8_t attach_handle(int handle) {
+    char* bufs = malloc(2 * FILEIO_BUFFER_SIZE);
+    int8_t fh = bufs ? take_slot(handle) : -1;
+    if (fh < 0) {
+        free(bufs);
+        close(handle);
+        return -1;
+    }
+    FileInfo* fi = &files[fh];
+    fi->readbuf = bufs;
+    fi->writebuf = bufs + FILEIO_BUFFER_SIZE;
+    fi->r_offset = 0;
+    fi->w_offset = 0;
+    fi->r_bytes = 0;
+    fi->r_limit = SIZE_MAX;
+    fi->write_fn = NULL;
+    return fh;
+}
+
+static int8_t internal_open_file(const char* filename, int flags) {
+    int handle = open(filename, flags, 0644);
+    if (handle < 0) return -1;
+    return attach_handle(handle);
+}
+
+int8_t open_file(const char* filename) MYCC {
+    return internal_open_file(filename, O_RDONLY);
+}
+
+int8_t open_file_range(const char* filename, uint32_t start, uint32_t length) {
+    int8_t fh = internal_open_file(filename, O_RDONLY);
+    if (fh < 0) return -1;
+    if (lseek(files[fh].handle, (off_t)start, SEEK_SET) < 0) {
+        close_file(fh);
+        return -1;
+    }
+    files[fh].r_limit = length;
+    return fh;
+}
+
+int8_t create_file(const char* filename) MYCC {
+    return internal_open_file(filename, O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+int8_t open_stdin(void) {
+    int handle = dup(STDIN_FILENO);
+    return handle < 0 ? -1 : attach_handle(handle);
+}
+
+/* The output keeps the original stdout; descriptor 1 is pointed at
+   stderr so that messages printed from then on stay out of the stream. */
+int8_t open_stdout(void) {
+    fflush(stdout);
+    int handle = dup(STDOUT_FILENO);
+    if (handle < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) return -1;
+    return attach_handle(handle);
+}
+
+/* The caller's buffer stands in for the read buffer, so reads copy
+   straight out of it and the first refill reports end of file. */
+int8_t open_memory(const char* data, uint32_t size) {
+    int8_t fh = take_slot(MEMORY_HANDLE);
+    if (fh < 0) return -1;
+    FileInfo* fi = &files[fh];
+    fi->readbuf = (char*)data;
+    fi->writebuf = NULL;
+    fi->r_offset = 0;
+    fi->w_offset = 0;
+    fi->r_bytes = size;
+    fi->r_limit = 0;
+    fi->write_fn = NULL;
+    return fh;
+}
+
+int8_t open_writer(WriteFn fn, void* data) {
+    char* buf = malloc(FILEIO_BUFFER_SIZE);
+    int8_t fh = buf ? take_slot(MEMORY_HANDLE) : -1;
+    if (fh < 0) {
+        free(buf);
+        return -1;
+    }
+    FileInfo* fi = &files[fh];
+    fi->readbuf = NULL;
+    fi->writebuf = buf;
+    fi->r_offset = 0;
+    fi->w_offset = 0;
+    fi->r_bytes = 0;
+    fi->r_limit = 0;
+    fi->write_fn = fn;
+    fi->write_data = data;
+    return fh;
+}
+
+static int16_t peek_char(FileInfo* fi) {
+    if (fi->r_offset >= fi->r_bytes) {
+        if (read_buffer(fi) <= 0) return -1;
+    }
+    return (uint8_t)fi->readbuf[fi->r_offset];
+}
+
+/* Same contract as the esxDOS backend: at most `size` characters are
+   stored, "\n", "\r" and "\r\n" all terminate a line, and -1 is returned
+   only when end of file is reached before any character was read. The
+   copy loop runs directly over the read buffer and only drops out to
+   refill it. */
+int16_t read_line(int8_t f, char* buf, int16_t size) MYCC {
+    FileInfo* fi = &files[f];
+    int16_t count = 0;
+    while (count < size) {
+        if (fi->r_offset >= fi->r_bytes) {
+            if (read_buffer(fi) <= 0) {
+                if (!count) count = -1;
+                break;
+            }
+        }
+        const char* p = fi->readbuf + fi->r_offset;
+        const char* end = fi->readbuf + fi->r_bytes;
+        if (end - p > size - count) end = p + (size - count);
+        while (p < end && *p != '\n' && *p != '\r') *buf++ = *p++;
+        count += (int16_t)(p - (fi->readbuf + fi->r_offset));
+        fi->r_offset = (size_t)(p - fi->readbuf);
+        if (p < end) {
+            ++fi->r_offset;
+            if (*p == '\r' && peek_char(fi) == '\n') ++fi->r_offset;
+            break;
+        }
+    }
+    *buf = '\0';
+    return count;
+}
+
+static void grow_line(char** buf, linelen_t* cap, size_t need) {
+    if (need <= *cap) return;
+    size_t newcap = *cap ? *cap : 128;
+    while (newcap < need) newcap *= 2;
+    char* p = realloc(*buf, newcap);
+    if (p == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    *buf = p;
+    *cap = (linelen_t)newcap;
+}
+
+/* Unbounded variant of read_line: each run of line characters in the read
+   buffer is copied with a single memcpy. */
+int8_t read_line_grow(int8_t f, char** buf, linelen_t* cap, linelen_t* len) MYCC {
+    FileInfo* fi = &files[f];
+    size_t count = 0;
+    int8_t result = -1;
+    while (1) {
+        if (fi->r_offset >= fi->r_bytes) {
+            if (read_buffer(fi) <= 0) break;
+        }
+        result = 0;
+        const char* start = fi->readbuf + fi->r_offset;
+        const char* end = fi->readbuf + fi->r_bytes;
+        const char* p = start;
+        while (p < end && *p != '\n' && *p != '\r') ++p;
+        size_t n = (size_t)(p - start);
+        grow_line(buf, cap, count + n + 1);
+        memcpy(*buf + count, start, n);
+        count += n;
+        fi->r_offset += n;
+        if (p < end) {
+            ++fi->r_offset;
+            if (*p == '\r' && peek_char(fi) == '\n') ++fi->r_offset;
+            break;
+        }
+    }
+    grow_line(buf, cap, count + 1);
+    (*buf)[count] = '\0';
+    *len = (linelen_t)count;
+    return result;
+}
+
+static int flush_write_buffer(FileInfo* fi) {
+    if (fi->write_fn) {
+        if (fi->w_offset && fi->write_fn(fi->write_data, fi->writebuf, (uint32_t)fi->w_offset) < 0) return -1;
+        fi->w_offset = 0;
+        return 0;
+    }
+    size_t done = 0;
+    while (done < fi->w_offset) {
+        ssize_t n = write(fi->handle, fi->writebuf + done, fi->w_offset - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    fi->w_offset = 0;
+    return 0;
+}
+
+static int write_bytes(FileInfo* fi, const char* buf, size_t size) {
+    while (size) {
+        if (fi->w_offset == FILEIO_BUFFER_SIZE) {
+            if (flush_write_buffer(fi) < 0) return -1;
+        }
+        size_t room = FILEIO_BUFFER_SIZE - fi->w_offset;
+        size_t chunk = size < room ? size : room;
+        memcpy(fi->writebuf + fi->w_offset, buf, chunk);
+        fi->w_offset += chunk;
+        buf += chunk;
+        size -= chunk;
+    }
+    return 0;
+}
+
+int8_t write_line(int8_t f, char* buf, linelen_t size) MYCC {
+    FileInfo* fi = &files[f];
+    if (write_bytes(fi, buf, (size_t)size) < 0) return -1;
+    if (write_bytes(fi, "\n", 1) < 0) return -1;
+    return 0;
+}
+
+int8_t close_file(int8_t f) MYCC {
+    FileInfo* fi = &files[f];
+    int8_t result = flush_write_buffer(fi) < 0 ? -1 : 0;
+    if (fi->handle >= 0) {
+        if (close(fi->handle) != 0) result = -1;
+        free(fi->readbuf);
+    }
+    else if (fi->write_fn) {
+        free(fi->writebuf);
+        fi->write_fn = NULL;
+    }
+    fi->readbuf = NULL;
+    fi->writebuf = NULL;
+    fi->r_offset = 0;
+    fi->w_offset = 0;
+    fi->r_bytes = 0;
+    pthread_mutex_lock(&files_lock);
+    fi->handle = -1;
+    pthread_mutex_unlock(&files_lock);
+    return result;
+}
+
+int16_t write_block(int8_t f, const void* buf, uint16_t size) MYCC {
+    if (write_bytes(&files[f], (const char*)buf, size) < 0) return -1;
+    return (int16_t)size;
+}
+
+uint32_t file_timestamp(const char* filename) MYCC {
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+    return (uint32_t)st.st_mtime;
+}
+
+uint32_t file_size(const char* filename) MYCC {
+    struct stat st;
+    if (stat(filename, &st) != 0) return 0;
+    return (uint32_t)st.st_size;
+}
+
+/* The image is mapped copy-on-write so the loader can patch pointers in
+   place without touching the file on disk. */
+void* load_file(const char* filename, uint32_t* size) MYCC {
+    struct stat st;
+    int handle = open(filename, O_RDONLY);
+    if (handle < 0) return NULL;
+    void* data = NULL;
+    if (fstat(handle, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, handle, 0);
+        if (data == MAP_FAILED) data = NULL;
+        *size = (uint32_t)st.st_size;
+    }
+    close(handle);
+    return data;
+}
+
+void unload_file(void* data, uint32_t size) MYCC {
+    if (data) munmap(data, size);
+}
+
+void delete_file(const char* filename) MYCC {
+    unlink(filename);
+}
+
+void rename_file(const char* origname, const char* newname) MYCC {
+    rename(origname, newname);
+}
+
+#endif //PLATFORM_POSIX
@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include "platform.h"
+#include "dataarea.h"
+#include "fileio.h"
+#include "optimizer.h"
+#include "liveness.h"
+#include "opcodes.h"
+#include "labels.h"
+
+#define LABEL_MIN_SLOTS 256
+/* Labels defined at one spot that get its jump or return noted; more
+   than that is unheard of, and the extra ones just go without */
+#define LABEL_PENDING 8
+
+/* Character classes of the scanner, looked up in char_class rather than
+   through <ctype.h>, as the pre-pass looks at every input character */
+#define CC_NAME_START 1     /* letter, '_', '.' */
+#define CC_NAME 2           /* the above and digits */
+#define CC_TOKEN 4          /* the above and '$' */
+
+static const uint8_t char_class[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 7, 0,
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 0, 0,
+    0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 0, 7,
+    0, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+#define IS_BLANK(c) ((c) == ' ' || (c) == '\t')
+#define IS_NAME_START(c) (char_class[(uint8_t)(c)] & CC_NAME_START)
+#define IS_NAME_CHAR(c) (char_class[(uint8_t)(c)] & CC_NAME)
+#define IS_TOKEN_CHAR(c) (char_class[(uint8_t)(c)] & CC_TOKEN)
+
+struct LabelBlock {
+    struct LabelBlock* next;
+    Label labels[LABEL_BLOCK];
+};
+
+/* Label names are bump allocated from blocks of text */
+#define LABEL_TEXT_BLOCK 8192
+
+struct LabelText {
+    struct LabelText* next;
+    char text[1];
+};
+
+static const char* store_name(LabelTable* t, const char* s, uint16_t len) {
+    if (t->text_left < (size_t)len + 1) {
+        size_t size = len + 1 > LABEL_TEXT_BLOCK ? len + 1 : LABEL_TEXT_BLOCK;
+        struct LabelText* b = malloc(sizeof(struct LabelText) + size);
+        if (b == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+        b->next = t->texts;
+        t->texts = b;
+        t->text = b->text;
+        t->text_left = size;
+    }
+    char* name = t->text;
+    memcpy(name, s, len);
+    name[len] = '\0';
+    t->text += len + 1;
+    t->text_left -= len + 1;
+    return name;
+}
+
+/* Slot holding the name, or the empty slot where it would go */
+static Label** find_slot(const LabelTable* t, const char* s, uint16_t len, strhash_t h) {
+    size_t mask = t->capacity - 1;
+    for (size_t i = h & mask;; i = (i + 1) & mask) {
+        Label* l = t->slots[i];
+        if (l == NULL) return &t->slots[i];
+        if (l->hash == h && l->len == len && memcmp(l->name, s, len) == 0) return &t->slots[i];
+    }
+}
+
+static void grow(LabelTable* t) {
+    size_t capacity = t->capacity ? t->capacity * 2 : LABEL_MIN_SLOTS;
+    Label** old = t->slots;
+    size_t old_capacity = t->capacity;
+    t->slots = calloc(capacity, sizeof(Label*));
+    if (t->slots == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    t->capacity = capacity;
+    for (size_t i = 0; i < old_capacity; ++i) {
+        Label* l = old[i];
+        if (l) *find_slot(t, l->name, l->len, l->hash) = l;
+    }
+    free(old);
+}
+
+static Label* label_add(LabelTable* t, const char* s, uint16_t len) {
+    if ((t->count + 1) * 4 > t->capacity * 3) grow(t);
+    strhash_t h = hash_string(s, len);
+    Label** slot = find_slot(t, s, len, h);
+    if (*slot) return *slot;
+
+    if (t->blocks == NULL || t->block_used == LABEL_BLOCK) {
+        struct LabelBlock* b = malloc(sizeof(struct LabelBlock));
+        if (b == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+        b->next = t->blocks;
+        t->blocks = b;
+        t->block_used = 0;
+    }
+    Label* l = &t->blocks->labels[t->block_used++];
+    memset(l, 0, sizeof(Label));
+    l->name = store_name(t, s, len);
+    l->id = (uint32_t)t->count;
+    l->len = len;
+    l->hash = h;
+    if (len > t->longest) t->longest = len;
+    *slot = l;
+    ++t->count;
+    return l;
+}
+
+Label* label_find(const LabelTable* t, const char* s, uint16_t len) {
+    if (t == NULL || t->capacity == 0) return NULL;
+    return *find_slot(t, s, len, hash_string(s, len));
+}
+
+/* Length of the label a line defines, 0 if none; *rest is set past the
+   definition. A name alone in column 0 without a ':' is only a label when
+   it is not a mnemonic, so an unindented `ret` stays an instruction. */
+static uint16_t definition(const char* text, const char** rest) {
+    const char* p = text;
+    if (!IS_NAME_START(*p)) return 0;
+    while (IS_NAME_CHAR(*p)) ++p;
+    const char* q = p;
+    if (*q == ':') ++q;
+    else {
+        while (IS_BLANK(*q)) ++q;
+        if (*q) return 0;
+        if (p - text <= 8 && mnemonic_id(text, (uint8_t)(p - text)) != MNEM_NONE) return 0;
+    }
+    *rest = q;
+    return (uint16_t)(p - text);
+}
+
+/* Whether a name is a register or a condition, which no label can be
+   called. Most operands are one, so they are ruled out before hashing. */
+static uint8_t is_reserved(const char* s, uint16_t len) {
+    char a = s[0] | 0x20;
+    if (len == 1) return strchr("abcdefhilmprz", a) != NULL;
+    if (len != 2) return 0;
+    char b = s[1] | 0x20;
+    switch (a) {
+        case 'a': return b == 'f';
+        case 'b': return b == 'c';
+        case 'd': return b == 'e';
+        case 'h': return b == 'l';
+        case 'i': return b == 'x' || b == 'y';
+        case 's': return b == 'p';
+        case 'n': return b == 'z' || b == 'c';
+        case 'p': return b == 'o' || b == 'e';
+    }
+    return 0;
+}
+
+/* Log a read (`delta` 0) or a change of a count at input line `line` */
+static void log_entry(LabelCounts* c, uint32_t id, int32_t delta, uint32_t line) {
+    if (c->log_count == c->log_cap) {
+        size_t cap = c->log_cap ? c->log_cap * 2 : 256;
+        LabelLog* log = realloc(c->log, cap * sizeof(LabelLog));
+        if (log == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+        c->log = log;
+        c->log_cap = cap;
+    }
+    LabelLog* e = &c->log[c->log_count++];
+    e->id = id;
+    e->delta = delta;
+    e->line = line;
+}
+
+/* Step a count by `delta`, stopping at 0 and at UINT32_MAX, which stands
+   for a count that overflowed and is no longer kept */
+static void step_count(uint32_t* refs, int8_t delta) {
+    if (delta > 0) {
+        if (*refs < UINT32_MAX) ++*refs;
+    }
+    else if (*refs > 0 && *refs < UINT32_MAX) --*refs;
+}
+
+/* Count the names the instruction at `p` refers to: every name after the
+   first word. Numbers ($ff, 0x1f, 10h) are not names, and quoted text is
+   skipped, except for the quote of af'. `insert` adds names that are not
+   in the table yet. With `own` set the job's counts change instead of
+   the table's. */
+static void count_names(LabelTable* t, LabelCounts* own, const char* p, int8_t delta, uint8_t insert, uint32_t line) {
+    while (IS_BLANK(*p)) ++p;
+    while (*p && !IS_BLANK(*p)) ++p;
+    while (*p) {
+        if (IS_TOKEN_CHAR(*p)) {
+            const char* s = p;
+            while (IS_TOKEN_CHAR(*p)) ++p;
+            if (*p == '\'') ++p;
+            if (!IS_NAME_START(*s)) continue;
+            uint16_t len = (uint16_t)(p - s - (p[-1] == '\''));
+            if (is_reserved(s, len)) continue;
+            Label* l = insert ? label_add(t, s, len) : label_find(t, s, len);
+            if (l == NULL) continue;
+            if (own) {
+                step_count(&own->refs[l->id], delta);
+                log_entry(own, l->id, delta, line);
+            }
+            else step_count(&l->refs, delta);
+        }
+        else if (*p == '"' || *p == '\'') {
+            char quote = *p++;
+            while (*p && *p != quote) ++p;
+            if (*p) ++p;
+        }
+        else ++p;
+    }
+}
+
+/* Whether the `len` characters at `s` are the mnemonic `m`, in any case */
+static uint8_t is_word(const char* s, uint16_t len, const char* m) {
+    for (uint16_t i = 0; i < len; ++i, ++m) {
+        if (*m == '\0' || tolower((unsigned char)s[i]) != *m) return 0;
+    }
+    return *m == '\0';
+}
+
+/* Note what the code at freshly defined labels is: `jp label` or `ret` */
+static void note_code(LabelTable* t, const char* p, Label** pending, uint8_t n) {
+    uint8_t flag = 0;
+    Label* jump = NULL;
+    const char* w = p;
+    while (*p && !IS_BLANK(*p)) ++p;
+    uint16_t wlen = (uint16_t)(p - w);
+    while (IS_BLANK(*p)) ++p;
+    if (is_word(w, wlen, "jp") && IS_NAME_START(*p)) {
+        const char* s = p;
+        while (IS_NAME_CHAR(*p)) ++p;
+        uint16_t len = (uint16_t)(p - s);
+        while (IS_BLANK(*p)) ++p;
+        /* jp nz,label has a condition and jp hl a register */
+        if (*p == '\0' && register_mask(s, len) < 0) {
+            jump = label_add(t, s, len);
+            flag = LABEL_TO_JP;
+        }
+    }
+    else if (is_word(w, wlen, "ret") && *p == '\0') {
+        flag = LABEL_TO_RET;
+    }
+    for (uint8_t i = 0; i < n; ++i) {
+        pending[i]->flags |= flag;
+        pending[i]->jump = jump;
+    }
+}
+
+LabelTable* label_scan(int8_t fd) {
+    LabelTable* t = calloc(1, sizeof(LabelTable));
+    if (t == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    char* buf = NULL;
+    linelen_t cap = 0;
+    linelen_t len;
+    Label* pending[LABEL_PENDING];
+    uint8_t npending = 0;
+
+    for (uint32_t lineno = 0; read_line_grow(fd, &buf, &cap, &len) >= 0; ++lineno) {
+        if (strip_asm_comment(buf, len) == 0) continue;
+        const char* p = buf;
+        uint16_t n = definition(p, &p);
+        if (n) {
+            Label* l = label_add(t, buf, n);
+            l->flags |= l->flags & LABEL_DEFINED ? LABEL_REDEFINED : LABEL_DEFINED;
+            l->line = lineno;
+            if (npending < LABEL_PENDING) pending[npending++] = l;
+        }
+        while (IS_BLANK(*p)) ++p;
+        if (*p == '\0') continue;
+        if (npending) {
+            note_code(t, p, pending, npending);
+            npending = 0;
+        }
+        count_names(t, NULL, p, 1, 1, 0);
+    }
+    free(buf);
+    return t;
+}
+
+void label_count_refs(LabelTable* t, LabelCounts* own, const char* text, int8_t delta, uint32_t line) {
+    const char* p = text;
+    definition(p, &p);
+    count_names(t, own, p, delta, 0, line);
+}
+
+uint32_t label_refs(const Label* l, LabelCounts* own, uint32_t line) {
+    if (own == NULL) return l->refs;
+    log_entry(own, l->id, 0, line);
+    return own->refs[l->id];
+}
+
+void label_counts_reset(LabelCounts* c, const LabelTable* t) {
+    for (size_t i = 0; i < t->capacity; ++i) {
+        const Label* l = t->slots[i];
+        if (l) c->refs[l->id] = l->refs;
+    }
+}
+
+LabelCounts* label_counts_new(const LabelTable* t) {
+    LabelCounts* c = calloc(1, sizeof(LabelCounts));
+    if (c == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    c->refs = malloc((t->count ? t->count : 1) * sizeof(uint32_t));
+    if (c->refs == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    label_counts_reset(c, t);
+    return c;
+}
+
+void label_counts_apply(LabelCounts* c, const LabelCounts* job, uint32_t from, uint32_t to) {
+    for (size_t i = 0; i < job->log_count; ++i) {
+        const LabelLog* e = &job->log[i];
+        if (e->delta != 0 && e->line >= from && e->line < to)
+            step_count(&c->refs[e->id], (int8_t)e->delta);
+    }
+}
+
+void label_counts_free(LabelCounts* c) {
+    if (c == NULL) return;
+    free(c->refs);
+    free(c->log);
+    free(c);
+}
+
+Label* label_target(Label* l) {
+    Label* cur = l;
+    for (uint8_t i = 0; i < LABEL_MAX_CHAIN; ++i) {
+        if ((cur->flags & (LABEL_DEFINED | LABEL_REDEFINED | LABEL_TO_JP)) != (LABEL_DEFINED | LABEL_TO_JP))
+            return cur;
+        cur = cur->jump;
+    }
+    return l;
+}
+
+void label_free(LabelTable* t) {
+    if (t == NULL) return;
+    while (t->blocks) {
+        struct LabelBlock* next = t->blocks->next;
+        free(t->blocks);
+        t->blocks = next;
+    }
+    while (t->texts) {
+        struct LabelText* next = t->texts->next;
+        free(t->texts);
+        t->texts = next;
+    }
+    free(t->slots);
+    free(t);
+}
@@ -0,0 +1,101 @@
+#ifndef LABELS_H_
+#define LABELS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "dataarea.h"
+
+/*
+ * Label cross-reference table of one input, built by a pre-pass before it
+ * is optimized. A label is defined by a line that starts in column 0 with
+ * a name followed by ':' or by nothing else. Every other name on a line,
+ * the mnemonic aside, is a reference, so a PUBLIC or GLOBAL directive
+ * counts as one and keeps an exported label referenced. The table also
+ * notes whether the code at a label is just an unconditional `jp` or
+ * `ret`, which is what jump threading needs.
+ *
+ * Reference counts follow the rewrites: the lines a rule removes and adds
+ * are passed to label_count_refs. Names only enter the table in the
+ * pre-pass; a name a rewrite introduces that was never seen there cannot
+ * be a label of this input and is not counted.
+ */
+#define LABEL_DEFINED   0x01
+#define LABEL_REDEFINED 0x02    /* defined more than once: never relied on */
+#define LABEL_TO_JP     0x04    /* the code at the label is `jp jump` */
+#define LABEL_TO_RET    0x08    /* the code at the label is `ret` */
+
+/* Longest chain of jumps label_target follows */
+#define LABEL_MAX_CHAIN 16
+
+typedef struct Label {
+    const char* name;       /* NUL terminated, owned by the table */
+    uint32_t id;            /* order of entry into the table, from 0 */
+    uint16_t len;
+    strhash_t hash;
+    uint8_t flags;
+    uint32_t refs;
+    uint32_t line;          /* input line of the definition, from 0 */
+    struct Label* jump;
+} Label;
+
+/* Labels live in blocks so that pointers to them, `jump` included, stay
+   valid while the open-addressing slot array grows. */
+#define LABEL_BLOCK 256
+
+typedef struct LabelTable {
+    Label** slots;
+    size_t capacity;        /* a power of two */
+    size_t count;
+    struct LabelBlock* blocks;
+    uint16_t block_used;    /* labels taken from the newest block */
+    uint16_t longest;       /* longest name */
+    struct LabelText* texts;
+    char* text;             /* free bytes in the newest text block */
+    size_t text_left;
+} LabelTable;
+
+/*
+ * Reference counts of one job over a table that it shares with other
+ * jobs, which then only read the table (see batch.c). The job starts from
+ * the table's counts and keeps its own. Every count it reads and every
+ * change it makes is logged with the input line at the head of its
+ * window, so that the chunks of a split file can be checked against the
+ * counts a single pass would have seen.
+ */
+typedef struct LabelLog {
+    uint32_t id;
+    int32_t delta;          /* 0 for a read */
+    uint32_t line;
+} LabelLog;
+
+typedef struct LabelCounts {
+    uint32_t* refs;         /* by Label.id */
+    LabelLog* log;
+    size_t log_count;
+    size_t log_cap;
+} LabelCounts;
+
+/* Read `fd` to the end and build its table; the caller closes `fd`. */
+LabelTable* label_scan(int8_t fd);
+void label_free(LabelTable* t);
+
+LabelCounts* label_counts_new(const LabelTable* t);
+void label_counts_free(LabelCounts* c);
+/* Set the counts of `c` back to those of the table */
+void label_counts_reset(LabelCounts* c, const LabelTable* t);
+/* Make to the counts of `c` the changes `job` logged at lines [from, to) */
+void label_counts_apply(LabelCounts* c, const LabelCounts* job, uint32_t from, uint32_t to);
+
+Label* label_find(const LabelTable* t, const char* s, uint16_t len);
+/* Reference count of `l`: the table's, or the job's own when `own` is
+   set, which logs the read at input line `line` */
+uint32_t label_refs(const Label* l, LabelCounts* own, uint32_t line);
+/* Add `delta` (+1 or -1) to the count of every label `text` refers to,
+   in the table or, when `own` is set, in the job's own counts */
+void label_count_refs(LabelTable* t, LabelCounts* own, const char* text, int8_t delta, uint32_t line);
+/* The label a jump to `l` ends up at, following unconditional jumps; `l`
+   itself when it does not lead to one or the chain loops */
+Label* label_target(Label* l);
+
+#endif //LABELS_H_
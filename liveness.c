@@ -0,0 +1,665 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "platform.h"
+#include "opcodes.h"
+#include "liveness.h"
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t')
+#define IS_WORD(c) (((c) >= 'a' && (c) <= 'z') || ((c) >= 'A' && (c) <= 'Z') || \
+                    ((c) >= '0' && (c) <= '9') || (c) == '_' || (c) == '\'')
+
+#define LOWER(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+
+/* Index register halves, after "ix"/"iy" ("ixh") or alone ("hx", "xh") */
+static int index_half(char x, char half) {
+    uint16_t hi = x == 'x' ? REG_IXH : REG_IYH;
+    uint16_t lo = x == 'x' ? REG_IXL : REG_IYL;
+    if (x != 'x' && x != 'y') return -1;
+    return half == 'h' ? hi : half == 'l' ? lo : -1;
+}
+
+/* The index register halves go by several names across assemblers; every
+   spelling is recognised so that none is mistaken for a symbol. A switch
+   rather than a table, as every word of every operand is looked up. */
+int register_mask(const char* s, linelen_t len) {
+    char a, b;
+    if (len == 0 || len > 3) return -1;
+    a = LOWER(s[0]);
+    if (len == 1) {
+        switch (a) {
+            case 'a': return REG_A;
+            case 'f': return REG_F;
+            case 'b': return REG_B;
+            case 'c': return REG_C;
+            case 'd': return REG_D;
+            case 'e': return REG_E;
+            case 'h': return REG_H;
+            case 'l': return REG_L;
+            case 'i': case 'r': return 0;
+        }
+        return -1;
+    }
+    b = LOWER(s[1]);
+    if (len == 3) {
+        if (a == 'a' && b == 'f' && s[2] == '\'') return 0;
+        if (a != 'i') return -1;
+        return index_half(b, LOWER(s[2]));
+    }
+    switch (a) {
+        case 'a': return b == 'f' ? REG_A | REG_F : -1;
+        case 'b': return b == 'c' ? REG_B | REG_C : -1;
+        case 'd': return b == 'e' ? REG_D | REG_E : -1;
+        case 'h': return b == 'l' ? REG_H | REG_L : index_half(b, 'h');
+        case 'l': return index_half(b, 'l');
+        case 's': return b == 'p' ? 0 : -1;
+        case 'i':
+            if (b == 'x') return REG_IXH | REG_IXL;
+            if (b == 'y') return REG_IYH | REG_IYL;
+            return -1;
+        case 'x': case 'y': return index_half(a, b);
+    }
+    return -1;
+}
+
+/* An operand is a register, a memory reference "(...)" or anything else,
+   taken to be an immediate. `regs` holds the register for the first kind
+   and every register named inside the parentheses for the second, which
+   covers the address registers of (hl), (ix+d), (bc) and (c). */
+typedef enum { opImm, opReg, opMem } OperandKind;
+
+typedef struct Operand {
+    uint8_t kind;
+    uint16_t regs;
+    const char* text;   /* the operand, blanks around it left out */
+    uint8_t len;
+} Operand;
+
+#define MAX_OPERANDS 3
+
+/* Split the operands after the mnemonic at top-level commas. Returns the
+   operand count, or -1 when there are more than MAX_OPERANDS. */
+static int8_t parse_operands(const char* p, Operand* ops) {
+    int8_t n = 0;
+    while (IS_SPACE(*p)) ++p;
+    if (*p == '\0') return 0;
+    for (;;) {
+        if (n == MAX_OPERANDS) return -1;
+        Operand* op = &ops[n++];
+        uint8_t words = 0;
+        uint8_t depth = 0;
+        int reg = -1;
+        while (IS_SPACE(*p)) ++p;
+        op->kind = *p == '(' ? opMem : opImm;
+        op->regs = 0;
+        op->text = p;
+        while (*p && (*p != ',' || depth)) {
+            if (*p == '(') ++depth;
+            else if (*p == ')' && depth) --depth;
+            if (IS_WORD(*p)) {
+                const char* w = p;
+                while (IS_WORD(*p)) ++p;
+                reg = register_mask(w, (uint16_t)(p - w));
+                if (reg > 0) op->regs |= (uint16_t)reg;
+                ++words;
+                continue;
+            }
+            if (!IS_SPACE(*p) && *p != '(' && *p != ')') words += 2;
+            ++p;
+        }
+        if (op->kind == opImm && words == 1 && reg >= 0) op->kind = opReg;
+        const char* end = p;
+        while (end > op->text && IS_SPACE(end[-1])) --end;
+        op->len = end - op->text > 255 ? 255 : (uint8_t)(end - op->text);
+        if (*p == '\0') return n;
+        ++p;
+    }
+}
+
+/* Registers an operand reads when it is a source */
+#define SRC(op) ((op).regs)
+/* Registers a destination operand overwrites, and those it reads to
+   form an address */
+#define DST_DEF(op) ((op).kind == opReg ? (op).regs : 0)
+#define DST_USE(op) ((op).kind == opMem ? (op).regs : 0)
+
+void line_effect(const char* text, uint16_t* use, uint16_t* def) {
+    Operand ops[MAX_OPERANDS];
+    const char* p = text;
+    uint16_t u = 0;
+    uint16_t d = 0;
+
+    *use = REG_ALL;
+    *def = 0;
+
+    while (IS_SPACE(*p)) ++p;
+    const char* word = p;
+    while (*p && !IS_SPACE(*p)) ++p;
+    if (p - word > 8) return;
+    uint8_t id = mnemonic_id(word, (uint8_t)(p - word));
+    int8_t n = parse_operands(p, ops);
+    if (n < 0) return;
+
+    switch (id) {
+        case MNEM_LD:
+            if (n != 2) return;
+            u = SRC(ops[1]) | DST_USE(ops[0]);
+            d = DST_DEF(ops[0]);
+            break;
+        case MNEM_PUSH:
+            if (n != 1) return;
+            u = SRC(ops[0]);
+            break;
+        case MNEM_POP:
+            if (n != 1 || ops[0].kind != opReg) return;
+            d = ops[0].regs;
+            break;
+        case MNEM_EX:
+            if (n != 2) return;
+            if (ops[0].regs == (REG_A | REG_F)) {
+                /* ex af,af': the values move to the shadow registers,
+                   from where anything later may bring them back */
+                u = REG_A | REG_F;
+            }
+            else {
+                /* ex de,hl and ex (sp),hl: both sides are read and the
+                   registers get the other side's value */
+                u = ops[0].regs | ops[1].regs;
+                d = DST_DEF(ops[0]) | DST_DEF(ops[1]);
+            }
+            break;
+        case MNEM_EXX:
+            if (n != 0) return;
+            u = REG_B | REG_C | REG_D | REG_E | REG_H | REG_L;
+            break;
+        case MNEM_ADD:
+        case MNEM_ADC:
+        case MNEM_SBC:
+        case MNEM_SUB:
+        case MNEM_AND:
+        case MNEM_OR:
+        case MNEM_XOR:
+        case MNEM_CP: {
+            Operand acc = { opReg, REG_A };
+            const Operand* dst = &acc;
+            const Operand* src = &ops[0];
+            if (n == 2) {
+                dst = &ops[0];
+                src = &ops[1];
+            }
+            else if (n != 1) return;
+            if (dst->kind != opReg) return;
+            u = dst->regs | SRC(*src);
+            if (id == MNEM_ADC || id == MNEM_SBC) u |= REG_F;
+            if (id != MNEM_CP) d = dst->regs;
+            /* 8-bit arithmetic and 16-bit adc/sbc set every flag;
+               add hl,rr leaves S, Z and P/V alone */
+            if (dst->regs == REG_A || id == MNEM_ADC || id == MNEM_SBC) d |= REG_F;
+        } break;
+        case MNEM_INC:
+        case MNEM_DEC:
+            /* the carry survives, so F is not defined */
+            if (n != 1) return;
+            u = SRC(ops[0]);
+            d = DST_DEF(ops[0]);
+            break;
+        case MNEM_RLC:
+        case MNEM_RRC:
+        case MNEM_RL:
+        case MNEM_RR:
+        case MNEM_SLA:
+        case MNEM_SRA:
+        case MNEM_SRL:
+        case MNEM_SLL:
+            if (n != 1) return;
+            u = SRC(ops[0]);
+            if (id == MNEM_RL || id == MNEM_RR) u |= REG_F;
+            d = DST_DEF(ops[0]) | REG_F;
+            break;
+        case MNEM_RLA:
+        case MNEM_RRA:
+            u = REG_A | REG_F;
+            d = REG_A;
+            break;
+        case MNEM_RLCA:
+        case MNEM_RRCA:
+        case MNEM_CPL:
+            u = REG_A;
+            d = REG_A;
+            break;
+        case MNEM_RLD:
+        case MNEM_RRD:
+            u = REG_A | REG_H | REG_L;
+            d = REG_A;
+            break;
+        case MNEM_NEG:
+            u = REG_A;
+            d = REG_A | REG_F;
+            break;
+        case MNEM_DAA:
+            u = REG_A | REG_F;
+            d = REG_A | REG_F;
+            break;
+        case MNEM_CCF:
+            u = REG_F;
+            break;
+        case MNEM_BIT:
+            if (n != 2) return;
+            u = SRC(ops[1]);
+            break;
+        case MNEM_SET:
+        case MNEM_RES:
+            if (n != 2) return;
+            u = SRC(ops[1]);
+            d = DST_DEF(ops[1]);
+            break;
+        case MNEM_LDI:
+        case MNEM_LDD:
+        case MNEM_LDIR:
+        case MNEM_LDDR:
+            u = REG_B | REG_C | REG_D | REG_E | REG_H | REG_L;
+            d = u;
+            break;
+        case MNEM_CPI:
+        case MNEM_CPD:
+        case MNEM_CPIR:
+        case MNEM_CPDR:
+            u = REG_A | REG_B | REG_C | REG_H | REG_L;
+            d = REG_B | REG_C | REG_H | REG_L;
+            break;
+        case MNEM_INI:
+        case MNEM_IND:
+        case MNEM_INIR:
+        case MNEM_INDR:
+        case MNEM_OUTI:
+        case MNEM_OUTD:
+        case MNEM_OTIR:
+        case MNEM_OTDR:
+            u = REG_B | REG_C | REG_H | REG_L;
+            d = REG_B | REG_H | REG_L;
+            break;
+        case MNEM_IN:
+            /* in r,(c) and in (c) address the port with BC, in a,(n)
+               with A */
+            if (n == 2 && ops[1].kind == opMem) {
+                u = ops[1].regs & REG_C ? REG_B | REG_C : REG_A;
+                d = DST_DEF(ops[0]) & ~REG_F;
+            }
+            else if (n == 1 && ops[0].kind == opMem) u = REG_B | REG_C;
+            else return;
+            break;
+        case MNEM_OUT:
+            if (n != 2 || ops[0].kind != opMem) return;
+            u = SRC(ops[1]) | (ops[0].regs & REG_C ? REG_B | REG_C : REG_A);
+            break;
+        case MNEM_MUL:
+            u = REG_D | REG_E;
+            d = REG_D | REG_E;
+            break;
+        case MNEM_SWAPNIB:
+        case MNEM_MIRROR:
+            u = REG_A;
+            d = REG_A;
+            break;
+        case MNEM_TEST:
+            if (n != 1) return;
+            u = REG_A;
+            d = REG_F;
+            break;
+        case MNEM_SCF:
+        case MNEM_NOP:
+        case MNEM_DI:
+        case MNEM_EI:
+        case MNEM_IM:
+            break;
+        default:
+            /* control transfers, block instructions that touch more
+               registers, and anything unknown */
+            return;
+    }
+    *use = u;
+    *def = d;
+}
+
+/* Known values. A register value is the content of one of the 8-bit
+   registers a, b, c, d, e, h and l, kept at the position of its REG_ bit;
+   F is only followed for its zero and carry flags. */
+#define TRACKED (REG_A | REG_B | REG_C | REG_D | REG_E | REG_H | REG_L)
+
+static uint8_t bit_index(uint16_t bit) {
+    uint8_t i = 0;
+    while (!(bit & 1)) {
+        bit >>= 1;
+        ++i;
+    }
+    return i;
+}
+
+void values_reset(RegValues* v) {
+    v->known = 0;
+    v->flags_known = 0;
+}
+
+/* A register pair in value order: the high half, then the low half */
+static uint8_t pair_halves(uint16_t mask, uint16_t* hi, uint16_t* lo) {
+    switch (mask) {
+        case REG_B | REG_C: *hi = REG_B; *lo = REG_C; return 1;
+        case REG_D | REG_E: *hi = REG_D; *lo = REG_E; return 1;
+        case REG_H | REG_L: *hi = REG_H; *lo = REG_L; return 1;
+    }
+    return 0;
+}
+
+static uint8_t is_reg8(uint16_t mask) {
+    return (mask & TRACKED) == mask && mask && (mask & (mask - 1)) == 0;
+}
+
+/* Value of a register or pair, -1 when it is not known or not tracked */
+static int32_t reg_value(const RegValues* v, uint16_t mask) {
+    uint16_t hi, lo;
+    if (is_reg8(mask)) {
+        return v->known & mask ? v->value[bit_index(mask)] : -1;
+    }
+    if (pair_halves(mask, &hi, &lo) && (v->known & mask) == mask)
+        return v->value[bit_index(hi)] << 8 | v->value[bit_index(lo)];
+    return -1;
+}
+
+static void set_reg(RegValues* v, uint16_t mask, int32_t value) {
+    uint16_t hi, lo;
+    if (value < 0) {
+        v->known &= ~mask;
+        return;
+    }
+    if (is_reg8(mask)) {
+        v->value[bit_index(mask)] = (uint8_t)value;
+        v->known |= mask;
+    }
+    else if (pair_halves(mask, &hi, &lo)) {
+        v->value[bit_index(hi)] = (uint8_t)(value >> 8);
+        v->value[bit_index(lo)] = (uint8_t)value;
+        v->known |= mask;
+    }
+    else v->known &= ~mask;
+}
+
+static void set_flag(RegValues* v, uint8_t flag, int32_t on) {
+    if (on < 0) {
+        v->flags_known &= ~flag;
+        return;
+    }
+    v->flags_known |= flag;
+    if (on) v->flags |= flag;
+    else v->flags &= ~flag;
+}
+
+static int32_t flag_value(const RegValues* v, uint8_t flag) {
+    return v->flags_known & flag ? (v->flags & flag) != 0 : -1;
+}
+
+uint8_t parse_number(const char* s, linelen_t len, int32_t* value) {
+    const char* p = s;
+    const char* end = s + len;
+    int32_t sign = 1;
+    uint32_t n = 0;
+    uint8_t base = 10;
+    if (p < end && (*p == '-' || *p == '+')) sign = *p++ == '-' ? -1 : 1;
+    if (p < end && *p == '$') {
+        base = 16;
+        ++p;
+    }
+    else if (end - p > 2 && p[0] == '0' && (p[1] | 0x20) == 'x') {
+        base = 16;
+        p += 2;
+    }
+    if (p == end) return 0;
+    for (; p < end; ++p) {
+        char c = *p;
+        uint8_t d;
+        if (c >= '0' && c <= '9') d = c - '0';
+        else if (base == 16 && (c | 0x20) >= 'a' && (c | 0x20) <= 'f') d = (c | 0x20) - 'a' + 10;
+        else return 0;
+        n = n * base + d;
+    }
+    *value = (int32_t)(sign < 0 ? 0u - n : n);
+    return 1;
+}
+
+/* Number written as an operand. -1 for anything else, a symbol included. */
+static int32_t immediate(const Operand* op, uint16_t width) {
+    int32_t n;
+    if (op->kind != opImm || !parse_number(op->text, op->len, &n)) return -1;
+    return n & width;
+}
+
+/* Value a source operand gives: a number or a known register */
+static int32_t source_value(const RegValues* v, const Operand* op, uint16_t width) {
+    if (op->kind == opReg) return reg_value(v, op->regs);
+    return immediate(op, width);
+}
+
+/* Width mask of a register operand: 0xff for a single register */
+#define WIDTH(mask) ((mask) & ((mask) - 1) ? 0xffff : 0xff)
+
+static void step_alu(RegValues* v, uint8_t id, const Operand* dst, const Operand* src) {
+    if (dst->regs != REG_A) {
+        /* 16-bit: add hl,rr keeps Z; adc and sbc set every flag */
+        int32_t x = reg_value(v, dst->regs);
+        int32_t y = source_value(v, src, 0xffff);
+        if (id == MNEM_ADD && x >= 0 && y >= 0) {
+            set_reg(v, dst->regs, (x + y) & 0xffff);
+            set_flag(v, FLAG_C, x + y > 0xffff);
+            return;
+        }
+        set_reg(v, dst->regs, -1);
+        set_flag(v, FLAG_C, -1);
+        if (id != MNEM_ADD) set_flag(v, FLAG_Z, -1);
+        return;
+    }
+
+    int32_t a = reg_value(v, REG_A);
+    int32_t y = source_value(v, src, 0xff);
+    int32_t carry = flag_value(v, FLAG_C);
+
+    if (src->kind == opReg && src->regs == REG_A) {
+        /* xor a, sub a and cp a give 0 whatever A is, and and a and
+           or a leave A as it is */
+        if (id == MNEM_XOR || id == MNEM_SUB || id == MNEM_CP) a = y = 0;
+    }
+    if (id == MNEM_ADC || id == MNEM_SBC) {
+        if (carry < 0) a = -1;
+    }
+    else carry = 0;
+
+    if (a >= 0 && y >= 0) {
+        int32_t r = 0;
+        switch (id) {
+            case MNEM_ADD: case MNEM_ADC: r = a + y + carry; break;
+            case MNEM_SUB: case MNEM_SBC: case MNEM_CP: r = a - y - carry; break;
+            case MNEM_AND: r = a & y; break;
+            case MNEM_OR: r = a | y; break;
+            case MNEM_XOR: r = a ^ y; break;
+        }
+        set_flag(v, FLAG_Z, (r & 0xff) == 0);
+        set_flag(v, FLAG_C, r < 0 || r > 0xff);
+        if (id != MNEM_CP) set_reg(v, REG_A, r & 0xff);
+        return;
+    }
+    if (id == MNEM_AND || id == MNEM_OR || id == MNEM_XOR) {
+        set_flag(v, FLAG_C, 0);
+        if (src->kind == opReg && src->regs == REG_A) {
+            /* and a, or a: only the flags change */
+            set_flag(v, FLAG_Z, -1);
+            return;
+        }
+    }
+    else set_flag(v, FLAG_C, -1);
+    set_flag(v, FLAG_Z, -1);
+    if (id != MNEM_CP) set_reg(v, REG_A, -1);
+}
+
+/* Whether an instruction can give a value with nothing known before it */
+static uint8_t makes_value(uint8_t id) {
+    switch (id) {
+        case MNEM_LD:
+        case MNEM_XOR:
+        case MNEM_SUB:
+        case MNEM_CP:
+        case MNEM_AND:
+        case MNEM_OR:
+        case MNEM_SCF:
+            return 1;
+    }
+    return 0;
+}
+
+void values_step(RegValues* v, const char* text, uint8_t id) {
+    Operand ops[MAX_OPERANDS];
+    const char* p = text;
+
+    /* Most lines are taken care of without looking at the operands */
+    switch (id) {
+        case MNEM_NONE:
+        case MNEM_CALL:
+        case MNEM_RST:
+        case MNEM_DJNZ:
+        case MNEM_HALT:
+        case MNEM_RETI:
+        case MNEM_RETN:
+            values_reset(v);
+            return;
+    }
+    if (VALUES_NONE(v) && !makes_value(id)) return;
+
+    while (IS_SPACE(*p)) ++p;
+    while (*p && !IS_SPACE(*p)) ++p;
+    int8_t n = parse_operands(p, ops);
+    if (n < 0) {
+        values_reset(v);
+        return;
+    }
+
+    switch (id) {
+        case MNEM_LD:
+            if (n != 2) break;
+            /* a store changes no register */
+            if (ops[0].kind != opReg) return;
+            if (ops[1].kind == opReg && ops[1].regs == 0 && (ops[0].regs & REG_A)) {
+                /* ld a,i and ld a,r set the flags */
+                set_reg(v, REG_A, -1);
+                set_flag(v, FLAG_Z | FLAG_C, -1);
+                return;
+            }
+            set_reg(v, ops[0].regs, source_value(v, &ops[1], WIDTH(ops[0].regs)));
+            return;
+        case MNEM_PUSH:
+        case MNEM_NOP:
+        case MNEM_DI:
+        case MNEM_EI:
+        case MNEM_IM:
+            return;
+        case MNEM_POP:
+            if (n != 1 || ops[0].kind != opReg) break;
+            set_reg(v, ops[0].regs, -1);
+            if (ops[0].regs & REG_F) set_flag(v, FLAG_Z | FLAG_C, -1);
+            return;
+        case MNEM_EX:
+            if (n != 2) break;
+            if (ops[0].regs == (REG_D | REG_E) && ops[1].regs == (REG_H | REG_L) && ops[1].kind == opReg) {
+                int32_t de = reg_value(v, REG_D | REG_E);
+                int32_t hl = reg_value(v, REG_H | REG_L);
+                set_reg(v, REG_D | REG_E, hl);
+                set_reg(v, REG_H | REG_L, de);
+                return;
+            }
+            if (ops[0].regs == (REG_A | REG_F)) {
+                set_reg(v, REG_A, -1);
+                set_flag(v, FLAG_Z | FLAG_C, -1);
+                return;
+            }
+            /* ex (sp),hl */
+            set_reg(v, ops[1].regs, -1);
+            return;
+        case MNEM_EXX:
+            set_reg(v, REG_B | REG_C | REG_D | REG_E | REG_H | REG_L, -1);
+            return;
+        case MNEM_SCF:
+            set_flag(v, FLAG_C, 1);
+            return;
+        case MNEM_CCF: {
+            int32_t c = flag_value(v, FLAG_C);
+            set_flag(v, FLAG_C, c < 0 ? -1 : !c);
+        } return;
+        case MNEM_CPL: {
+            int32_t a = reg_value(v, REG_A);
+            set_reg(v, REG_A, a < 0 ? -1 : ~a & 0xff);
+        } return;
+        case MNEM_NEG: {
+            int32_t a = reg_value(v, REG_A);
+            set_reg(v, REG_A, a < 0 ? -1 : -a & 0xff);
+            set_flag(v, FLAG_Z, a < 0 ? -1 : a == 0);
+            set_flag(v, FLAG_C, a < 0 ? -1 : a != 0);
+        } return;
+        case MNEM_ADD:
+        case MNEM_ADC:
+        case MNEM_SBC:
+        case MNEM_SUB:
+        case MNEM_AND:
+        case MNEM_OR:
+        case MNEM_XOR:
+        case MNEM_CP: {
+            Operand acc = { opReg, REG_A, "a", 1 };
+            if (n == 1) step_alu(v, id, &acc, &ops[0]);
+            else if (n == 2 && ops[0].kind == opReg) step_alu(v, id, &ops[0], &ops[1]);
+            else break;
+        } return;
+        case MNEM_INC:
+        case MNEM_DEC: {
+            /* the carry survives; 16-bit steps keep every flag */
+            if (n != 1) break;
+            if (ops[0].kind != opReg) {
+                set_flag(v, FLAG_Z, -1);
+                return;
+            }
+            uint16_t width = WIDTH(ops[0].regs);
+            int32_t x = reg_value(v, ops[0].regs);
+            if (x >= 0) x = (x + (id == MNEM_INC ? 1 : -1)) & width;
+            set_reg(v, ops[0].regs, x);
+            if (width == 0xff) set_flag(v, FLAG_Z, x < 0 ? -1 : x == 0);
+        } return;
+        case MNEM_JP:
+        case MNEM_JR:
+            /* a conditional jump falls through with everything as it was */
+            if (n == 2) return;
+            break;
+        case MNEM_RET:
+            if (n == 1) return;
+            break;
+        default: {
+            /* Anything else that is not a barrier to liveness overwrites
+               at most the registers it defines, and some of the flags */
+            uint16_t use, def;
+            line_effect(text, &use, &def);
+            if (use == REG_ALL && def == 0) break;
+            set_reg(v, def & TRACKED, -1);
+            set_flag(v, FLAG_Z | FLAG_C, -1);
+        } return;
+    }
+    values_reset(v);
+}
+
+int known_value(const RegValues* v, const char* s, linelen_t len, uint16_t* width) {
+    if (len == 2 && (s[1] | 0x20) == 'f') {
+        uint8_t flag = (s[0] | 0x20) == 'z' ? FLAG_Z : (s[0] | 0x20) == 'c' ? FLAG_C : 0;
+        if (flag) {
+            *width = 1;
+            return flag_value(v, flag);
+        }
+    }
+    int mask = register_mask(s, len);
+    uint16_t hi, lo;
+    if (mask <= 0 || !(is_reg8((uint16_t)mask) || pair_halves((uint16_t)mask, &hi, &lo)))
+        return VALUE_UNTRACKED;
+    *width = WIDTH((uint16_t)mask);
+    return reg_value(v, (uint16_t)mask);
+}
@@ -0,0 +1,80 @@
+#ifndef LIVENESS_H_
+#define LIVENESS_H_
+
+#include <stdint.h>
+
+#include "fileio.h"
+
+/*
+ * Register liveness for the `dead` constraint operator. Each instruction
+ * is summarised by the registers it reads (use) and the registers it
+ * overwrites completely (def), one bit per 8-bit register; an instruction
+ * that only updates some flags does not define F. A line the table does
+ * not know - a label, a directive, a jump, call or return, or a mnemonic
+ * outside the table - reads every register, so nothing is dead across it.
+ */
+#define REG_A   0x001
+#define REG_F   0x002
+#define REG_B   0x004
+#define REG_C   0x008
+#define REG_D   0x010
+#define REG_E   0x020
+#define REG_H   0x040
+#define REG_L   0x080
+#define REG_IXH 0x100
+#define REG_IXL 0x200
+#define REG_IYH 0x400
+#define REG_IYL 0x800
+#define REG_ALL 0xfff
+
+/* Bits of the register named by the `len` characters at `s`, compared
+   case-insensitively: a, f, b, c, d, e, h, l, a pair or an index register
+   or half. 0 for i, r and sp, which are not tracked, and -1 for anything
+   that is not a register name. */
+int register_mask(const char* s, linelen_t len);
+
+/* Registers read and overwritten by the instruction on a window line */
+void line_effect(const char* text, uint16_t* use, uint16_t* def);
+
+/*
+ * Known register values for the `knownval` and `holds` operators: the
+ * constants that a, b, c, d, e, h, l and the zero and carry flags are
+ * known to hold, followed forwards line by line. Loads of a number, the
+ * arithmetic on known values and a few instructions with a fixed result
+ * (xor a, scf, ...) make a value known. Whatever the step does not model
+ * forgets what it overwrites, and a label, call, return, unconditional
+ * jump, directive or unknown mnemonic forgets everything, so a value is
+ * only known within straight-line code.
+ */
+#define FLAG_C 0x01
+#define FLAG_Z 0x40
+
+typedef struct RegValues {
+    uint16_t known;         /* REG_ bits of the registers with a value */
+    uint8_t flags_known;    /* FLAG_ bits */
+    uint8_t flags;
+    uint8_t value[8];       /* by the position of the REG_ bit */
+} RegValues;
+
+#define VALUES_NONE(v) ((v)->known == 0 && (v)->flags_known == 0)
+
+void values_reset(RegValues* v);
+/* Advance past the instruction on a line, whose first word has the
+   mnemonic id `id` */
+void values_step(RegValues* v, const char* text, uint8_t id);
+
+/* Value of the number written in the `len` characters at `s`: decimal,
+   $ or 0x hex, with an optional sign; a leading zero does not make it
+   octal. Returns 0, leaving *value alone, for anything else. This is how
+   both the tracker and rule captures read numbers. */
+uint8_t parse_number(const char* s, linelen_t len, int32_t* value);
+
+/* Returned by known_value for a name that is never tracked */
+#define VALUE_UNTRACKED (-2)
+
+/* Known value of the register, pair (bc, de, hl) or flag (zf, cf) named
+   by the `len` characters at `s`, and the mask of its width in `width`;
+   -1 when it is not known. */
+int known_value(const RegValues* v, const char* s, linelen_t len, uint16_t* width);
+
+#endif //LIVENESS_H_
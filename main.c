@@ -2,7 +2,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
-#include <ctype.h>
 #ifdef __ZXNEXT
 #include <arch/zxn.h>
 #endif
@@ -10,1224 +9,303 @@
 #include "platform.h"
 #include "dataarea.h"
 #include "fileio.h"
+#include "rules.h"
+#include "rulecache.h"
+#include "ruleindex.h"
+#include "rulestats.h"
+#include "optimizer.h"
+#include "batch.h"
 
-#define SEARCH_PATH "C:/ZDEV/"
-
-static void strip_asm_comment(char* s) {
-    int in_single = 0;
-    int in_double = 0;
-    for (char* p = s; *p; ++p) {
-        if (!in_double && *p == '\'') { // toggle single-quote
-            in_single = !in_single;
-            continue;
-        }
-        if (!in_single && *p == '"') { // toggle double-quote
-            in_double = !in_double;
-            continue;
-        }
-        if (!in_single && !in_double && *p == ';') {
-            *p = '\0';
-            break;
-        }
-    }
-    // trim trailing spaces
-    size_t len = strlen(s);
-    while (len && (unsigned char)s[len - 1] == ' ') {
-        s[--len] = '\0';
-    }
-}
-
-int rule_count;
-uint8_t paren_depth;
-
-typedef struct TokenizedExpr TokenizedExpr;
-
-/* Note: pattern/replacement line counts are always <= MAX_WINDOW_SIZE (<=255)
-   so use uint8_t to save space and help the optimizer. */
-
-/* Forward declarations for compiled-expression API */
-TokenizedExpr* compile_expression(const char* expr, int lineno);
-void free_tokenized_expr(TokenizedExpr* e);
-int eval_tokenized(TokenizedExpr* e, char* bindings[10], int lineno);
+uint8_t old_speed;
+uint8_t old_border;
+OptimizerContext job;
 
-static void get_mnemonic(const char* s, char* mnem) {
-    const char* p = s;
-    while (*p && !isalnum((unsigned char)*p) && *p != '$' && *p != '_') p++; // skip leading non-alphanumeric
-    int i = 0;
-    while (*p && (isalnum((unsigned char)*p) || *p == '_' || *p == '$') && i < 15) {
-        mnem[i++] = tolower((unsigned char)*p++);
+void cleanup(void) {
+    /* Index nodes loaded from a rule image belong to the image */
+    if (rule_cache_loaded()) free_rule_cache();
+    free_context(&job);
+    index_free(&key_index);
+    index_free(&mnemonic_index);
+    RuleNode* gn = generic_rules;
+    while (gn) {
+        RuleNode* next = gn->next;
+        free(gn);
+        gn = next;
     }
-    mnem[i] = '\0';
+#ifdef __ZXNEXT
+    ZXN_NEXTREGA(0x07, old_speed);
+    zx_border(old_border);
+#endif
 }
 
-#define RULE_HASH_SIZE 61
-
-static uint8_t hash_mnemonic(const char* mnem) {
-    uint8_t h = 0;
-    const char* p = mnem;
-    while (*p) {
-        h = (h << 1) ^ (*p++);
-    }
-    return h & (RULE_HASH_SIZE - 1);
-}
+void load_config(const char* filename) {
+    int8_t fd = open_file(filename);
+    if (fd < 0) return;
 
-/*
- * Build a two-level index key: "mnemonic_secondtoken"
- * Rules whose second token starts with '$' (pure wildcard) produce only
- * the mnemonic part and go into the per-mnemonic fallback bucket.
- * Rules whose first token starts with '$' go into generic_rules.
- *
- * Only '(' and alpha characters are accepted into the second-token portion.
- * This naturally excludes digits, '+'/'-' offsets, and other punctuation,
- * ensuring pattern lines (which stop at '$') and concrete instruction lines
- * (which have actual values) always produce the same key prefix.
- */
-static void get_index_key(const char* s, char* key) {
-    char* out = key;
-    const char* p = s;
-    while (*p == ' ') p++;
-    /* copy mnemonic */
-    while (*p && *p != ' ') *out++ = (char)tolower((unsigned char)*p++);
-    while (*p == ' ') p++;
-    /* second token: if it starts with '$' it is a pure wildcard - stop here */
-    if (*p == '\0' || *p == '$') { *out = '\0'; return; }
-    *out++ = '_';
-    /* copy second token, accepting only '(' and alpha characters */
-    while (*p == '(' || isalpha((unsigned char)*p)) *out++ = (char)tolower((unsigned char)*p++);
-    *out = '\0';
+    
+    
+    close_file(fd);
 }
 
-typedef struct Rule {
-    int lineno;
-    char** pattern_lines;
-    uint8_t pattern_linecount;
-    char** replacement_lines;
-    uint8_t replacement_linecount;
-    TokenizedExpr* constraint_expr;
-} Rule;
-
-typedef struct RuleNode {
-    Rule* rule;
-    struct RuleNode* next;
-} RuleNode;
-
-/* Specific two-level buckets: mnemonic + second token */
-static RuleNode* rule_buckets[RULE_HASH_SIZE];
-/* Fallback per-mnemonic buckets: rules whose second token is a pure wildcard */
-static RuleNode* mnemonic_fallback_buckets[RULE_HASH_SIZE];
-static RuleNode* generic_rules = NULL;
-
-static void add_rule_to_index(Rule* rule) {
-    char mnem[16];
-    get_mnemonic(rule->pattern_lines[0], mnem);
-    RuleNode* node = malloc(sizeof(RuleNode));
-    if (!node) exit(1);
-    node->rule = rule;
-    if (mnem[0] == '$' || mnem[0] == '\0') {
-        /* First token is a wildcard - matches any instruction */
-        node->next = generic_rules;
-        generic_rules = node;
-    }
-    else {
-        char key[32];
-        get_index_key(rule->pattern_lines[0], key);
-        uint8_t h = hash_mnemonic(key);
-        if (strchr(key, '_')) {
-            /* Two-level specific key: mnemonic + concrete second token */
-            node->next = rule_buckets[h];
-            rule_buckets[h] = node;
-        }
-        else {
-            /* Mnemonic-only key: second token was a pure wildcard */
-            node->next = mnemonic_fallback_buckets[h];
-            mnemonic_fallback_buckets[h] = node;
-        }
-    }
+void init(void) {
+    atexit(cleanup);
+    init_file_io();
+#ifdef __ZXNEXT
+    old_speed = ZXN_READ_REG(0x07) & 0x03;
+    old_border = ((*(uint8_t*)(0x5c48)) & 0b00111000) >> 3;
+    ZXN_NEXTREG(0x07, 3);
+#endif
 }
 
-int8_t probe_rules(const char* filename) {
-    int8_t fp = open_file(filename);
-    if (fp < 0) {
-        char* path = malloc(strlen(filename) + sizeof(SEARCH_PATH) + 1);
-        if (!path) {
-            printf("Out of memory\n");
-            return -1;
-        }        
-        sprintf(path, "%s%s", SEARCH_PATH, filename);        
-        fp = open_file(path);
+/* --compile-rules [rulefile] [imagefile] */
+int compile_rules(int argc, char** argv) {
+    const char* rule_filename = argc > 0 ? argv[0] : "rules.opt";
+    char* path = probe_rules(rule_filename);
+    if (!path) return 1;
+
+    /* taken before parsing, so that an edit made meanwhile is noticed */
+    uint32_t source_time = file_timestamp(path);
+    uint32_t source_size = file_size(path);
+    printf("Compiling rules\n");
+    Rule* rules = parse_rules(path);
+    if (!rules) {
         free(path);
-    }
-    return fp;
-}
-
-Rule* parse_rules(const char* filename) {
-    int8_t fp = probe_rules(filename);
-    if (fp < 0) {
-        printf("Error opening rule file: %s\n", filename);
-        return NULL;
-    }
-    int capacity = 5;
-    Rule* rules = malloc(capacity * sizeof(Rule));
-    if (rules == NULL) {
-        error(ERROR_OUT_OF_MEMORY, 0);
-        return NULL;
-    }
-
-    enum { STATE_START, STATE_IN_PATTERN, STATE_IN_REPLACEMENT, STATE_IN_CONSTRAINT } state = STATE_START;
-
-    int current_lineno = 0;
-    int rule_lineno = 0;
-    char** pattern_lines = NULL;
-    uint8_t pattern_linecount = 0;
-    char** replacement_lines = NULL;
-    uint8_t replacement_linecount = 0;
-    TokenizedExpr* constraint_expr = NULL;
-    rule_count = 0;
-    for (int i = 0; i < RULE_HASH_SIZE; i++) rule_buckets[i] = NULL;
-    for (int i = 0; i < RULE_HASH_SIZE; i++) mnemonic_fallback_buckets[i] = NULL;
-    generic_rules = NULL;
-
-    while (read_line(fp, line, MAX_LINE_LENGTH) >= 0) {
-        ++current_lineno;
-        char* trimmed = trim(line);
-        if (trimmed[0] == '\0' || trimmed[0] == '#') continue;
-        do {
-            switch (state) {
-                case STATE_START:
-                    if (strncmp(trimmed, "pattern:", 8) != 0) error(ERROR_EXPECTED_REPLACEMENT_OR_CONSTRAINT, current_lineno);
-                    state = STATE_IN_PATTERN;
-                    rule_lineno = current_lineno;
-
-                    if (rule_count >= capacity) {
-                        capacity *= 2;
-                        rules = realloc(rules, capacity * sizeof(Rule));
-                        if (rules == NULL) {
-                            printf("Out of memory\n");
-                            return NULL;
-                        }
-                    }
-                    break;
-
-                case STATE_IN_PATTERN:
-                    if (strncmp(trimmed, "replacement:", 12) == 0)
-                        state = STATE_IN_REPLACEMENT;
-                    else if (strncmp(trimmed, "constraints:", 12) == 0)
-                        state = STATE_IN_CONSTRAINT;
-
-                    if (state == STATE_IN_PATTERN) {
-                        if (pattern_linecount == MAX_WINDOW_SIZE) error(ERROR_TOO_MANY_LINES, current_lineno);
-                        strcpy(window[pattern_linecount++], line);
-                    }
-                    else {
-                        pattern_lines = malloc(pattern_linecount * sizeof(char*));
-                        if (pattern_lines == NULL) error(ERROR_OUT_OF_MEMORY, current_lineno);
-                        for (uint8_t i = 0; i < pattern_linecount; ++i)
-                            pattern_lines[i] = hash(window[i]);
-                    }
-                    break;
-
-                case STATE_IN_CONSTRAINT:
-                    if (strncmp(trimmed, "replacement:", 12) == 0)
-                        state = STATE_IN_REPLACEMENT;
-                    else {
-                        if (constraint_expr != NULL && strlen(trim(line)) != 0) error(ERROR_MULTILINE_CONSTRAINT, current_lineno);
-                        constraint_expr = compile_expression(trimmed, current_lineno);
-                    }
-                    break;
-
-                case STATE_IN_REPLACEMENT:
-                    if (strncmp(trimmed, "pattern:", 8) == 0)
-                        state = STATE_START;
-
-                    if (state == STATE_IN_REPLACEMENT) {
-                        if (pattern_linecount == MAX_WINDOW_SIZE) error(ERROR_TOO_MANY_LINES, current_lineno);
-                        if (trimmed[0] == '-') {
-                            strcpy(window[replacement_linecount++], hash(""));
-                        }
-                        else {
-                            strcpy(window[replacement_linecount++], line);
-                        }
-                    }
-                    else {
-                        replacement_lines = malloc(replacement_linecount * sizeof(char*));
-                        if (replacement_lines == NULL) error(ERROR_OUT_OF_MEMORY, current_lineno);
-                        for (uint8_t i = 0; i < replacement_linecount; ++i)
-                            replacement_lines[i] = hash(window[i]);
-
-                        Rule* rule = &rules[rule_count++];
-                        rule->lineno = rule_lineno;
-                        rule->pattern_lines = pattern_lines;
-                        rule->pattern_linecount = pattern_linecount;
-                        rule->replacement_lines = replacement_lines;
-                        rule->replacement_linecount = replacement_linecount;
-                        rule->constraint_expr = constraint_expr;
-
-                        pattern_lines = NULL; pattern_linecount = 0;
-                        replacement_lines = NULL; replacement_linecount = 0;
-                        constraint_expr = NULL;
-                    }
-                    break;
-            }
-        } while (state == STATE_START);
+        return 1;
     }
 
-    if (pattern_linecount || replacement_linecount) {
-        if (replacement_linecount == 0) error(ERROR_EXPECTED_REPLACEMENT_OR_CONSTRAINT, current_lineno);
-        if (pattern_linecount == 0) error(ERROR_EXPECTED_PATTERN, current_lineno);
-
-        replacement_lines = malloc(replacement_linecount * sizeof(char*));
-        if (replacement_lines == NULL) error(ERROR_OUT_OF_MEMORY, current_lineno);
-        for (uint8_t i = 0; i < replacement_linecount; ++i)
-            replacement_lines[i] = hash(window[i]);
-
-        Rule* rule = &rules[rule_count++];
-        rule->lineno = rule_lineno;
-        rule->pattern_lines = pattern_lines;
-        rule->pattern_linecount = pattern_linecount;
-        rule->replacement_lines = replacement_lines;
-        rule->replacement_linecount = replacement_linecount;
-        rule->constraint_expr = constraint_expr;
-
-        pattern_lines = NULL; pattern_linecount = 0;
-        replacement_lines = NULL; replacement_linecount = 0;
-        constraint_expr = NULL;
+    char* cachename = argc > 1 ? NULL : rule_cache_filename(path);
+    const char* image_filename = argc > 1 ? argv[1] : cachename;
+    int result = 0;
+    if (!image_filename || save_rule_cache(image_filename, rules, rule_count, source_time, source_size) < 0) {
+        printf("Error writing rule image\n");
+        result = 1;
     }
-
-    for (int i = rule_count - 1; i >= 0; i--) {
-        add_rule_to_index(&rules[i]);
+    else {
+        printf("Wrote %d rules to %s\n", rule_count, image_filename);
     }
 
-    return rules;
+    free(cachename);
+    free(path);
+    free_strtbl();
+    free_rules(rules);
+    return result;
 }
 
-typedef enum { vtInt, vtString } ValueType;
-typedef struct Value {
-    ValueType vt;
-    union {
-        char* strval;
-        int intval;
-    };
-} Value;
-
-// Define the various token types.
-typedef enum {
-    tokNone,
-    tokNumber,
-    tokVariable,
-    tokLiteral,
-    tokLParen,
-    tokRParen,
-    tokIsNumeric,
-    tokStartsWith,
-    tokPlus,
-    tokMinus,
-    tokTimes,
-    tokDivide,
-    tokMod,
-    tokLt,
-    tokGt,
-    tokLe,
-    tokGe,
-    tokEq,
-    tokNe,
-    tokAnd,
-    tokOr,
-    tokXor,
-    tokBand,
-    tokBor,
-    tokBxor,
-    tokShl,
-    tokShr,
-    tokEos,
-} TokenType;
-
-// Global array to hold the current token string.
-char token[64];
-TokenType tok;
-int token_lineno;
-
-// Tokenized expression representation for compiled constraints
-typedef struct {
-    TokenType type;
-    char* strval; /* interned string for literals */
-    int intval;   /* numeric value or variable index */
-} TokenEntry;
-
-typedef struct TokenizedExpr {
-    TokenEntry* entries;
-    int count;
-    int capacity;
-} TokenizedExpr;
-
-/* Compile an expression into a token array for fast repeated evaluation */
-TokenizedExpr* compile_expression(const char* expr, int lineno);
-void free_tokenized_expr(TokenizedExpr* e);
-int eval_tokenized(TokenizedExpr* e, char* bindings[10], int lineno);
+/* --check-rules [rulefile]
+   List the rules that may rewrite each other's output without end.
+   Returns 1 when there are any. */
+int report_rule_loops(int argc, char** argv) {
+    const char* rule_filename = argc > 0 ? argv[0] : "rules.opt";
+    Rule* rules = load_rules(rule_filename);
+    if (!rules) return 1;
 
-// Global pointer that tracks our current position in the input string.
-static const char* tokptr = NULL;
+    int found = check_rules(rules, rule_count);
+    printf("%d rewrite loops\n", found);
 
-void init_tokenizer(const char* str, int lineno) {
-    tokptr = str;
-    paren_depth = 0;
-    token_lineno = lineno;
+    free_strtbl();
+    free_rules(rules);
+    return found > 0;
 }
 
-TokenType get_token(void) {
-    tok = tokNone;
-    char* temp = &token[0];
-
-    // Skip whitespace.
-    while (*tokptr && *tokptr == ' ') {
-        tokptr++;
-    }
-
-    if (*tokptr == '\0') {
-        return (tok = tokEos);
-    }
+/* --index-stats [rulefile] [asmfile]
+   Print the shape of the rule index and, given an input file, how many
+   candidate rules are tried on average for each of its lines. */
+int report_index_stats(int argc, char** argv) {
+    const char* rule_filename = argc > 0 ? argv[0] : "rules.opt";
+    Rule* rules = load_rules(rule_filename);
+    if (!rules) return 1;
 
-    switch (*tokptr) {
-        case '(': *temp++ = *tokptr++; tok = tokLParen; ++paren_depth; break;
-        case ')': *temp++ = *tokptr++; tok = tokRParen; --paren_depth; break;
-        case '+': *temp++ = *tokptr++; tok = tokPlus; break;
-        case '-': *temp++ = *tokptr++; tok = tokMinus; break;
-        case '*': *temp++ = *tokptr++; tok = tokTimes; break;
-        case '/': *temp++ = *tokptr++; tok = tokDivide; break;
-        case '%': *temp++ = *tokptr++; tok = tokMod; break;
-        case '<': *temp++ = *tokptr++; tok = tokLt;
-            if (*tokptr == '=') {
-                *temp++ = *tokptr++;
-                tok = tokLe;
-            }
-            else if (*tokptr == '>') {
-                *temp++ = *tokptr++;
-                tok = tokNe;
-            }
-            break;
-        case '>': *temp++ = *tokptr++; tok = tokGt;
-            if (*tokptr == '=') {
-                *temp++ = *tokptr++;
-                tok = tokGe;
-            }
-            break;
-        case '=': *temp++ = *tokptr++; tok = tokEq; break;
-        case '$':
-            tokptr++; // skip '$'            
-            if (*tokptr == '$') {
-                *temp++ = '$';
-                tokptr++; // skip '$'
-                tok = tokLiteral;
-            }
-            else if (isdigit(*tokptr)) {
-                while (*tokptr && isdigit(*tokptr)) {
-                    *temp++ = *tokptr++;
-                }
-                tok = tokVariable;
-            }
-            break;
-        case '"':
-        case '\'':
-        {
-            char terminator = *tokptr;
-            tokptr++; // skip quote
-            while (*tokptr && *tokptr != terminator) {
-                *temp++ = *tokptr++;
-            }
-            if (*tokptr != terminator) error(ERROR_INVALID_EXPRESSION, token_lineno);
-            tokptr++; // skip closing quote
-            tok = tokLiteral;
+    uint16_t generic = chain_length(generic_rules);
+    index_stats(&key_index, "key");
+    index_stats(&mnemonic_index, "mnemonic");
+    printf("generic   %3u rules\n", (unsigned)generic);
+
+    int result = 0;
+    if (argc > 1) {
+        int8_t fd = open_file(argv[1]);
+        if (fd < 0) {
+            printf("Error opening input file\n");
+            result = 1;
         }
-        break;
-        default:
-            if (isdigit(*tokptr)) {
-                while (*tokptr && isdigit(*tokptr)) {
-                    *temp++ = *tokptr++;
-                }
-                tok = tokNumber;
-            }
-            else {
-                while (*tokptr && *tokptr != ' ' && *tokptr != ')') {
-                    *temp++ = *tokptr++;
-                }
-                *temp = '\0';
-                /* Reduce repeated strcmp calls by routing based on first char */
-                switch (token[0]) {
-                    case 'i':
-                        if (strcmp(token, "isnumeric") == 0) tok = tokIsNumeric;
-                        else tok = tokLiteral;
-                        break;
-                    case 'a':
-                        if (strcmp(token, "and") == 0) tok = tokAnd;
-                        else tok = tokLiteral;
-                        break;
-                    case 'b':
-                        if (strcmp(token, "band") == 0) tok = tokBand;
-                        else if (strcmp(token, "bor") == 0) tok = tokBor;
-                        else if (strcmp(token, "bxor") == 0) tok = tokBxor;
-                        else tok = tokLiteral;
-                        break;
-                    case 'o':
-                        if (strcmp(token, "or") == 0) tok = tokOr;
-                        else tok = tokLiteral;
-                        break;
-                    case 's':
-                        if (strcmp(token, "startswith") == 0) tok = tokStartsWith;
-                        else if (strcmp(token, "shl") == 0) tok = tokShl;
-                        else if (strcmp(token, "shr") == 0) tok = tokShr;
-                        else tok = tokLiteral;
-                        break;
-                    case 'x':
-                        if (strcmp(token, "xor") == 0) tok = tokXor;
-                        else tok = tokLiteral;
-                        break;
-                    default:
-                        tok = tokLiteral;
-                        break;
-                }
-            }
-            break;
-    }
-    *temp = '\0';
-
-    return tok;
-}
-
-Value stack[10];
-int top = 0;
-
-int is_numeric(const char* s) {
-    if (s == NULL || *s == '\0')
-        return 0;
-    const char* p = s;
-    if (*p == '-' || *p == '+')
-        p++;
-    /* Z80 assembler hex: $xx */
-    if (*p == '$') {
-        p++;
-        if (!isxdigit((unsigned char)*p))
-            return 0;
-        while (*p && isxdigit((unsigned char)*p))
-            p++;
-        return (*p == '\0');
-    }
-    /* C-style hex: 0x... */
-    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
-        p += 2;
-        if (!isxdigit((unsigned char)*p))
-            return 0;
-        while (*p && isxdigit((unsigned char)*p))
-            p++;
-        return (*p == '\0');
-    }
-    while (*p) {
-        if (!isdigit((unsigned char)*p))
-            return 0;
-        p++;
-    }
-    return 1;
-}
-
-/* Parse an integer from a string, supporting decimal, 0x hex, and $-prefixed Z80 hex. */
-static int parse_int(const char* s) {
-    if (s == NULL) return 0;
-    const char* p = s;
-    int sign = 1;
-    if (*p == '-') { sign = -1; p++; }
-    else if (*p == '+') { p++; }
-    if (*p == '$') {
-        return sign * (int)strtol(p + 1, NULL, 16);
-    }
-    return sign * (int)strtol(p, NULL, 0);
-}
-
-void eval_binop(TokenType op) {
-    if (top < 2) error(ERROR_INVALID_EXPRESSION, token_lineno);
-    Value y = stack[--top];
-    Value x = stack[--top];
-    if ((x.vt == vtInt && y.vt == vtString) || (x.vt == vtString && y.vt == vtInt)) {
-        switch (op) {
-            case tokLt:
-            case tokGt:
-            case tokLe:
-            case tokGe:
-            case tokEq:
-            case tokNe:
-            {
-                char leftbuf[32];
-                char rightbuf[32];
-                const char* ls, * rs;
-                if (x.vt == vtInt) {
-                    snprintf(leftbuf, sizeof(leftbuf), "%d", x.intval);
-                    ls = leftbuf;
-                    rs = y.strval;
-                }
-                else {
-                    ls = x.strval;
-                    snprintf(rightbuf, sizeof(rightbuf), "%d", y.intval);
-                    rs = rightbuf;
-                }
-                int r = strcmp(ls, rs);
-                switch (op) {
-                    case tokLt: x.intval = r < 0; break;
-                    case tokGt: x.intval = r > 0; break;
-                    case tokLe: x.intval = r <= 0; break;
-                    case tokGe: x.intval = r >= 0; break;
-                    case tokEq: x.intval = r == 0; break;
-                    case tokNe: x.intval = r != 0; break;
-                }
-                x.vt = vtInt;
-                stack[top++] = x;
-                return;
+        else {
+            char* buf = NULL;
+            linelen_t cap = 0;
+            linelen_t len;
+            uint32_t lines = 0;
+            uint32_t candidates = 0;
+            while (read_line_grow(fd, &buf, &cap, &len) >= 0) {
+                uint16_t n = candidate_rules(buf, len);
+                if (n == 0 && buf[0] == '\0') continue;
+                candidates += n;
+                ++lines;
             }
-            default:
-                error(ERROR_INVALID_EXPRESSION, token_lineno);
+            close_file(fd);
+            free(buf);
+            uint32_t div = lines ? lines : 1;
+            printf("%lu lines, %lu.%02lu candidate rules per line\n", (unsigned long)lines,
+                (unsigned long)(candidates / div), (unsigned long)(candidates % div * 100 / div));
         }
     }
 
-    if (x.vt == vtInt && y.vt == vtInt) {
-        switch (op) {
-            case tokPlus: x.intval = x.intval + y.intval; break;
-            case tokMinus: x.intval = x.intval - y.intval; break;
-            case tokTimes: x.intval = x.intval * y.intval; break;
-            case tokDivide: x.intval = x.intval / y.intval; break;
-            case tokMod: x.intval = x.intval % y.intval; break;
-            case tokLt: x.intval = (x.intval < y.intval); break;
-            case tokGt: x.intval = (x.intval > y.intval); break;
-            case tokLe: x.intval = (x.intval <= y.intval); break;
-            case tokGe: x.intval = (x.intval >= y.intval); break;
-            case tokEq: x.intval = (x.intval == y.intval); break;
-            case tokNe: x.intval = (x.intval != y.intval); break;
-            case tokAnd:  x.intval = (x.intval != 0) && (y.intval != 0); break;
-            case tokOr:   x.intval = (x.intval != 0) || (y.intval != 0); break;
-            case tokXor:  x.intval = (x.intval && !y.intval) || (!x.intval && y.intval); break;
-            case tokBand: x.intval = x.intval & y.intval; break;
-            case tokBor:  x.intval = x.intval | y.intval; break;
-            case tokBxor: x.intval = x.intval ^ y.intval; break;
-            case tokShl:  x.intval = x.intval << y.intval; break;
-            case tokShr:  x.intval = x.intval >> y.intval; break;
-        }
-    }
-    else if (x.vt == vtString && y.vt == vtString) {
-        int r = strcmp(x.strval, y.strval);
-        switch (op) {
-            case tokLt: x.intval = r < 0; break;
-            case tokGt: x.intval = r > 0; break;
-            case tokLe: x.intval = (r <= 0); break;
-            case tokGe: x.intval = (r >= 0); break;
-            case tokEq: x.intval = (r == 0); break;
-            case tokNe: x.intval = (r != 0); break;
-        }
-        x.vt = vtInt;
-    }
-    else {
-        error(ERROR_INVALID_EXPRESSION, token_lineno);
-    }
-    stack[top++] = x;
+    free_strtbl();
+    free_rules(rules);
+    return result;
 }
 
-int eval_expression(const char* expr, char* bindings[10], int lineno) {
-    Value v1, v2;
-    top = 0;
-    init_tokenizer(expr, lineno);
-    get_token();
-    while (tok != tokEos) {
-        switch (tok) {
-            case tokNumber:
-            {
-                v1.vt = vtInt;
-                v1.intval = atoi(token);
-                stack[top++] = v1;
-                get_token();
-            }
-            break;
-            case tokVariable:
-            {
-                int id = token[0] - '0';
-                if (id < 0 || id > 9) error(ERROR_INVALID_BINDING, lineno);
-                if (is_numeric(bindings[id])) {
-                    v1.vt = vtInt;
-                    v1.intval = parse_int(bindings[id]);
-                    stack[top++] = v1;
-                }
-                else {
-                    v1.vt = vtString;
-                    v1.strval = bindings[id];
-                    stack[top++] = v1;
-                }
-                get_token();
-            }
-            break;
-            case tokLiteral:
-                v1.vt = vtString;
-                v1.strval = hash(token);
-                stack[top++] = v1;
-                get_token();
-                break;
-            case tokPlus:
-            case tokMinus:
-            case tokTimes:
-            case tokDivide:
-            case tokMod:
-            case tokLt:
-            case tokGt:
-            case tokLe:
-            case tokGe:
-            case tokEq:
-            case tokNe:
-            case tokAnd:
-            case tokOr:
-            case tokXor:
-                eval_binop(tok);
-                get_token();
-                break;
-            case tokIsNumeric:
-                v1 = stack[--top];
-                if (v1.vt == vtInt) v1.intval = 1;
-                else if (is_numeric(v1.strval)) v1.intval = 1;
-                else v1.intval = 0;
-                v1.vt = vtInt;
-                stack[top++] = v1;
-                get_token();
-                break;
-            case tokStartsWith:
-                v1 = stack[--top];
-                v2 = stack[--top];
-                if (v1.vt == vtString && v2.vt == vtString) {
-                    char* prefix = v1.strval;
-                    char* str = v2.strval;
-                    v1.intval = (strncmp(str, prefix, strlen(prefix)) == 0);
-                    v1.vt = vtInt;
-                    stack[top++] = v1;
-                }
-                else {
-                    v1.vt = vtInt;
-                    v1.intval = 0;
-                    stack[top++] = v1;
-                }
-                get_token();
-                break;
-            case tokLParen:
-            case tokRParen:
-                get_token();
-                break;
-        }
+/* Optimize input_filename into output_name rather than in place. On the
+   host "-" stands for stdin as the input; out_fd is already open when the
+   output is stdout. */
+int optimize_to(const char* input_filename, const char* output_name, int8_t out_fd, uint8_t window) {
+    int8_t in_fd;
+    uint8_t piped = 0;
+#ifdef PLATFORM_POSIX
+    piped = strcmp(input_filename, "-") == 0;
+    if (piped) in_fd = open_stdin();
+    else
+#endif
+    in_fd = open_file(input_filename);
+    if (in_fd < 0) {
+        printf("Error opening input file %s\n", input_filename);
+        return 1;
     }
-
-    if (top != 1 || stack[0].vt != vtInt) error(ERROR_INVALID_EXPRESSION, lineno);
-    return stack[0].intval;
-}
-
-/* Compile expression into token entries */
-TokenizedExpr* compile_expression(const char* expr, int lineno) {
-    TokenizedExpr* e = malloc(sizeof(TokenizedExpr));
-    if (!e) error(ERROR_OUT_OF_MEMORY, lineno);
-    e->count = 0; e->capacity = 16;
-    e->entries = malloc(e->capacity * sizeof(TokenEntry));
-    if (!e->entries) error(ERROR_OUT_OF_MEMORY, lineno);
-
-    init_tokenizer(expr, lineno);
-    while (get_token() != tokEos) {
-        TokenEntry te = { 0 };
-        te.type = tok;
-        te.strval = NULL;
-        te.intval = 0;
-        switch (tok) {
-            case tokNumber:
-                te.intval = atoi(token);
-                break;
-            case tokVariable:
-                te.intval = token[0] - '0';
-                break;
-            case tokLiteral:
-                te.strval = hash(token);
-                break;
-            case tokLParen:
-            case tokRParen:
-                continue;
-            default:
-                break;
+    if (out_fd < 0) {
+        if (strcmp(output_name, input_filename) == 0) {
+            printf("Output file is the input file\n");
+            close_file(in_fd);
+            return 1;
         }
-        if (e->count >= e->capacity) {
-            e->capacity *= 2;
-            e->entries = realloc(e->entries, e->capacity * sizeof(TokenEntry));
-            if (!e->entries) error(ERROR_OUT_OF_MEMORY, lineno);
+        out_fd = create_file(output_name);
+        if (out_fd < 0) {
+            printf("Error creating output file %s\n", output_name);
+            close_file(in_fd);
+            return 1;
         }
-        e->entries[e->count++] = te;
     }
-    return e;
-}
 
-void free_tokenized_expr(TokenizedExpr* e) {
-    if (!e) return;
-    free(e->entries);
-    free(e);
-}
+    /* stdin cannot be read twice, and holding it for a second read would
+       end streaming, so a piped input goes without the label pre-pass */
+    if (label_rules && !piped) {
+        int8_t scan_fd = open_file(input_filename);
+        if (scan_fd >= 0) scan_labels(&job, scan_fd);
+    }
 
-int eval_tokenized(TokenizedExpr* e, char* bindings[10], int lineno) {
-    top = 0;
-    token_lineno = lineno;
-    for (uint16_t i = 0; i < e->count; ++i) {
-        TokenEntry* te = &e->entries[i];
-        switch (te->type) {
-            case tokNumber: {
-                Value v; v.vt = vtInt; v.intval = te->intval; stack[top++] = v;
-            } break;
-            case tokVariable: {
-                int id = te->intval;
-                if (id < 0 || id > 9) error(ERROR_INVALID_BINDING, lineno);
-                Value v;
-                if (is_numeric(bindings[id])) {
-                    v.vt = vtInt; v.intval = parse_int(bindings[id]);
-                }
-                else {
-                    v.vt = vtString; v.strval = bindings[id];
-                }
-                stack[top++] = v;
-            } break;
-            case tokLiteral: {
-                Value v; v.vt = vtString; v.strval = te->strval; stack[top++] = v;
-            } break;
-            case tokPlus:
-            case tokMinus:
-            case tokTimes:
-            case tokDivide:
-            case tokMod:
-            case tokLt:
-            case tokGt:
-            case tokLe:
-            case tokGe:
-            case tokEq:
-            case tokNe:
-            case tokAnd:
-            case tokOr:
-            case tokXor:
-            case tokBand:
-            case tokBor:
-            case tokBxor:
-            case tokShl:
-            case tokShr:
-                eval_binop(te->type);
-                break;
-            case tokIsNumeric: {
-                Value v1 = stack[--top];
-                if (v1.vt == vtInt) v1.intval = 1;
-                else if (is_numeric(v1.strval)) v1.intval = 1;
-                else v1.intval = 0;
-                v1.vt = vtInt;
-                stack[top++] = v1;
-            } break;
-            case tokStartsWith: {
-                Value v1 = stack[--top];
-                Value v2 = stack[--top];
-                Value vr;
-                if (v1.vt == vtString && v2.vt == vtString) {
-                    vr.vt = vtInt;
-                    vr.intval = (strncmp(v2.strval, v1.strval, strlen(v1.strval)) == 0);
-                }
-                else {
-                    vr.vt = vtInt; vr.intval = 0;
-                }
-                stack[top++] = vr;
-            } break;
-            case tokLParen:
-            case tokRParen:
-                /* parentheses ignored in RPN evaluation */
-                break;
-            default:
-                error(ERROR_INVALID_EXPRESSION, lineno);
-        }
+    printf("Optimizing %s\n", input_filename);
+    int8_t failed = optimize(&job, in_fd, out_fd, window) < 0;
+    close_file(in_fd);
+    if (close_file(out_fd) < 0) failed = 1;
+    if (failed) {
+        printf("Error writing %s\n", output_name);
+        return 1;
     }
-    if (top != 1 || stack[0].vt != vtInt) error(ERROR_INVALID_EXPRESSION, lineno);
-    return stack[0].intval;
+    return 0;
 }
 
-int match_pattern_line(const char* pattern, const char* line, char* bindings[10]) {
-    const char* p = pattern;
-    const char* l = line;
+int main(int argc, char** argv) {
+    init();
 
-    while (*p) {
-        while (*p == ' ') ++p;
-        while (*l == ' ') ++l;
-        if (p[0] == '$' && isdigit(p[1])) {
-            int var_index = p[1] - '0';
-            p += 2; // skip over "$n"
-            /* Find next literal segment in pattern */
-            const char* lit_start = p;
-            while (*p && !(p[0] == '$' && isdigit(p[1])))
-                p++;
-            int lit_len = p - lit_start;
-            if (lit_len > 0) {
-                if (lit_len > MAX_LINE_LENGTH) lit_len = MAX_LINE_LENGTH;
-                strncpy(tmp_line1, lit_start, lit_len);
-            }
-            tmp_line1[lit_len] = '\0';
-            if (lit_len == 0) {
-                /* No literal after the placeholder: grab the rest of the line */
-                if (bindings[var_index]) {
-                    if (strcmp(bindings[var_index], l) != 0)
-                        return 0;
-                }
-                else {
-                    bindings[var_index] = hash(l);
-                }
-                l += strlen(l);
-            }
-            else {
-                char* pos = strstr(l, tmp_line1);
-                if (!pos)
-                    return 0;
-                int var_len = pos - l;
-                if (var_len > MAX_LINE_LENGTH) var_len = MAX_LINE_LENGTH;
-                strncpy(tmp_line2, l, var_len);
-                tmp_line2[var_len] = '\0';
-                if (bindings[var_index]) {
-                    if (strcmp(bindings[var_index], tmp_line2) != 0)
-                        return 0;
-                }
-                else {
-                    bindings[var_index] = hash(tmp_line2);
-                }
-                l = pos;
-                if (strncmp(l, tmp_line1, lit_len) != 0)
-                    return 0;
-                l += lit_len;
+    /* Leading options, in any order:
+       --budget=<n> caps the rewrites at one window position.
+       -o <file> writes the result to <file> instead of replacing the
+       input. On the host an input of "-" is read from stdin, and "-" as
+       the output, or no -o with stdin as the input, writes to stdout.
+       -j <jobs> optimizes the files on that many threads (host only).
+       --stats prints the per-rule table; --stats=<file> writes it as CSV
+       or JSON when the file name ends in .csv or .json (STATS=1 only). */
+    const char* output_name = NULL;
+    int8_t stdout_fd = -1;
+    int jobs = 0;
+#ifdef RULE_STATS
+    uint8_t stats_enabled = 0;
+    const char* stats_filename = NULL;
+#endif
+    while (argc >= 2) {
+        const char* opt = argv[1];
+        int used = 1;
+        if (strncmp(opt, "--budget=", 9) == 0) {
+            long budget = atol(opt + 9);
+            if (budget < 1 || budget > UINT16_MAX) {
+                printf("--budget takes 1 to %u rewrites\n", (unsigned)UINT16_MAX);
+                return 1;
             }
+            rewrite_budget = (uint16_t)budget;
         }
-        else {
-            if (*p != *l)
-                return 0;
-            p++;
-            l++;
+        else if (strcmp(opt, "-o") == 0 && argc >= 3) {
+            output_name = argv[2];
+            used = 2;
         }
-    }
-    while (*l == ' ') ++l;   /* trailing spaces in line are ignored */
-    if (*l != '\0' && *l != '\n')
-        return 0;
-    return 1;
-}
-
-
-uint8_t match_rule(Rule* rule, uint8_t window_size, char* bindings[10]) {
-    uint8_t last_line = (rule->pattern_linecount < window_size ? rule->pattern_linecount : window_size);
-
-#define MATCH_LINE(i) \
-    match_pattern_line(rule->pattern_lines[(i)], window[(i)], bindings)
-
-    if (!MATCH_LINE(0))
-        return 0;
-    if (last_line == 1) return 1;
-
-    if (!MATCH_LINE(last_line - 1))
-        return 0;
-
-    for (uint8_t i = 1; i < last_line - 1; ++i) {
-        if (!MATCH_LINE(i))
-            return 0;
-    }
-#undef MATCH_LINE
-    return rule->pattern_linecount;
-}
-
-static void substitute_line(const char* templ, char* bindings[10], char* result, int lineno) {
-    char* out = result;
-    const char* p = templ;
-    while (*p) {
-        if (p[0] == '$') {
-            if (isdigit((unsigned char)p[1])) {
-                int index = p[1] - '0';
-                if (bindings[index]) {
-                    const char* s = bindings[index];
-                    while (*s) *out++ = *s++;
-                }
-                p += 2;
-            }
-            else if (strncmp(p, "$eval(", 6) == 0) {
-                const char* start = p + 6;
-                const char* end = start;
-                paren_depth++;
-                while (*end && paren_depth) {
-                    if (*end == '(') ++paren_depth;
-                    else if (*end == ')') --paren_depth;
-                    ++end;
-                }
-
-                if (paren_depth != 0) error(ERROR_INVALID_EXPRESSION, lineno);
-
-                int expr_len = end - start;
-                char expr[MAX_LINE_LENGTH + 1];
-                if (expr_len > MAX_LINE_LENGTH)
-                    expr_len = MAX_LINE_LENGTH;
-                strncpy(expr, start, expr_len);
-                expr[expr_len] = '\0';
-                int evaluated = eval_expression(expr, bindings, lineno);
-                char buf[64];
-                sprintf(buf, "%d", evaluated);
-                const char* s = buf;
-                while (*s) *out++ = *s++;
-                p = end;
-            }
-            else {
-                *out++ = *p++;
+#ifdef PLATFORM_POSIX
+        else if (strcmp(opt, "-j") == 0 && argc >= 3) {
+            jobs = atoi(argv[2]);
+            if (jobs < 1 || jobs > MAX_JOBS) {
+                printf("-j takes 1 to %d jobs\n", MAX_JOBS);
+                return 1;
             }
+            used = 2;
         }
-        else {
-            *out++ = *p++;
+#endif
+#ifdef RULE_STATS
+        else if (strncmp(opt, "--stats", 7) == 0 && (opt[7] == '\0' || opt[7] == '=')) {
+            stats_enabled = 1;
+            stats_filename = opt[7] == '=' ? opt + 8 : NULL;
         }
+#endif
+        else break;
+        argc -= used;
+        argv += used;
     }
-    *out = '\0';
-}
 
-void apply_replacement(Rule* rule, char** bindings) {
-    for (uint8_t i = 0; i < rule->replacement_linecount; i++) {
-        const char* line = rule->replacement_lines[i];
-        const char* line_body = line;
-        substitute_line(line_body, bindings, &tmp_line1[0], rule->lineno);
-        strcpy(window[i], tmp_line1);
+#ifdef PLATFORM_POSIX
+    if (!output_name && !jobs && argc >= 2 && strcmp(argv[argc - 1], "-") == 0) output_name = "-";
+    if (output_name && strcmp(output_name, "-") == 0) {
+        /* messages go to stderr from here on */
+        stdout_fd = open_stdout();
+        if (stdout_fd < 0) return 1;
     }
-}
+#endif
 
-static int is_opt_directive(const char* line) {
-    const char* p = line;
-    while (*p && isspace((unsigned char)*p)) ++p;
-    if (*p != ';') return 0;
-    ++p;
-    while (*p && isspace((unsigned char)*p)) ++p;
-    if (*p != '#') return 0;
-    ++p;
-    if (strncmp(p, "OPT_OFF", 7) == 0) {
-        p += 7;
-    } else if (strncmp(p, "OPT_ON", 6) == 0) {
-        p += 6;
-    } else {
-        return 0;
+    printf("ZOPT optimizer v0.3b (c)2026\n%s %s\n",__DATE__, __TIME__);
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--compile-rules") == 0) {
+        return compile_rules(argc - 2, argv + 2);
     }
-    while (*p && isspace((unsigned char)*p)) ++p;
-    if (*p != '\0') return 0;
-    // return 1 for OFF, 2 for ON
-    return (*(p - 1) == 'F') ? 1 : 2;
-}
-
-/* Write out any lines currently buffered in the window, preserving order. */
-static void flush_window(int8_t out_fd, uint8_t* window_size) {
-    while (*window_size > 0) {
-        if (window[0][0] != '\0') {
-            write_line(out_fd, window[0], strlen(window[0]));
-        }
-        if (*window_size > 1) {
-            memmove(&window[0], &window[1], (*window_size - 1) * sizeof(window[0]));
-        }
-        --(*window_size);
+    if (argc >= 2 && argc <= 4 && strcmp(argv[1], "--index-stats") == 0) {
+        return report_index_stats(argc - 2, argv + 2);
     }
-}
-
-/* Handle an OPT_OFF/OPT_ON directive that was just read into `line`.
-   Flushes any buffered window lines first so the directive (and the
-   passthrough block that follows an OPT_OFF) keeps its original position.
-   Returns 1 if the directive was handled (caller should not add `line`
-   to the window), 0 if `line` was not a directive. */
-static int handle_opt_directive(int8_t in_fd, int8_t out_fd, uint8_t* window_size, int* optimize_enabled, int dir) {
-    if (dir == 0) return 0;
-
-    flush_window(out_fd, window_size);
-    write_line(out_fd, line, strlen(line));
-
-    if (dir == 1) {
-        /* OPT_OFF: passthrough subsequent lines unchanged until OPT_ON */
-        *optimize_enabled = 0;
-        while (1) {
-            int16_t n = read_line(in_fd, line, MAX_LINE_LENGTH);
-            if (n < 0) break;
-            int dir2 = is_opt_directive(line);
-            write_line(out_fd, line, strlen(line));
-            if (dir2 == 2) { *optimize_enabled = 1; break; }
-        }
-    } else {
-        /* OPT_ON */
-        *optimize_enabled = 1;
+    if (argc >= 2 && argc <= 3 && strcmp(argv[1], "--check-rules") == 0) {
+        return report_rule_loops(argc - 2, argv + 2);
     }
-    return 1;
-}
-
-/* Refill the window up to max_window_size after a rule replacement,
-   honoring OPT_OFF/OPT_ON directives encountered along the way. */
-static void refill_window(int8_t in_fd, int8_t out_fd, uint8_t max_window_size, uint8_t* window_size, int* optimize_enabled) {
-    while (*window_size < max_window_size) {
-        int16_t n = read_line(in_fd, line, MAX_LINE_LENGTH);
-        if (n < 0) break;
-        int dir = is_opt_directive(line);
-        if (dir) {
-            /* handle_opt_directive fully processes OPT_OFF...OPT_ON (or a lone
-               OPT_ON) internally, including writing the passthrough lines and
-               restoring optimize_enabled, so we simply keep filling afterward. */
-            handle_opt_directive(in_fd, out_fd, window_size, optimize_enabled, dir);
-            continue;
+#ifdef PLATFORM_POSIX
+    if (jobs && argc >= 3) {
+        if (output_name) {
+            printf("-o cannot be combined with -j\n");
+            return 1;
         }
-        strip_asm_comment(line);
-        if (line[0] == '\0') continue;
-        strcpy(window[(*window_size)++], line);
-    }
-    for (uint8_t i = *window_size; i < max_window_size; ++i) window[i][0] = '\0';
-}
-
-void optimize(int8_t in_fd, int8_t out_fd, uint8_t max_window_size) {
-    uint8_t window_size = 0;
-    char current_mnem[16];
-    int optimize_enabled = 1;
-
-    while (window_size < max_window_size) {
-        int16_t n = read_line(in_fd, line, MAX_LINE_LENGTH);
-        if (n < 0) break;
-        /* Check for OPT directives before stripping comments */
-        int dir = is_opt_directive(line);
-        if (dir) {
-            handle_opt_directive(in_fd, out_fd, &window_size, &optimize_enabled, dir);
-            continue;
-        }
-        strip_asm_comment(line);
-        if (line[0] == '\0') {
-            continue; // skip empty lines and keep filling
-        }
-        strcpy(window[window_size++], line);
-    }
-
-    char* bindings[10];
-
-    while (window_size > 0) {
-#ifdef __ZXNEXT
-        zx_border(0);
-#endif      
-        int rule_applied;
-        /* If optimizations are disabled, bypass rule matching and just emit lines
-           to preserve original ordering until OPT_ON is seen. */
-        if (!optimize_enabled) {
-            if (window[0][0] != '\0') {
-                write_line(out_fd, window[0], strlen(window[0]));
-            }
-            if (window_size > 1) {
-                memmove(&window[0], &window[1], (window_size - 1) * sizeof(window[0]));
-            }
-            --window_size;
-            /* Refill the window fully (handles directives and keeps window at
-               max_window_size instead of only replacing the single emitted line) */
-            refill_window(in_fd, out_fd, max_window_size, &window_size, &optimize_enabled);
-            continue;
-        }
-        do {
-            rule_applied = 0;
-            char index_key[32];
-            get_index_key(window[0], index_key);
-            get_mnemonic(window[0], current_mnem);
-            uint8_t hkey  = hash_mnemonic(index_key);   /* specific bucket */
-            uint8_t hmnem = hash_mnemonic(current_mnem); /* fallback bucket  */
-
-/* Try one RuleNode chain; jumps to rule_fired on success, else falls through */
-#define TRY_CHAIN(chain_head) \
-            for (RuleNode* node = (chain_head); node; node = node->next) { \
-                Rule* rule = node->rule; \
-                memset(bindings, 0, sizeof(bindings)); \
-                if (rule->pattern_linecount <= window_size) { \
-                    if (match_rule(rule, window_size, bindings)) { \
-                        uint8_t constraints_ok = 1; \
-                        if (rule->constraint_expr) \
-                            constraints_ok = eval_tokenized(rule->constraint_expr, bindings, rule->lineno); \
-                        if (constraints_ok) { \
-                            apply_replacement(rule, bindings); \
-                            int count = (int)rule->pattern_linecount - (int)rule->replacement_linecount; \
-                            if (count) { \
-                                int P = rule->pattern_linecount; \
-                                int R = rule->replacement_linecount; \
-                                int rows_to_move = window_size - P; \
-                                memmove(&window[R], &window[P], rows_to_move * sizeof(window[0])); \
-                            } \
-                            window_size -= count; \
-                            refill_window(in_fd, out_fd, max_window_size, &window_size, &optimize_enabled); \
-                            rule_applied = 1; \
-                            goto rule_fired; \
-                        } \
-                    } \
-                } \
-            }
-
-            /* 1. Specific two-level bucket (mnemonic + second token) */
-            TRY_CHAIN(rule_buckets[hkey]);
-            /* 2. Mnemonic-only fallback (second token was a pure wildcard) */
-            TRY_CHAIN(mnemonic_fallback_buckets[hmnem]);
-            /* 3. Generic (first token itself was a wildcard) */
-            TRY_CHAIN(generic_rules);
-#undef TRY_CHAIN
-
-            rule_fired:;
-        } while (rule_applied);
-
-        // Only emit and decrement if we still have lines in the window
-        if (window_size > 0) {
-            if (window[0][0] != '\0') {
-                write_line(out_fd, window[0], strlen(window[0]));
-            }
-            if (window_size > 1) {
-                memmove(&window[0], &window[1], (window_size - 1) * sizeof(window[0]));
-            }
-            --window_size;
+#ifdef RULE_STATS
+        if (stats_enabled) {
+            printf("--stats cannot be combined with -j\n");
+            return 1;
         }
-
-        /* Refill the window fully (handles directives and keeps window at
-           max_window_size instead of only replacing the single emitted line) */
-        refill_window(in_fd, out_fd, max_window_size, &window_size, &optimize_enabled);
-    }
-}
-
-uint8_t old_speed;
-uint8_t old_border;
-
-void cleanup(void) {
-    for (int i = 0; i < RULE_HASH_SIZE; i++) {
-        RuleNode* n = rule_buckets[i];
-        while (n) { RuleNode* next = n->next; free(n); n = next; }
-    }
-    for (int i = 0; i < RULE_HASH_SIZE; i++) {
-        RuleNode* n = mnemonic_fallback_buckets[i];
-        while (n) { RuleNode* next = n->next; free(n); n = next; }
-    }
-    RuleNode* gn = generic_rules;
-    while (gn) {
-        RuleNode* next = gn->next;
-        free(gn);
-        gn = next;
+#endif
+        return optimize_batch(jobs, argv[1], argv + 2, argc - 2);
     }
-#ifdef __ZXNEXT
-    ZXN_NEXTREGA(0x07, old_speed);
-    zx_border(old_border);
 #endif
-}
-
-void load_config(const char* filename) {
-    int8_t fd = open_file(filename);
-    if (fd < 0) return;
-
-    
-    
-    close_file(fd);
-}
-
-void init(void) {
-    atexit(cleanup);
-    init_file_io();
-#ifdef __ZXNEXT
-    old_speed = ZXN_READ_REG(0x07) & 0x03;
-    old_border = ((*(uint8_t*)(0x5c48)) & 0b00111000) >> 3;
-    ZXN_NEXTREG(0x07, 3);
+    if (argc < 2 || argc > 3 || jobs) {
+        printf("Usage:\n .zopt [-o outfile] [rulefile] <asmfile>\n");
+#ifdef RULE_STATS
+        printf(" .zopt --stats[=file.csv|file.json] [rulefile] <asmfile>\n");
 #endif
-}
-
-int main(int argc, char** argv) {
-    printf("ZOPT optimizer v0.3b (c)2026\n%s %s\n",__DATE__, __TIME__);
-    if (argc < 2 || argc > 3) {
-        printf("Usage:\n .zopt [rulefile] <asmfile>\n");
+#ifdef PLATFORM_POSIX
+        printf(" .zopt -j <jobs> <rulefile> <asmfile>...\n");
+        printf(" zcc ... | zopt [rulefile] - | z80asm ...\n");
+#endif
+        printf(" .zopt --compile-rules [rulefile] [imagefile]\n");
+        printf(" .zopt --index-stats [rulefile] [asmfile]\n");
+        printf(" .zopt --check-rules [rulefile]\n");
+        printf("Options come before the files, in any order\n");
+        printf("Options: --budget=<n> rewrites at one position (%u)\n", (unsigned)REWRITE_BUDGET);
         printf("Default rule file:rules.opt\n\n");
         return 1;
     }
 
-    init();
     const char* rule_filename;
     const char* input_filename;
 
@@ -1240,46 +318,30 @@ int main(int argc, char** argv) {
         input_filename = argv[2];
     }
 
-    strcpy(output_filename, input_filename);
-    strcat(output_filename, ".tmp");
-
     printf("Loading rules\n");
-    Rule* rules = parse_rules(rule_filename);
+    Rule* rules = load_rules(rule_filename);
     if (!rules) return 1;
 
-    uint8_t code_window = 0;
-    for (int i = 0; i < rule_count; ++i) {
-        if (rules[i].pattern_linecount > code_window) code_window = rules[i].pattern_linecount;
-    }
+    uint8_t code_window = max_pattern_lines(rules, rule_count);
 
-    int8_t in_fd = open_file(input_filename);
-    if (in_fd < 0) {
-        printf("Error opening input file\n");
-        return 1;
-    }
+#ifdef RULE_STATS
+    stats_init(rules, rule_count);
+#endif
 
-    int8_t out_fd = create_file(output_filename);
-    if (out_fd < 0) {
-        printf("Error creating output file\n");
-        close_file(in_fd);
+    if (output_name) {
+        if (optimize_to(input_filename, output_name, stdout_fd, code_window)) return 1;
+    }
+    else if (optimize_file(&job, input_filename, output_filename, code_window)) {
         return 1;
     }
 
-    printf("Optimizing %s\n", input_filename);
-    optimize(in_fd, out_fd, code_window);
-
-    close_file(in_fd);
-    close_file(out_fd);
-
-    delete_file(input_filename);
-    rename_file(output_filename, input_filename);
+#ifdef RULE_STATS
+    if (stats_enabled && stats_report(stats_filename) < 0)
+        printf("Error writing %s\n", stats_filename);
+    stats_free();
+#endif
 
     free_strtbl();
-    for (int i = 0; i < rule_count; ++i) {
-        free(rules[i].pattern_lines);
-        free(rules[i].replacement_lines);
-        free_tokenized_expr(rules[i].constraint_expr);
-    }
-    free(rules);
+    free_rules(rules);
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include <stdint.h>
+
+#include "platform.h"
+#include "opcodes.h"
+
+/* Sorted, so that ids can be found by binary search; the id of an entry
+   is its position plus one. */
+static const char* const mnemonics[] = {
+    "adc", "add", "and", "bit", "brlc", "bsla", "bsra", "bsrf", "bsrl",
+    "call", "ccf", "cp", "cpd", "cpdr", "cpi", "cpir", "cpl", "daa", "dec",
+    "di", "djnz", "ei", "ex", "exx", "halt", "im", "in", "inc", "ind",
+    "indr", "ini", "inir", "jp", "jr", "ld", "ldd", "lddr", "lddrx", "lddx",
+    "ldi", "ldir", "ldirx", "ldix", "ldpirx", "ldws", "mirror", "mul", "neg",
+    "nextreg", "nop", "or", "otdr", "otir", "out", "outd", "outi", "outinb",
+    "pixelad", "pixeldn", "pop", "push", "res", "ret", "reti", "retn", "rl",
+    "rla", "rlc", "rlca", "rld", "rr", "rra", "rrc", "rrca", "rrd", "rst",
+    "sbc", "scf", "set", "setae", "sla", "sll", "sra", "srl", "sub",
+    "swapnib", "test", "xor",
+};
+
+/* Compare `len` characters of `s`, lowercased, with the table entry `m` */
+static int compare_word(const char* s, uint8_t len, const char* m) {
+    for (uint8_t i = 0; i < len; ++i, ++m) {
+        int c = (unsigned char)s[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != *m) return c - (unsigned char)*m;
+    }
+    return *m ? -1 : 0;
+}
+
+/* first_entry[c - 'a'] is the first mnemonic starting with c or a later
+   letter, so the entries starting with c end at first_entry[c - 'a' + 1] */
+static const uint8_t first_entry[27] = {
+    0, 3, 9, 17, 21, 24, 24, 24, 25, 32, 34, 34, 45, 47, 50, 57, 61, 61, 76,
+    86, 87, 87, 87, 87, 88, 88, 88
+};
+
+uint8_t mnemonic_id(const char* s, uint8_t len) {
+    if (len == 0) return MNEM_NONE;
+    uint8_t c = (uint8_t)s[0] | 0x20;
+    if (c < 'a' || c > 'z') return MNEM_NONE;
+    uint8_t lo = first_entry[c - 'a'];
+    uint8_t hi = first_entry[c - 'a' + 1];
+    while (lo < hi) {
+        uint8_t mid = (lo + hi) / 2;
+        int r = compare_word(s, len, mnemonics[mid]);
+        if (r == 0) return mid + 1;
+        if (r < 0) hi = mid;
+        else lo = mid + 1;
+    }
+    return MNEM_NONE;
+}
+
+/* Id of the first space-delimited word of `s`. A word holding a '$'
+   placeholder or longer than any mnemonic has no id. */
+uint8_t first_word_id(const char* s) {
+    while (*s == ' ') ++s;
+    const char* start = s;
+    while (*s && *s != ' ') {
+        if (*s == '$' || s - start > 8) return MNEM_NONE;
+        ++s;
+    }
+    return mnemonic_id(start, (uint8_t)(s - start));
+}
@@ -0,0 +1,33 @@
+#ifndef OPCODES_H_
+#define OPCODES_H_
+
+#include <stdint.h>
+
+/*
+ * Fixed table of Z80 and Z80N mnemonics. A line's first word maps to a
+ * small id, compared case-insensitively; MNEM_NONE means the word is not a
+ * known instruction (a label, a directive, a macro or a placeholder). The
+ * ids follow the alphabetical order of the table in opcodes.c.
+ */
+typedef enum {
+    MNEM_NONE, MNEM_ADC, MNEM_ADD, MNEM_AND, MNEM_BIT, MNEM_BRLC, MNEM_BSLA,
+    MNEM_BSRA, MNEM_BSRF, MNEM_BSRL, MNEM_CALL, MNEM_CCF, MNEM_CP, MNEM_CPD,
+    MNEM_CPDR, MNEM_CPI, MNEM_CPIR, MNEM_CPL, MNEM_DAA, MNEM_DEC, MNEM_DI,
+    MNEM_DJNZ, MNEM_EI, MNEM_EX, MNEM_EXX, MNEM_HALT, MNEM_IM, MNEM_IN,
+    MNEM_INC, MNEM_IND, MNEM_INDR, MNEM_INI, MNEM_INIR, MNEM_JP, MNEM_JR,
+    MNEM_LD, MNEM_LDD, MNEM_LDDR, MNEM_LDDRX, MNEM_LDDX, MNEM_LDI, MNEM_LDIR,
+    MNEM_LDIRX, MNEM_LDIX, MNEM_LDPIRX, MNEM_LDWS, MNEM_MIRROR, MNEM_MUL,
+    MNEM_NEG, MNEM_NEXTREG, MNEM_NOP, MNEM_OR, MNEM_OTDR, MNEM_OTIR, MNEM_OUT,
+    MNEM_OUTD, MNEM_OUTI, MNEM_OUTINB, MNEM_PIXELAD, MNEM_PIXELDN, MNEM_POP,
+    MNEM_PUSH, MNEM_RES, MNEM_RET, MNEM_RETI, MNEM_RETN, MNEM_RL, MNEM_RLA,
+    MNEM_RLC, MNEM_RLCA, MNEM_RLD, MNEM_RR, MNEM_RRA, MNEM_RRC, MNEM_RRCA,
+    MNEM_RRD, MNEM_RST, MNEM_SBC, MNEM_SCF, MNEM_SET, MNEM_SETAE, MNEM_SLA,
+    MNEM_SLL, MNEM_SRA, MNEM_SRL, MNEM_SUB, MNEM_SWAPNIB, MNEM_TEST, MNEM_XOR,
+} MnemonicId;
+
+#define MNEM_COUNT MNEM_XOR
+
+uint8_t mnemonic_id(const char* s, uint8_t len);
+uint8_t first_word_id(const char* s);
+
+#endif //OPCODES_H_
@@ -0,0 +1,2071 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#ifdef __ZXNEXT
+#include <arch/zxn.h>
+#endif
+
+#include "platform.h"
+#include "dataarea.h"
+#include "fileio.h"
+#include "rules.h"
+#include "rulecache.h"
+#include "ruleindex.h"
+#include "rulestats.h"
+#include "optimizer.h"
+#include "opcodes.h"
+#include "liveness.h"
+#include "labels.h"
+
+#ifdef PLATFORM_ZXN
+#define SEARCH_PATH "C:/ZDEV/"
+#else
+#define SEARCH_PATH "/usr/local/share/zopt/"
+#endif
+
+/* Cut a trailing comment and trailing spaces from a line of `len`
+   characters in place, returning the new length. */
+linelen_t strip_asm_comment(char* s, linelen_t len) {
+    int in_single = 0;
+    int in_double = 0;
+    for (char* p = s; p < s + len; ++p) {
+        if (!in_double && *p == '\'') { // toggle single-quote
+            in_single = !in_single;
+            continue;
+        }
+        if (!in_single && *p == '"') { // toggle double-quote
+            in_double = !in_double;
+            continue;
+        }
+        if (!in_single && !in_double && *p == ';') {
+            *p = '\0';
+            len = (linelen_t)(p - s);
+            break;
+        }
+    }
+    // trim trailing spaces
+    while (len && (unsigned char)s[len - 1] == ' ') {
+        s[--len] = '\0';
+    }
+    return len;
+}
+
+int rule_count;
+uint8_t label_rules;
+uint8_t value_rules;
+uint8_t longest_replacement;
+uint16_t rewrite_budget = REWRITE_BUDGET;
+uint8_t paren_depth;
+
+/* Forward declarations for compiled-expression API */
+TokenizedExpr* compile_expression(const char* expr, int lineno);
+void free_tokenized_expr(TokenizedExpr* e);
+int eval_tokenized(TokenizedExpr* e, Binding bindings[10], OptimizerContext* ctx, uint8_t end, int lineno);
+
+static void get_mnemonic(const char* s, char* mnem) {
+    const char* p = s;
+    while (*p && !isalnum((unsigned char)*p) && *p != '$' && *p != '_') p++; // skip leading non-alphanumeric
+    int i = 0;
+    while (*p && (isalnum((unsigned char)*p) || *p == '_' || *p == '$') && i < 15) {
+        mnem[i++] = tolower((unsigned char)*p++);
+    }
+    mnem[i] = '\0';
+}
+
+static int is_placeholder(const char* p) {
+    return p[0] == '$' && isdigit((unsigned char)p[1]);
+}
+
+/*
+ * Build a two-level index key: "mnemonic_secondtoken"
+ * Rules whose second token starts with '$' (pure wildcard) produce only
+ * the mnemonic part and go into the per-mnemonic fallback index.
+ * Rules whose first token starts with '$' go into generic_rules.
+ *
+ * Only '(' and alpha characters are accepted into the second-token portion.
+ * This naturally excludes digits, '+'/'-' offsets, and other punctuation,
+ * ensuring pattern lines (which stop at '$') and concrete instruction lines
+ * (which have actual values) always produce the same key prefix.
+ *
+ * Returns 1 if the key includes a second token that every line matching
+ * the pattern shares. A second token cut short by a placeholder, as in
+ * "ld ($1),hl", is only a prefix of the line keys, so such patterns are
+ * indexed by mnemonic alone. At most `size` - 1 characters are stored.
+ */
+static uint8_t get_index_key(const char* s, char* key, uint8_t size) {
+    char* out = key;
+    char* end = key + size - 1;
+    const char* p = s;
+    while (*p == ' ') p++;
+    /* copy mnemonic */
+    while (*p && *p != ' ' && out < end) *out++ = (char)tolower((unsigned char)*p++);
+    while (*p && *p != ' ') p++;
+    while (*p == ' ') p++;
+    /* second token: if it starts with '$' it is a pure wildcard - stop here */
+    if (*p == '\0' || *p == '$' || out == end) { *out = '\0'; return 0; }
+    char* mnem_end = out;
+    *out++ = '_';
+    /* copy second token, accepting only '(' and alpha characters */
+    while ((*p == '(' || isalpha((unsigned char)*p)) && out < end) *out++ = (char)tolower((unsigned char)*p++);
+    if (is_placeholder(p)) { *mnem_end = '\0'; return 0; }
+    *out = '\0';
+    return 1;
+}
+
+static void add_rule_to_index(Rule* rule) {
+    char mnem[16];
+    get_mnemonic(rule->pattern_lines[0], mnem);
+    if (mnem[0] == '$' || mnem[0] == '\0') {
+        /* First token is a wildcard - matches any instruction */
+        RuleNode* node = malloc(sizeof(RuleNode));
+        if (!node) exit(1);
+        node->rule = rule;
+        node->next = generic_rules;
+        generic_rules = node;
+    }
+    else {
+        char key[32];
+        if (get_index_key(rule->pattern_lines[0], key, sizeof(key)))
+            index_add(&key_index, key, rule);
+        else
+            index_add(&mnemonic_index, key, rule);
+    }
+}
+
+/* Split one pattern line into segments (see rules.h), squeezing literal
+   text in `text`, which holds strlen(pattern) + 1 bytes. Returns the
+   number of segments written to `seg`, excluding the terminating segEnd. */
+static uint16_t compile_pattern_line(const char* pattern, PatternSegment* seg, char* text) {
+    const char* p = pattern;
+    uint16_t count = 0;
+    while (1) {
+        while (*p == ' ') ++p;
+        if (!*p) break;
+        PatternSegment* s = &seg[count++];
+        if (is_placeholder(p)) {
+            s->type = segCapture;
+            s->var = p[1] - '0';
+            p += 2;
+            /* the literal that ends the capture runs up to the next placeholder */
+            const char* lit_start = p;
+            while (*p && !is_placeholder(p)) ++p;
+            s->len = p - lit_start;
+            s->text = s->len ? hash_n(lit_start, s->len) : NULL;
+        }
+        else {
+            /* literal text up to the next placeholder, spaces removed */
+            char* out = text;
+            while (*p && !is_placeholder(p)) {
+                if (*p != ' ') *out++ = *p;
+                ++p;
+            }
+            *out = '\0';
+            s->type = segText;
+            s->var = 0;
+            s->len = out - text;
+            s->text = hash(text);
+        }
+        s->first = s->text ? s->text[0] : '\0';
+    }
+    seg[count].type = segEnd;
+    seg[count].var = 0;
+    seg[count].first = '\0';
+    seg[count].len = 0;
+    seg[count].text = NULL;
+    return count;
+}
+
+/* Signature of a compiled pattern line: every literal character it
+   requires, and the interned text when the line is a single literal short
+   enough for parse_line to look up. */
+static void pattern_sig(const PatternSegment* seg, LineSig* sig) {
+    sig->mask = 0;
+    sig->len = 0;
+    sig->lit = seg[0].type == segText && seg[1].type == segEnd && seg[0].len <= MAX_LITERAL_LINE ? seg[0].text : NULL;
+    for (; seg->type != segEnd; ++seg) {
+        for (uint16_t i = 0; i < seg->len; ++i) {
+            if (seg->text[i] == ' ') continue;
+            sig->mask |= SIG_BIT(seg->text[i]);
+            ++sig->len;
+        }
+    }
+}
+
+/* All of a rule's segment arrays and signatures share one allocation with
+   the line table. A line is compiled into scratch space first: every
+   segment takes at least one character, so the longest line bounds both
+   the segments and the squeezed text. */
+static void compile_patterns(Rule* rule) {
+    size_t longest = 0;
+    for (uint8_t i = 0; i < rule->pattern_linecount; ++i) {
+        size_t n = strlen(rule->pattern_lines[i]);
+        if (n > longest) longest = n;
+    }
+    if (longest >= UINT16_MAX) error(ERROR_INVALID_RULE, rule->lineno);
+    PatternSegment* segs = malloc((longest + 1) * sizeof(PatternSegment) + longest + 1);
+    if (!segs) error(ERROR_OUT_OF_MEMORY, rule->lineno);
+    char* text = (char*)(segs + longest + 1);
+
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < rule->pattern_linecount; ++i)
+        total += compile_pattern_line(rule->pattern_lines[i], segs, text) + 1;
+
+    PatternSegment** lines = malloc(rule->pattern_linecount * (sizeof(PatternSegment*) + sizeof(LineSig)) + total * sizeof(PatternSegment));
+    if (!lines) error(ERROR_OUT_OF_MEMORY, rule->lineno);
+    LineSig* sigs = (LineSig*)(lines + rule->pattern_linecount);
+    PatternSegment* out = (PatternSegment*)(sigs + rule->pattern_linecount);
+    for (uint8_t i = 0; i < rule->pattern_linecount; ++i) {
+        uint16_t n = compile_pattern_line(rule->pattern_lines[i], segs, text) + 1;
+        memcpy(out, segs, n * sizeof(PatternSegment));
+        lines[i] = out;
+        pattern_sig(out, &sigs[i]);
+        out += n;
+    }
+    rule->pattern_segments = lines;
+    rule->pattern_sigs = sigs;
+    free(segs);
+}
+
+/* Split one replacement line into segments (see rules.h). With `seg`
+   NULL the segments are only counted. Returns the number of segments,
+   excluding the terminating segEnd. */
+static uint16_t compile_replacement_line(const char* templ, ReplacementSegment* seg, int lineno) {
+    ReplacementSegment scratch;
+    const char* p = templ;
+    uint16_t count = 0;
+    while (*p) {
+        ReplacementSegment* s = seg ? &seg[count] : &scratch;
+        ++count;
+        s->var = 0;
+        s->len = 0;
+        s->text = NULL;
+        s->expr = NULL;
+        if (is_placeholder(p)) {
+            s->type = segCapture;
+            s->var = p[1] - '0';
+            p += 2;
+        }
+        else if (strncmp(p, "$eval(", 6) == 0) {
+            const char* start = p + 6;
+            const char* end = start;
+            uint8_t depth = 1;
+            for (; *end; ++end) {
+                if (*end == '(') ++depth;
+                else if (*end == ')' && --depth == 0) break;
+            }
+            if (depth) error(ERROR_INVALID_EXPRESSION, lineno);
+            s->type = segEval;
+            if (seg) {
+                char* text = malloc(end - start + 1);
+                if (!text) error(ERROR_OUT_OF_MEMORY, lineno);
+                memcpy(text, start, end - start);
+                text[end - start] = '\0';
+                s->expr = compile_expression(text, lineno);
+                free(text);
+            }
+            p = end + 1;
+        }
+        else {
+            /* verbatim text up to the next placeholder or $eval */
+            const char* lit_start = p++;
+            while (*p && !is_placeholder(p) && strncmp(p, "$eval(", 6) != 0) ++p;
+            s->type = segText;
+            s->len = p - lit_start;
+            if (seg) s->text = hash_n(lit_start, s->len);
+        }
+    }
+    if (seg) {
+        seg[count].type = segEnd;
+        seg[count].var = 0;
+        seg[count].len = 0;
+        seg[count].text = NULL;
+        seg[count].expr = NULL;
+    }
+    return count;
+}
+
+/* As with patterns, the segment arrays share one allocation with the line
+   table; each $eval expression owns its bytecode. */
+static void compile_replacements(Rule* rule) {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < rule->replacement_linecount; ++i)
+        total += compile_replacement_line(rule->replacement_lines[i], NULL, rule->lineno) + 1;
+
+    ReplacementSegment** lines = malloc(rule->replacement_linecount * sizeof(ReplacementSegment*) + total * sizeof(ReplacementSegment));
+    if (!lines) error(ERROR_OUT_OF_MEMORY, rule->lineno);
+    ReplacementSegment* out = (ReplacementSegment*)(lines + rule->replacement_linecount);
+    for (uint8_t i = 0; i < rule->replacement_linecount; ++i) {
+        lines[i] = out;
+        out += compile_replacement_line(rule->replacement_lines[i], out, rule->lineno) + 1;
+    }
+    rule->replacement_segments = lines;
+}
+
+/* Resolve the rule file: the name as given, otherwise under SEARCH_PATH.
+   Returns a malloc'd path. */
+char* probe_rules(const char* filename) {
+    char* path = malloc(strlen(filename) + sizeof(SEARCH_PATH) + 1);
+    if (!path) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+    strcpy(path, filename);
+    if (!file_timestamp(path)) {
+        sprintf(path, "%s%s", SEARCH_PATH, filename);
+    }
+    return path;
+}
+
+/* The precompiled image for "rules.opt" is "rules.optc". Returns a malloc'd name. */
+char* rule_cache_filename(const char* filename) {
+    char* cachename = malloc(strlen(filename) + 2);
+    if (!cachename) {
+        printf("Out of memory\n");
+        return NULL;
+    }
+    strcpy(cachename, filename);
+    strcat(cachename, "c");
+    return cachename;
+}
+
+/* Lines of the rule being parsed, already interned. */
+static char* rule_lines[MAX_RULE_LINES];
+
+Rule* parse_rules(const char* filename) {
+    int8_t fp = open_file(filename);
+    if (fp < 0) {
+        printf("Error opening rule file: %s\n", filename);
+        return NULL;
+    }
+    return parse_rules_from(fp);
+}
+
+Rule* parse_rules_from(int8_t fp) {
+    int capacity = 5;
+    Rule* rules = malloc(capacity * sizeof(Rule));
+    if (rules == NULL) {
+        error(ERROR_OUT_OF_MEMORY, 0);
+        return NULL;
+    }
+
+    enum { STATE_START, STATE_IN_PATTERN, STATE_IN_REPLACEMENT, STATE_IN_CONSTRAINT } state = STATE_START;
+
+    int current_lineno = 0;
+    int rule_lineno = 0;
+    char** pattern_lines = NULL;
+    uint8_t pattern_linecount = 0;
+    char** replacement_lines = NULL;
+    uint8_t replacement_linecount = 0;
+    TokenizedExpr* constraint_expr = NULL;
+    rule_count = 0;
+    memset(&key_index, 0, sizeof(key_index));
+    memset(&mnemonic_index, 0, sizeof(mnemonic_index));
+    generic_rules = NULL;
+
+    char* line = NULL;
+    linelen_t line_cap = 0;
+    linelen_t line_len;
+    while (read_line_grow(fp, &line, &line_cap, &line_len) >= 0) {
+        ++current_lineno;
+        char* trimmed = trim(line);
+        if (trimmed[0] == '\0' || trimmed[0] == '#') continue;
+        do {
+            switch (state) {
+                case STATE_START:
+                    if (strncmp(trimmed, "pattern:", 8) != 0) error(ERROR_EXPECTED_REPLACEMENT_OR_CONSTRAINT, current_lineno);
+                    state = STATE_IN_PATTERN;
+                    rule_lineno = current_lineno;
+
+                    if (rule_count >= capacity) {
+                        capacity *= 2;
+                        rules = realloc(rules, capacity * sizeof(Rule));
+                        if (rules == NULL) {
+                            printf("Out of memory\n");
+                            return NULL;
+                        }
+                    }
+                    break;
+
+                case STATE_IN_PATTERN:
+                    if (strncmp(trimmed, "replacement:", 12) == 0)
+                        state = STATE_IN_REPLACEMENT;
+                    else if (strncmp(trimmed, "constraints:", 12) == 0)
+                        state = STATE_IN_CONSTRAINT;
+
+                    if (state == STATE_IN_PATTERN) {
+                        if (pattern_linecount == MAX_RULE_LINES) error(ERROR_TOO_MANY_LINES, current_lineno);
+                        rule_lines[pattern_linecount++] = hash(line);
+                    }
+                    else {
+                        pattern_lines = malloc(pattern_linecount * sizeof(char*));
+                        if (pattern_lines == NULL) error(ERROR_OUT_OF_MEMORY, current_lineno);
+                        for (uint8_t i = 0; i < pattern_linecount; ++i)
+                            pattern_lines[i] = rule_lines[i];
+                    }
+                    break;
+
+                case STATE_IN_CONSTRAINT:
+                    if (strncmp(trimmed, "replacement:", 12) == 0)
+                        state = STATE_IN_REPLACEMENT;
+                    else {
+                        if (constraint_expr != NULL && strlen(trim(line)) != 0) error(ERROR_MULTILINE_CONSTRAINT, current_lineno);
+                        constraint_expr = compile_expression(trimmed, current_lineno);
+                    }
+                    break;
+
+                case STATE_IN_REPLACEMENT:
+                    if (strncmp(trimmed, "pattern:", 8) == 0)
+                        state = STATE_START;
+
+                    if (state == STATE_IN_REPLACEMENT) {
+                        if (replacement_linecount == MAX_RULE_LINES) error(ERROR_TOO_MANY_LINES, current_lineno);
+                        if (trimmed[0] == '-') {
+                            rule_lines[replacement_linecount++] = hash("");
+                        }
+                        else {
+                            rule_lines[replacement_linecount++] = hash(line);
+                        }
+                    }
+                    else {
+                        replacement_lines = malloc(replacement_linecount * sizeof(char*));
+                        if (replacement_lines == NULL) error(ERROR_OUT_OF_MEMORY, current_lineno);
+                        for (uint8_t i = 0; i < replacement_linecount; ++i)
+                            replacement_lines[i] = rule_lines[i];
+
+                        Rule* rule = &rules[rule_count++];
+                        rule->lineno = rule_lineno;
+                        rule->pattern_lines = pattern_lines;
+                        rule->pattern_linecount = pattern_linecount;
+                        rule->replacement_lines = replacement_lines;
+                        rule->replacement_linecount = replacement_linecount;
+                        rule->constraint_expr = constraint_expr;
+
+                        pattern_lines = NULL; pattern_linecount = 0;
+                        replacement_lines = NULL; replacement_linecount = 0;
+                        constraint_expr = NULL;
+                    }
+                    break;
+            }
+        } while (state == STATE_START);
+    }
+    free(line);
+
+    if (pattern_linecount || replacement_linecount) {
+        if (replacement_linecount == 0) error(ERROR_EXPECTED_REPLACEMENT_OR_CONSTRAINT, current_lineno);
+        if (pattern_linecount == 0) error(ERROR_EXPECTED_PATTERN, current_lineno);
+
+        replacement_lines = malloc(replacement_linecount * sizeof(char*));
+        if (replacement_lines == NULL) error(ERROR_OUT_OF_MEMORY, current_lineno);
+        for (uint8_t i = 0; i < replacement_linecount; ++i)
+            replacement_lines[i] = rule_lines[i];
+
+        Rule* rule = &rules[rule_count++];
+        rule->lineno = rule_lineno;
+        rule->pattern_lines = pattern_lines;
+        rule->pattern_linecount = pattern_linecount;
+        rule->replacement_lines = replacement_lines;
+        rule->replacement_linecount = replacement_linecount;
+        rule->constraint_expr = constraint_expr;
+
+        pattern_lines = NULL; pattern_linecount = 0;
+        replacement_lines = NULL; replacement_linecount = 0;
+        constraint_expr = NULL;
+    }
+
+    close_file(fp);
+
+    for (int i = 0; i < rule_count; i++) {
+        rules[i].id = (uint16_t)i;
+        compile_patterns(&rules[i]);
+        compile_replacements(&rules[i]);
+    }
+    for (int i = rule_count - 1; i >= 0; i--) {
+        add_rule_to_index(&rules[i]);
+    }
+    index_build(&key_index);
+    index_build(&mnemonic_index);
+    index_mnemonics();
+    check_rule_features(rules, rule_count);
+
+    return rules;
+}
+
+/* Load the rule set, preferring the precompiled image when it was compiled
+   from the source file as it is now. */
+Rule* load_rules(const char* filename) {
+    char* path = probe_rules(filename);
+    if (!path) return NULL;
+
+    Rule* rules = NULL;
+    char* cachename = rule_cache_filename(path);
+    if (cachename) {
+        rules = load_rule_cache(cachename, file_timestamp(path), file_size(path));
+        free(cachename);
+    }
+    if (!rules) {
+        rules = parse_rules(path);
+    }
+    free(path);
+    return rules;
+}
+
+void free_rules(Rule* rules) {
+    label_rules = 0;
+    value_rules = 0;
+    longest_replacement = 0;
+    if (rule_cache_loaded()) {
+        free_rule_cache();
+        return;
+    }
+    for (int i = 0; i < rule_count; ++i) {
+        free(rules[i].pattern_lines);
+        free(rules[i].pattern_segments);
+        free(rules[i].replacement_lines);
+        for (uint8_t j = 0; j < rules[i].replacement_linecount; ++j) {
+            for (ReplacementSegment* seg = rules[i].replacement_segments[j]; seg->type != segEnd; ++seg)
+                free_tokenized_expr(seg->expr);
+        }
+        free(rules[i].replacement_segments);
+        free_tokenized_expr(rules[i].constraint_expr);
+    }
+    free(rules);
+    index_free(&key_index);
+    index_free(&mnemonic_index);
+    memset(mnemonic_chains, 0, sizeof(mnemonic_chains));
+    while (generic_rules) {
+        RuleNode* next = generic_rules->next;
+        free(generic_rules);
+        generic_rules = next;
+    }
+}
+
+typedef enum { vtInt, vtString } ValueType;
+typedef struct Value {
+    ValueType vt;
+    union {
+        struct {
+            const char* strval;     /* not terminated, see Binding */
+            linelen_t len;
+        };
+        int intval;
+    };
+} Value;
+
+// Global buffer to hold the current token string, grown by init_tokenizer
+// to the length of the expression, the longest a token can be.
+char* token;
+static size_t token_cap;
+TokenType tok;
+int token_lineno;
+
+/* Compile an expression into a token array for fast repeated evaluation */
+TokenizedExpr* compile_expression(const char* expr, int lineno);
+void free_tokenized_expr(TokenizedExpr* e);
+int eval_tokenized(TokenizedExpr* e, Binding bindings[10], OptimizerContext* ctx, uint8_t end, int lineno);
+
+// Global pointer that tracks our current position in the input string.
+static const char* tokptr = NULL;
+
+void init_tokenizer(const char* str, int lineno) {
+    size_t need = strlen(str) + 1;
+    if (need > token_cap) {
+        free(token);
+        token = malloc(need);
+        if (!token) error(ERROR_OUT_OF_MEMORY, lineno);
+        token_cap = need;
+    }
+    tokptr = str;
+    paren_depth = 0;
+    token_lineno = lineno;
+}
+
+TokenType get_token(void) {
+    tok = tokNone;
+    char* temp = token;
+
+    // Skip whitespace.
+    while (*tokptr && *tokptr == ' ') {
+        tokptr++;
+    }
+
+    if (*tokptr == '\0') {
+        return (tok = tokEos);
+    }
+
+    switch (*tokptr) {
+        case '(': *temp++ = *tokptr++; tok = tokLParen; ++paren_depth; break;
+        case ')': *temp++ = *tokptr++; tok = tokRParen; --paren_depth; break;
+        case '+': *temp++ = *tokptr++; tok = tokPlus; break;
+        case '-': *temp++ = *tokptr++; tok = tokMinus; break;
+        case '*': *temp++ = *tokptr++; tok = tokTimes; break;
+        case '/': *temp++ = *tokptr++; tok = tokDivide; break;
+        case '%': *temp++ = *tokptr++; tok = tokMod; break;
+        case '<': *temp++ = *tokptr++; tok = tokLt;
+            if (*tokptr == '=') {
+                *temp++ = *tokptr++;
+                tok = tokLe;
+            }
+            else if (*tokptr == '>') {
+                *temp++ = *tokptr++;
+                tok = tokNe;
+            }
+            break;
+        case '>': *temp++ = *tokptr++; tok = tokGt;
+            if (*tokptr == '=') {
+                *temp++ = *tokptr++;
+                tok = tokGe;
+            }
+            break;
+        case '=': *temp++ = *tokptr++; tok = tokEq; break;
+        case '$':
+            tokptr++; // skip '$'            
+            if (*tokptr == '$') {
+                *temp++ = '$';
+                tokptr++; // skip '$'
+                tok = tokLiteral;
+            }
+            else if (isdigit(*tokptr)) {
+                while (*tokptr && isdigit(*tokptr)) {
+                    *temp++ = *tokptr++;
+                }
+                tok = tokVariable;
+            }
+            break;
+        case '"':
+        case '\'':
+        {
+            char terminator = *tokptr;
+            tokptr++; // skip quote
+            while (*tokptr && *tokptr != terminator) {
+                *temp++ = *tokptr++;
+            }
+            if (*tokptr != terminator) error(ERROR_INVALID_EXPRESSION, token_lineno);
+            tokptr++; // skip closing quote
+            tok = tokLiteral;
+        }
+        break;
+        default:
+            if (isdigit(*tokptr)) {
+                while (*tokptr && isdigit(*tokptr)) {
+                    *temp++ = *tokptr++;
+                }
+                tok = tokNumber;
+            }
+            else {
+                while (*tokptr && *tokptr != ' ' && *tokptr != ')') {
+                    *temp++ = *tokptr++;
+                }
+                *temp = '\0';
+                /* Reduce repeated strcmp calls by routing based on first char */
+                switch (token[0]) {
+                    case 'h':
+                        if (strcmp(token, "holds") == 0) tok = tokHolds;
+                        else tok = tokLiteral;
+                        break;
+                    case 'i':
+                        if (strcmp(token, "isnumeric") == 0) tok = tokIsNumeric;
+                        else if (strcmp(token, "isret") == 0) tok = tokIsRet;
+                        else tok = tokLiteral;
+                        break;
+                    case 'a':
+                        if (strcmp(token, "and") == 0) tok = tokAnd;
+                        else tok = tokLiteral;
+                        break;
+                    case 'b':
+                        if (strcmp(token, "band") == 0) tok = tokBand;
+                        else if (strcmp(token, "bor") == 0) tok = tokBor;
+                        else if (strcmp(token, "bxor") == 0) tok = tokBxor;
+                        else tok = tokLiteral;
+                        break;
+                    case 'd':
+                        if (strcmp(token, "dead") == 0) tok = tokDead;
+                        else tok = tokLiteral;
+                        break;
+                    case 'k':
+                        if (strcmp(token, "knownval") == 0) tok = tokKnownVal;
+                        else tok = tokLiteral;
+                        break;
+                    case 'o':
+                        if (strcmp(token, "or") == 0) tok = tokOr;
+                        else tok = tokLiteral;
+                        break;
+                    case 'r':
+                        if (strcmp(token, "refs") == 0) tok = tokRefs;
+                        else tok = tokLiteral;
+                        break;
+                    case 't':
+                        if (strcmp(token, "target") == 0) tok = tokTarget;
+                        else tok = tokLiteral;
+                        break;
+                    case 's':
+                        if (strcmp(token, "startswith") == 0) tok = tokStartsWith;
+                        else if (strcmp(token, "shl") == 0) tok = tokShl;
+                        else if (strcmp(token, "shr") == 0) tok = tokShr;
+                        else tok = tokLiteral;
+                        break;
+                    case 'x':
+                        if (strcmp(token, "xor") == 0) tok = tokXor;
+                        else tok = tokLiteral;
+                        break;
+                    default:
+                        tok = tokLiteral;
+                        break;
+                }
+            }
+            break;
+    }
+    *temp = '\0';
+
+    return tok;
+}
+
+/* Depth of the evaluation stack used by eval_tokenized. Deeper
+   expressions are rejected when they are compiled. */
+#define EVAL_STACK_SIZE 10
+
+/* Whether the `len` characters at `s` form a number */
+int is_numeric(const char* s, linelen_t len) {
+    if (s == NULL || len == 0)
+        return 0;
+    const char* p = s;
+    const char* end = s + len;
+    if (*p == '-' || *p == '+')
+        p++;
+    /* Z80 assembler hex: $xx */
+    if (p < end && *p == '$') {
+        p++;
+        if (p == end || !isxdigit((unsigned char)*p))
+            return 0;
+        while (p < end && isxdigit((unsigned char)*p))
+            p++;
+        return (p == end);
+    }
+    /* C-style hex: 0x... */
+    if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        p += 2;
+        if (p == end || !isxdigit((unsigned char)*p))
+            return 0;
+        while (p < end && isxdigit((unsigned char)*p))
+            p++;
+        return (p == end);
+    }
+    while (p < end) {
+        if (!isdigit((unsigned char)*p))
+            return 0;
+        p++;
+    }
+    return 1;
+}
+
+/* Compare two slices in the order strcmp would give the strings */
+static int compare_slices(const char* a, linelen_t alen, const char* b, linelen_t blen) {
+    int r = memcmp(a, b, alen < blen ? alen : blen);
+    if (r) return r;
+    return alen < blen ? -1 : alen > blen;
+}
+
+/* Push-ready value of a binding, classifying the capture on first use.
+   A numeral is read by parse_number, as the value tracker reads it, so
+   `holds` compares like with like. */
+static void binding_value(Binding* b, Value* v) {
+    if (b->type == bindUnknown) {
+        int32_t n;
+        if (is_numeric(b->str, b->len) && parse_number(b->str, b->len, &n)) {
+            b->type = bindInt;
+            b->intval = (int)n;
+        }
+        else {
+            b->type = bindString;
+        }
+    }
+    if (b->type == bindInt) {
+        v->vt = vtInt;
+        v->intval = b->intval;
+    }
+    else {
+        v->vt = vtString;
+        v->strval = b->str;
+        v->len = b->len;
+    }
+}
+
+/* Apply a binary operator to the top two values. The operand count is
+   checked when the expression is compiled (verify_expression). */
+static void eval_binop(Value* stack, uint8_t* top, TokenType op, int lineno) {
+    Value y = stack[--(*top)];
+    Value x = stack[--(*top)];
+    if (x.vt == vtInt && y.vt == vtInt) {
+        switch (op) {
+            case tokPlus: x.intval = x.intval + y.intval; break;
+            case tokMinus: x.intval = x.intval - y.intval; break;
+            case tokTimes: x.intval = x.intval * y.intval; break;
+            case tokDivide: x.intval = x.intval / y.intval; break;
+            case tokMod: x.intval = x.intval % y.intval; break;
+            case tokLt: x.intval = (x.intval < y.intval); break;
+            case tokGt: x.intval = (x.intval > y.intval); break;
+            case tokLe: x.intval = (x.intval <= y.intval); break;
+            case tokGe: x.intval = (x.intval >= y.intval); break;
+            case tokEq: x.intval = (x.intval == y.intval); break;
+            case tokNe: x.intval = (x.intval != y.intval); break;
+            case tokAnd:  x.intval = (x.intval != 0) && (y.intval != 0); break;
+            case tokOr:   x.intval = (x.intval != 0) || (y.intval != 0); break;
+            case tokXor:  x.intval = (x.intval && !y.intval) || (!x.intval && y.intval); break;
+            case tokBand: x.intval = x.intval & y.intval; break;
+            case tokBor:  x.intval = x.intval | y.intval; break;
+            case tokBxor: x.intval = x.intval ^ y.intval; break;
+            case tokShl:  x.intval = x.intval << y.intval; break;
+            case tokShr:  x.intval = x.intval >> y.intval; break;
+            default:
+                error(ERROR_INVALID_EXPRESSION, lineno);
+        }
+        stack[(*top)++] = x;
+        return;
+    }
+
+    /* A string operand only takes part in comparisons. With an int on the
+       other side the int is compared as its decimal text. */
+    int r;
+    switch (op) {
+        case tokLt:
+        case tokGt:
+        case tokLe:
+        case tokGe:
+        case tokEq:
+        case tokNe:
+            break;
+        default:
+            error(ERROR_INVALID_EXPRESSION, lineno);
+    }
+    if (x.vt == vtString && y.vt == vtString) {
+        r = compare_slices(x.strval, x.len, y.strval, y.len);
+    }
+    else {
+        char numbuf[32];
+        if (x.vt == vtInt) {
+            snprintf(numbuf, sizeof(numbuf), "%d", x.intval);
+            r = compare_slices(numbuf, strlen(numbuf), y.strval, y.len);
+        }
+        else {
+            snprintf(numbuf, sizeof(numbuf), "%d", y.intval);
+            r = compare_slices(x.strval, x.len, numbuf, strlen(numbuf));
+        }
+    }
+    switch (op) {
+        case tokLt: x.intval = r < 0; break;
+        case tokGt: x.intval = r > 0; break;
+        case tokLe: x.intval = r <= 0; break;
+        case tokGe: x.intval = r >= 0; break;
+        case tokEq: x.intval = r == 0; break;
+        case tokNe: x.intval = r != 0; break;
+        default:
+            error(ERROR_INVALID_EXPRESSION, lineno);
+    }
+    x.vt = vtInt;
+    stack[(*top)++] = x;
+}
+
+static int is_comparison(TokenType t) {
+    return t >= tokLt && t <= tokNe;
+}
+
+static int is_binop(TokenType t) {
+    return t >= tokPlus && t <= tokShr;
+}
+
+/* Static type of a stack slot while verifying; a variable's type is only
+   known once it is bound. */
+typedef enum { stInt, stString, stAny } StaticType;
+
+static Value const_value(const TokenEntry* te) {
+    Value v;
+    if (te->type == tokNumber) {
+        v.vt = vtInt;
+        v.intval = te->intval;
+    }
+    else {
+        v.vt = vtString;
+        v.strval = te->strval;
+        v.len = te->intval;
+    }
+    return v;
+}
+
+/* Check the RPN of a freshly tokenized expression by running it over the
+   static types of its operands, and fold every operator whose operands
+   are constants into a number. Folded operands are always the last
+   entries written, so the folding happens in place. Invalid expressions
+   end the load with an error. */
+static void verify_expression(TokenizedExpr* e, int lineno) {
+    uint8_t type[EVAL_STACK_SIZE];
+    uint8_t konst[EVAL_STACK_SIZE];
+    int first[EVAL_STACK_SIZE];     /* first entry of each slot's operand */
+    uint8_t top = 0;
+    int out = 0;
+    static const RegValues no_values;
+    uint16_t width;
+
+#define PUSH(t, k) do { \
+        if (top == EVAL_STACK_SIZE) error(ERROR_INVALID_EXPRESSION, lineno); \
+        type[top] = (t); konst[top] = (k); first[top] = out; ++top; \
+    } while (0)
+
+    for (int i = 0; i < e->count; ++i) {
+        TokenEntry te = e->entries[i];
+        switch (te.type) {
+            case tokNumber:
+                PUSH(stInt, 1);
+                break;
+            case tokLiteral:
+                PUSH(stString, 1);
+                break;
+            case tokVariable:
+                if (i + 1 < e->count && e->entries[i + 1].type == tokIsNumeric) {
+                    te.type = tokVarIsNumeric;
+                    ++i;
+                    PUSH(stInt, 0);
+                }
+                else {
+                    PUSH(stAny, 0);
+                }
+                break;
+            case tokIsNumeric:
+                if (top < 1) error(ERROR_INVALID_EXPRESSION, lineno);
+                if (konst[top - 1]) {
+                    Value v = const_value(&e->entries[--out]);
+                    te.type = tokNumber;
+                    te.strval = NULL;
+                    te.intval = v.vt == vtInt || is_numeric(v.strval, v.len);
+                }
+                type[top - 1] = stInt;
+                break;
+            case tokDead:
+                /* A literal register name is looked up here; one that is
+                   not tracked is an error rather than never dead. */
+                if (top < 1 || type[top - 1] == stInt) error(ERROR_INVALID_EXPRESSION, lineno);
+                if (konst[top - 1]) {
+                    Value v = const_value(&e->entries[--out]);
+                    int mask = register_mask(v.strval, v.len);
+                    if (mask <= 0) error(ERROR_INVALID_EXPRESSION, lineno);
+                    te.type = tokRegsDead;
+                    te.strval = NULL;
+                    te.intval = mask;
+                }
+                konst[top - 1] = 0;
+                type[top - 1] = stInt;
+                break;
+            case tokRefs:
+            case tokIsRet:
+            case tokTarget:
+                /* The label table belongs to the input, so these are
+                   never folded. target gives back a name that is not a
+                   label unchanged. */
+                if (top < 1 || type[top - 1] == stInt) error(ERROR_INVALID_EXPRESSION, lineno);
+                konst[top - 1] = 0;
+                if (te.type != tokTarget) type[top - 1] = stInt;
+                break;
+            case tokKnownVal:
+            case tokHolds: {
+                /* Known values change from line to line, so these are
+                   never folded; a literal name that is not tracked is an
+                   error. holds compares the value under the name. */
+                uint8_t name = top - 1 - (te.type == tokHolds);
+                if (top < 1 + (te.type == tokHolds) || type[name] == stInt ||
+                    (te.type == tokHolds && type[top - 1] == stString))
+                    error(ERROR_INVALID_EXPRESSION, lineno);
+                if (konst[name]) {
+                    Value v = const_value(&e->entries[first[name]]);
+                    if (known_value(&no_values, v.strval, v.len, &width) == VALUE_UNTRACKED)
+                        error(ERROR_INVALID_EXPRESSION, lineno);
+                }
+                top = name + 1;
+                konst[name] = 0;
+                type[name] = stInt;
+            } break;
+            case tokStartsWith:
+                if (top < 2 || type[top - 1] == stInt || type[top - 2] == stInt)
+                    error(ERROR_INVALID_EXPRESSION, lineno);
+                --top;
+                if (konst[top] && konst[top - 1]) {
+                    Value y = const_value(&e->entries[--out]);
+                    Value x = const_value(&e->entries[--out]);
+                    te.type = tokNumber;
+                    te.strval = NULL;
+                    te.intval = x.len >= y.len && memcmp(x.strval, y.strval, y.len) == 0;
+                }
+                else konst[top - 1] = 0;
+                type[top - 1] = stInt;
+                break;
+            default:
+                if (!is_binop(te.type) || top < 2)
+                    error(ERROR_INVALID_EXPRESSION, lineno);
+                if (!is_comparison(te.type) && (type[top - 1] == stString || type[top - 2] == stString))
+                    error(ERROR_INVALID_EXPRESSION, lineno);
+                --top;
+                if (konst[top] && konst[top - 1]) {
+                    Value v[2];
+                    uint8_t vtop = 2;
+                    v[1] = const_value(&e->entries[--out]);
+                    v[0] = const_value(&e->entries[--out]);
+                    if ((te.type == tokDivide || te.type == tokMod) && v[1].intval == 0)
+                        error(ERROR_INVALID_EXPRESSION, lineno);
+                    eval_binop(v, &vtop, te.type, lineno);
+                    te.type = tokNumber;
+                    te.strval = NULL;
+                    te.intval = v[0].intval;
+                }
+                else konst[top - 1] = 0;
+                type[top - 1] = stInt;
+                break;
+        }
+        e->entries[out++] = te;
+    }
+#undef PUSH
+
+    if (top != 1 || type[0] == stString) error(ERROR_INVALID_EXPRESSION, lineno);
+    e->count = out;
+}
+
+/* Compile expression into token entries */
+TokenizedExpr* compile_expression(const char* expr, int lineno) {
+    TokenizedExpr* e = malloc(sizeof(TokenizedExpr));
+    if (!e) error(ERROR_OUT_OF_MEMORY, lineno);
+    e->count = 0; e->capacity = 16;
+    e->entries = malloc(e->capacity * sizeof(TokenEntry));
+    if (!e->entries) error(ERROR_OUT_OF_MEMORY, lineno);
+
+    init_tokenizer(expr, lineno);
+    while (get_token() != tokEos) {
+        TokenEntry te = { 0 };
+        te.type = tok;
+        te.strval = NULL;
+        te.intval = 0;
+        switch (tok) {
+            case tokNumber:
+                te.intval = atoi(token);
+                break;
+            case tokVariable:
+                te.intval = token[0] - '0';
+                break;
+            case tokLiteral:
+                te.strval = hash(token);
+                te.intval = strlen(token);
+                break;
+            case tokLParen:
+            case tokRParen:
+                continue;
+            default:
+                break;
+        }
+        if (e->count >= e->capacity) {
+            e->capacity *= 2;
+            e->entries = realloc(e->entries, e->capacity * sizeof(TokenEntry));
+            if (!e->entries) error(ERROR_OUT_OF_MEMORY, lineno);
+        }
+        e->entries[e->count++] = te;
+    }
+    verify_expression(e, lineno);
+    return e;
+}
+
+void free_tokenized_expr(TokenizedExpr* e) {
+    if (!e) return;
+    free(e->entries);
+    free(e);
+}
+
+/* Registers live after window line `end` - 1, found by walking back from
+   the end of the window. Everything is live at the window end, as the
+   lines beyond it are unknown. */
+static uint16_t live_after(OptimizerContext* ctx, uint8_t end) {
+    uint16_t live = REG_ALL;
+    for (uint16_t i = ctx->window_size; i > end; --i) {
+        WindowLine* w = WINDOW_LINE(ctx, i - 1);
+        if (!w->effect_known) {
+            line_effect(w->text, &w->regs_used, &w->regs_set);
+            w->effect_known = 1;
+        }
+        live = (live & ~w->regs_set) | w->regs_used;
+    }
+    return live;
+}
+
+/* The label a value names, if the input has a label table */
+static Label* value_label(const OptimizerContext* ctx, const Value* v) {
+    /* a label name is at most 65535 characters */
+    if (v->vt != vtString || ctx->labels == NULL || v->len > UINT16_MAX) return NULL;
+    return label_find(ctx->labels, v->strval, (uint16_t)v->len);
+}
+
+#define DEFINED_ONCE(l) (((l)->flags & (LABEL_DEFINED | LABEL_REDEFINED)) == LABEL_DEFINED)
+
+/* Run a verified expression into `result`. Only a variable bound to a
+   string can still fail here, by reaching an arithmetic operator. The
+   `dead` operator looks at the window lines from `end` on, those after
+   the match; knownval and holds at the values before the window head,
+   where the match starts. */
+static void eval_value(TokenizedExpr* e, Binding bindings[10], OptimizerContext* ctx, uint8_t end, int lineno,
+                       Value* result) {
+    Value stack[EVAL_STACK_SIZE];
+    uint8_t top = 0;
+    for (int i = 0; i < e->count; ++i) {
+        TokenEntry* te = &e->entries[i];
+        switch (te->type) {
+            case tokNumber:
+                stack[top].vt = vtInt;
+                stack[top++].intval = te->intval;
+                break;
+            case tokLiteral:
+                stack[top].vt = vtString;
+                stack[top].strval = te->strval;
+                stack[top++].len = te->intval;
+                break;
+            case tokVariable:
+                binding_value(&bindings[te->intval], &stack[top++]);
+                break;
+            case tokVarIsNumeric:
+                binding_value(&bindings[te->intval], &stack[top]);
+                stack[top].intval = stack[top].vt == vtInt;
+                stack[top++].vt = vtInt;
+                break;
+            case tokIsNumeric: {
+                Value* v = &stack[top - 1];
+                v->intval = v->vt == vtInt || is_numeric(v->strval, v->len);
+                v->vt = vtInt;
+            } break;
+            case tokStartsWith: {
+                Value* y = &stack[--top];
+                Value* x = &stack[top - 1];
+                if (x->vt == vtString && y->vt == vtString)
+                    x->intval = x->len >= y->len && memcmp(x->strval, y->strval, y->len) == 0;
+                else
+                    x->intval = 0;
+                x->vt = vtInt;
+            } break;
+            case tokRegsDead:
+                stack[top].vt = vtInt;
+                stack[top++].intval = (live_after(ctx, end) & te->intval) == 0;
+                break;
+            case tokDead: {
+                Value* v = &stack[top - 1];
+                int mask = v->vt == vtString ? register_mask(v->strval, v->len) : -1;
+                v->intval = mask > 0 && (live_after(ctx, end) & mask) == 0;
+                v->vt = vtInt;
+            } break;
+            case tokRefs: {
+                /* -1 when the count is not known */
+                Value* v = &stack[top - 1];
+                Label* l = value_label(ctx, v);
+                if (l && DEFINED_ONCE(l)) {
+                    uint32_t refs = label_refs(l, ctx->label_counts, WINDOW_LINE(ctx, 0)->lineno);
+                    v->intval = refs < INT_MAX ? (int)refs : INT_MAX;
+                }
+                else v->intval = -1;
+                v->vt = vtInt;
+            } break;
+            case tokIsRet: {
+                Value* v = &stack[top - 1];
+                Label* l = value_label(ctx, v);
+                if (l) l = label_target(l);
+                v->intval = l && DEFINED_ONCE(l) && (l->flags & LABEL_TO_RET);
+                v->vt = vtInt;
+            } break;
+            case tokTarget: {
+                Value* v = &stack[top - 1];
+                Label* l = value_label(ctx, v);
+                if (l) {
+                    l = label_target(l);
+                    v->strval = l->name;
+                    v->len = l->len;
+                }
+            } break;
+            case tokKnownVal: {
+                /* -1 when the value is not known */
+                Value* v = &stack[top - 1];
+                uint16_t width;
+                int known = v->vt == vtString ? known_value(&ctx->values, v->strval, v->len, &width) : -1;
+                v->intval = known >= 0 ? known : -1;
+                v->vt = vtInt;
+            } break;
+            case tokHolds: {
+                Value* y = &stack[--top];
+                Value* x = &stack[top - 1];
+                uint16_t width;
+                int known = x->vt == vtString && y->vt == vtInt && !VALUES_NONE(&ctx->values) ?
+                    known_value(&ctx->values, x->strval, x->len, &width) : -1;
+                x->intval = known >= 0 && known == (y->intval & width);
+                x->vt = vtInt;
+            } break;
+            default:
+                eval_binop(stack, &top, te->type, lineno);
+                break;
+        }
+    }
+    *result = stack[0];
+}
+
+/* Run a verified expression that has to give a number, as a constraint
+   does */
+int eval_tokenized(TokenizedExpr* e, Binding bindings[10], OptimizerContext* ctx, uint8_t end, int lineno) {
+    Value v;
+    eval_value(e, bindings, ctx, end, lineno, &v);
+    if (v.vt != vtInt) error(ERROR_INVALID_EXPRESSION, lineno);
+    return v.intval;
+}
+
+/* Find the first occurrence of a capture's terminating literal in `l`. */
+static const char* find_segment_text(const char* l, const PatternSegment* seg) {
+    while ((l = strchr(l, seg->first)) != NULL) {
+        if (strncmp(l, seg->text, seg->len) == 0) return l;
+        ++l;
+    }
+    return NULL;
+}
+
+int match_pattern_line(const PatternSegment* seg, const char* line, Binding bindings[10]) {
+    const char* l = line;
+
+    for (; seg->type != segEnd; ++seg) {
+        while (*l == ' ') ++l;
+        if (seg->type == segText) {
+            if (*l != seg->first)
+                return 0;
+            ++l;
+            for (const char* t = seg->text + 1; *t; ++t) {
+                while (*l == ' ') ++l;
+                if (*l != *t)
+                    return 0;
+                ++l;
+            }
+        }
+        else {
+            const char* end;
+            if (seg->len == 0) {
+                /* No literal after the placeholder: grab the rest of the line */
+                end = l + strlen(l);
+            }
+            else {
+                end = find_segment_text(l, seg);
+                if (!end)
+                    return 0;
+            }
+            linelen_t var_len = (linelen_t)(end - l);
+            Binding* b = &bindings[seg->var];
+            if (b->str) {
+                if (b->len != var_len || memcmp(b->str, l, var_len) != 0)
+                    return 0;
+            }
+            else {
+                b->str = l;
+                b->len = var_len;
+            }
+            l = end + seg->len;
+        }
+    }
+    while (*l == ' ') ++l;   /* trailing spaces in line are ignored */
+    if (*l != '\0' && *l != '\n')
+        return 0;
+    return 1;
+}
+
+
+/* Rule ids in OptimizerContext.no_match */
+#define NO_MATCH_BIT(id) ((uint32_t)1 << ((id) & 31))
+#define NO_MATCH(ctx, id) ((ctx)->no_match[(id) >> 5] & NO_MATCH_BIT(id))
+#define NO_MATCH_SET(ctx, id) ((ctx)->no_match[(id) >> 5] |= NO_MATCH_BIT(id))
+
+/* Each pattern line is first checked against its window line's signature:
+   the line must contain every character the pattern requires and be long
+   enough to hold them. A literal pattern line matches exactly when the
+   interned pointers agree, so it needs no string matching at all. A
+   failure on the first line depends on nothing but the head line, and is
+   noted in no_match. */
+uint8_t match_rule(OptimizerContext* ctx, Rule* rule, Binding bindings[10]) {
+    uint8_t last_line = (rule->pattern_linecount < ctx->window_size ? rule->pattern_linecount : ctx->window_size);
+
+    for (uint8_t i = 0; i < last_line; ++i) {
+        const LineSig* p = &rule->pattern_sigs[i];
+        const LineSig* l = &WINDOW_LINE(ctx, i)->sig;
+        if ((p->mask & ~l->mask) || l->len < p->len || (p->lit && p->lit != l->lit)) {
+            STAT_INC(rule, fail_sig);
+            if (i == 0) NO_MATCH_SET(ctx, rule->id);
+            return 0;
+        }
+    }
+
+#define MATCH_LINE(i) \
+    (rule->pattern_sigs[(i)].lit || match_pattern_line(rule->pattern_segments[(i)], WINDOW_LINE(ctx, i)->text, bindings))
+
+    if (!MATCH_LINE(0)) {
+        STAT_INC(rule, fail_first);
+        NO_MATCH_SET(ctx, rule->id);
+        return 0;
+    }
+    if (last_line == 1) return 1;
+
+    if (!MATCH_LINE(last_line - 1)) {
+        STAT_INC(rule, fail_last);
+        return 0;
+    }
+
+    for (uint8_t i = 1; i < last_line - 1; ++i) {
+        if (!MATCH_LINE(i)) {
+            STAT_INC(rule, fail_middle);
+            return 0;
+        }
+    }
+#undef MATCH_LINE
+    return rule->pattern_linecount;
+}
+
+/* Expand a compiled replacement line into `result` and return a pointer
+   to the terminating NUL. */
+static char* substitute_line(const ReplacementSegment* seg, Binding bindings[10], OptimizerContext* ctx,
+                             uint8_t end, char* result, int lineno) {
+    char* out = result;
+    for (; seg->type != segEnd; ++seg) {
+        if (seg->type == segText) {
+            memcpy(out, seg->text, seg->len);
+            out += seg->len;
+        }
+        else if (seg->type == segCapture) {
+            const Binding* b = &bindings[seg->var];
+            if (b->str) {
+                memcpy(out, b->str, b->len);
+                out += b->len;
+            }
+        }
+        else {
+            /* An $eval gives a number, or a name such as a jump target */
+            Value v;
+            eval_value(seg->expr, bindings, ctx, end, lineno, &v);
+            if (v.vt == vtInt) {
+                out += sprintf(out, "%d", v.intval);
+            }
+            else {
+                memcpy(out, v.strval, v.len);
+                out += v.len;
+            }
+        }
+    }
+    *out = '\0';
+    return out;
+}
+
+/* Upper bound on the size of an $eval result: a minus sign and the widest
+   int, or the longest string it can give - a capture, a literal or a
+   label name. */
+static size_t eval_bound(const TokenizedExpr* e, Binding bindings[10], const OptimizerContext* ctx) {
+    size_t n = 12;
+    if (ctx->labels && ctx->labels->longest > n) n = ctx->labels->longest;
+    for (int i = 0; i < e->count; ++i) {
+        const TokenEntry* te = &e->entries[i];
+        size_t len = 0;
+        if (te->type == tokLiteral) len = te->intval;
+        else if (te->type == tokVariable) len = bindings[te->intval].len;
+        if (len > n) n = len;
+    }
+    return n;
+}
+
+/* Upper bound on the expanded size of a replacement line, terminator
+   included. */
+static size_t substitute_bound(const ReplacementSegment* seg, Binding bindings[10], const OptimizerContext* ctx) {
+    size_t n = 1;
+    for (; seg->type != segEnd; ++seg) {
+        if (seg->type == segText) n += seg->len;
+        else if (seg->type == segCapture) {
+            n += bindings[seg->var].len;
+        }
+        else n += eval_bound(seg->expr, bindings, ctx);
+    }
+    return n;
+}
+
+/* Replacement text is built in a bump arena rather than in the window
+   slots, so the matched lines are untouched while their replacement is
+   generated. repl_live counts the window lines viewing the arena; once
+   the last of them is emitted or replaced the arena is rewound. */
+#define REPL_ARENA_SIZE 512
+
+#define IN_REPL_ARENA(w) ((w)->text != (w)->buf)
+
+/* Detach a line leaving the window; its slot views its own buffer again. */
+static void release_line(OptimizerContext* ctx, WindowLine* w) {
+    if (IN_REPL_ARENA(w)) {
+        w->text = w->buf;
+        if (--ctx->repl_live == 0) ctx->repl_used = 0;
+    }
+}
+
+/* Move the captures that lie in window line `w` along with its text */
+static void rebase_bindings(Binding* bindings, const WindowLine* w, const char* to) {
+    for (uint8_t v = 0; v < 10; ++v) {
+        const char* s = bindings[v].str;
+        if (s && s >= w->text && s <= w->text + w->len)
+            bindings[v].str = to + (s - w->text);
+    }
+}
+
+/* Make room for `need` more bytes. When the arena is full the lines still
+   viewing it are moved to a fresh one, so its size stays proportional to
+   the window rather than to the number of rewrites. Captures of the
+   firing rule that point into a moved line are moved with it. */
+static void repl_reserve(OptimizerContext* ctx, size_t need, Binding* bindings) {
+    if (ctx->repl_used + need <= ctx->repl_cap) return;
+
+    size_t live = 0;
+    for (uint16_t i = 0; i < ctx->window_size; ++i) {
+        WindowLine* w = WINDOW_LINE(ctx, i);
+        if (IN_REPL_ARENA(w)) live += w->len + 1;
+    }
+    size_t cap = ctx->repl_cap ? ctx->repl_cap : REPL_ARENA_SIZE;
+    while (cap < 2 * (live + need)) cap *= 2;
+
+    char* fresh = malloc(cap);
+    if (fresh == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    char* out = fresh;
+    for (uint16_t i = 0; i < ctx->window_size; ++i) {
+        WindowLine* w = WINDOW_LINE(ctx, i);
+        if (IN_REPL_ARENA(w)) {
+            memcpy(out, w->text, w->len + 1);
+            rebase_bindings(bindings, w, out);
+            w->text = out;
+            out += w->len + 1;
+        }
+    }
+    free(ctx->repl_arena);
+    ctx->repl_arena = fresh;
+    ctx->repl_cap = cap;
+    ctx->repl_used = out - fresh;
+}
+
+/* Parse a line entering the window into its signature (see LineSig). The
+   space-free text is only looked up in the rule strings, never added. */
+static void parse_line(WindowLine* w) {
+    char squeezed[MAX_LITERAL_LINE];
+    uint32_t mask = 0;
+    uint16_t n = 0;
+    for (const char* p = w->text; *p && *p != '\n'; ++p) {
+        if (*p == ' ') continue;
+        mask |= SIG_BIT(*p);
+        if (n < MAX_LITERAL_LINE) squeezed[n] = *p;
+        if (n < UINT16_MAX) ++n;
+    }
+    w->sig.mask = mask;
+    w->sig.len = n;
+    w->sig.lit = n <= MAX_LITERAL_LINE ? hash_find(squeezed, n) : NULL;
+    w->indexed = 0;
+    w->memo = 0;
+    w->effect_known = 0;
+}
+
+/* Look up the index chains of the line at the head of the window, once.
+   A known mnemonic is its own get_mnemonic key, so its chain comes
+   straight from mnemonic_chains without hashing. */
+static void index_line(WindowLine* w) {
+    if (w->indexed) return;
+    char key[32];
+    get_index_key(w->text, key, sizeof(key));
+    w->key_rules = index_lookup(&key_index, key);
+    w->mnem = first_word_id(w->text);
+    if (w->mnem) {
+        w->mnem_rules = mnemonic_chains[w->mnem];
+    }
+    else {
+        get_mnemonic(w->text, key);
+        w->mnem_rules = index_lookup(&mnemonic_index, key);
+    }
+    w->indexed = 1;
+}
+
+/* Drop the matched lines and link the replacement lines in front of the
+   rest of the window. Only window_head moves; the remaining lines stay in
+   their slots. */
+void apply_replacement(OptimizerContext* ctx, Rule* rule, Binding* bindings) {
+    size_t need = 0;
+    for (uint8_t i = 0; i < rule->replacement_linecount; i++)
+        need += substitute_bound(rule->replacement_segments[i], bindings, ctx);
+    repl_reserve(ctx, need, bindings);
+
+    char* start = ctx->repl_arena + ctx->repl_used;
+    char* out = start;
+    for (uint8_t i = 0; i < rule->replacement_linecount; i++) {
+        out = substitute_line(rule->replacement_segments[i], bindings, ctx,
+                              rule->pattern_linecount, out, rule->lineno) + 1;
+    }
+    ctx->repl_used = out - ctx->repl_arena;
+    ctx->repl_live += rule->replacement_linecount;
+    /* A replacement that begins with the line the match began at keeps
+       its index chains and the rules already known to fail on it */
+    WindowLine head = *WINDOW_LINE(ctx, 0);
+    uint8_t same_head = rule->replacement_linecount && head.memo && strcmp(head.text, start) == 0;
+    uint32_t lineno = head.lineno;
+
+    for (uint8_t i = 0; i < rule->pattern_linecount; i++) {
+        WindowLine* w = WINDOW_LINE(ctx, i);
+        if (ctx->labels) label_count_refs(ctx->labels, ctx->label_counts, w->text, -1, lineno);
+        release_line(ctx, w);
+    }
+    ctx->window_head = (ctx->window_head + rule->pattern_linecount - rule->replacement_linecount) & ctx->window_mask;
+    ctx->window_size += rule->replacement_linecount - rule->pattern_linecount;
+    for (uint8_t i = 0; i < rule->replacement_linecount; i++) {
+        WindowLine* w = WINDOW_LINE(ctx, i);
+        w->text = start;
+        w->len = (linelen_t)strlen(start);
+        w->lineno = lineno;
+        parse_line(w);
+        if (ctx->labels) label_count_refs(ctx->labels, ctx->label_counts, w->text, 1, lineno);
+        start += w->len + 1;
+    }
+    if (same_head) {
+        WindowLine* w = WINDOW_LINE(ctx, 0);
+        w->indexed = head.indexed;
+        w->mnem = head.mnem;
+        w->key_rules = head.key_rules;
+        w->mnem_rules = head.mnem_rules;
+        w->memo = 1;
+    }
+}
+
+void init_context(OptimizerContext* ctx) {
+    memset(ctx, 0, sizeof(OptimizerContext));
+}
+
+/* Make the ring at least `slots` lines long, a power of two. Called with
+   the window empty; the slot buffers are kept. */
+static void reserve_window(OptimizerContext* ctx, uint16_t slots) {
+    uint16_t n = WINDOW_MIN_SLOTS;
+    while (n < slots) n <<= 1;
+    if (n <= ctx->window_slots) return;
+    WindowLine* window = realloc(ctx->window, n * sizeof(WindowLine));
+    if (window == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    memset(window + ctx->window_slots, 0, (n - ctx->window_slots) * sizeof(WindowLine));
+    ctx->window = window;
+    ctx->window_slots = n;
+    ctx->window_mask = n - 1;
+}
+
+/* Release the window ring with its slot buffers and the replacement
+   arena. The context can be reused afterwards. */
+void free_context(OptimizerContext* ctx) {
+    for (uint16_t i = 0; i < ctx->window_slots; ++i) free(ctx->window[i].buf);
+    free(ctx->window);
+    ctx->window = NULL;
+    ctx->window_slots = ctx->window_mask = 0;
+    free(ctx->no_match);
+    ctx->no_match = NULL;
+    ctx->no_match_words = 0;
+    free(ctx->repl_arena);
+    ctx->repl_arena = NULL;
+    ctx->repl_used = ctx->repl_cap = 0;
+    ctx->repl_live = 0;
+    label_free(ctx->labels);
+    ctx->labels = NULL;
+}
+
+static int is_opt_directive(const char* line) {
+    const char* p = line;
+    while (*p && isspace((unsigned char)*p)) ++p;
+    if (*p != ';') return 0;
+    ++p;
+    while (*p && isspace((unsigned char)*p)) ++p;
+    if (*p != '#') return 0;
+    ++p;
+    if (strncmp(p, "OPT_OFF", 7) == 0) {
+        p += 7;
+    } else if (strncmp(p, "OPT_ON", 6) == 0) {
+        p += 6;
+    } else {
+        return 0;
+    }
+    while (*p && isspace((unsigned char)*p)) ++p;
+    if (*p != '\0') return 0;
+    // return 1 for OFF, 2 for ON
+    return (*(p - 1) == 'F') ? 1 : 2;
+}
+
+static void write_output(OptimizerContext* ctx, WindowLine* w) {
+    if (write_line(ctx->out_fd, w->text, w->len) < 0) ctx->write_failed = 1;
+    ctx->bytes_out += w->len + 1;
+}
+
+/* Write out the first line of the window and release its slot. */
+static void emit_window_line(OptimizerContext* ctx) {
+    WindowLine* first = WINDOW_LINE(ctx, 0);
+    if (first->len) {
+        write_output(ctx, first);
+        if (value_rules)
+            values_step(&ctx->values, first->text, first->indexed ? first->mnem : first_word_id(first->text));
+    }
+    release_line(ctx, first);
+    ctx->window_head = (ctx->window_head + 1) & ctx->window_mask;
+    --ctx->window_size;
+}
+
+/* Write out any lines currently buffered in the window, preserving order. */
+static void flush_window(OptimizerContext* ctx) {
+    while (ctx->window_size > 0) {
+        emit_window_line(ctx);
+    }
+}
+
+/* Read the next input line straight into the free slot `w`. */
+static int8_t read_window_line(OptimizerContext* ctx, WindowLine* w) {
+    if (read_line_grow(ctx->in_fd, &w->buf, &w->cap, &w->len) < 0) return -1;
+    w->text = w->buf;
+    w->lineno = ctx->lines_read++;
+    return 0;
+}
+
+/* Handle an OPT_OFF/OPT_ON directive that was just read into slot `w`.
+   Flushes any buffered window lines first so the directive (and the
+   passthrough block that follows an OPT_OFF) keeps its original position.
+   Returns 1 if the directive was handled (caller should not add the line
+   to the window), 0 if it was not a directive. */
+static int handle_opt_directive(OptimizerContext* ctx, int dir, WindowLine* w) {
+    if (dir == 0) return 0;
+
+    flush_window(ctx);
+    write_output(ctx, w);
+
+    if (dir == 1) {
+        /* OPT_OFF: passthrough subsequent lines unchanged until OPT_ON */
+        ctx->optimize_enabled = 0;
+        values_reset(&ctx->values);
+        while (1) {
+            if (read_window_line(ctx, w) < 0) break;
+            int dir2 = is_opt_directive(w->text);
+            write_output(ctx, w);
+            if (dir2 == 2) { ctx->optimize_enabled = 1; break; }
+        }
+    } else {
+        /* OPT_ON */
+        ctx->optimize_enabled = 1;
+    }
+    return 1;
+}
+
+/* Refill the window up to max_window_size, honoring OPT_OFF/OPT_ON
+   directives encountered along the way. Lines are read into the slot they
+   will occupy, so nothing is copied. */
+static void refill_window(OptimizerContext* ctx) {
+    while (ctx->window_size < ctx->max_window_size) {
+        WindowLine* w = WINDOW_LINE(ctx, ctx->window_size);
+        if (read_window_line(ctx, w) < 0) break;
+        /* Check for OPT directives before stripping comments */
+        int dir = is_opt_directive(w->text);
+        if (dir) {
+            /* handle_opt_directive fully processes OPT_OFF...OPT_ON (or a lone
+               OPT_ON) internally, including writing the passthrough lines and
+               restoring optimize_enabled, so we simply keep filling afterward. */
+            handle_opt_directive(ctx, dir, w);
+            continue;
+        }
+        w->len = strip_asm_comment(w->text, w->len);
+        if (w->len == 0) continue; // skip empty lines and keep filling
+        parse_line(w);
+        ++ctx->window_size;
+    }
+}
+
+/* Whether the window holds max_window_size lines straight from the input.
+   Replacement lines always view the arena, and a rule only rewrites lines
+   at the head, so such a window is a contiguous run of input lines. */
+static uint8_t window_unmodified(OptimizerContext* ctx) {
+    if (ctx->window_size != ctx->max_window_size) return 0;
+    for (uint16_t i = 0; i < ctx->window_size; ++i) {
+        if (IN_REPL_ARENA(WINDOW_LINE(ctx, i))) return 0;
+    }
+    return 1;
+}
+
+/* Rewrites at one position before the window states are remembered.
+   Ordinary code settles after a few, so the hashing is rare. */
+#define REWRITE_WATCH 8
+
+static uint32_t window_hash(const OptimizerContext* ctx) {
+    uint32_t h = 2166136261u;
+    for (uint16_t i = 0; i < ctx->window_size; ++i) {
+        const WindowLine* w = WINDOW_LINE(ctx, i);
+        for (linelen_t k = 0; k < w->len; ++k) h = (h ^ (uint8_t)w->text[k]) * 16777619u;
+        h = (h ^ '\n') * 16777619u;
+    }
+    return h;
+}
+
+/* Warn about the first position where rewriting is stopped, naming the
+   rules of the last `count` rewrites; later ones are only counted. */
+static void report_rewrites(OptimizerContext* ctx, const char* why, uint16_t count, const Rule* rule) {
+    if (ctx->rewrite_stops++) return;
+    printf("Warning: %s at input line %lu, rules at lines", why, (unsigned long)WINDOW_LINE(ctx, 0)->lineno + 1);
+    printf(" %d", rule->lineno);
+    for (uint16_t k = 1; k < count; ++k) {
+        const Rule* r = ctx->rewrite_rule[(ctx->rewrites - k) % REWRITE_HISTORY];
+        uint16_t j = 1;
+        while (j < k && ctx->rewrite_rule[(ctx->rewrites - j) % REWRITE_HISTORY] != r) ++j;
+        if (r != rule && j == k) printf(" %d", r->lineno);
+    }
+    printf("\n");
+}
+
+/* Count a rewrite by `rule` at the current position. Returns 1 when the
+   rewriting there has to stop: the window is back at a state it had after
+   an earlier rewrite at this position, or the budget is spent. */
+static uint8_t rewrite_limit(OptimizerContext* ctx, const Rule* rule) {
+    uint32_t h = 0;
+    if (++ctx->rewrites >= REWRITE_WATCH) {
+        h = window_hash(ctx);
+        uint16_t seen = ctx->rewrites - REWRITE_WATCH;
+        if (seen > REWRITE_HISTORY) seen = REWRITE_HISTORY;
+        for (uint16_t k = 1; k <= seen; ++k) {
+            if (ctx->rewrite_hash[(ctx->rewrites - k) % REWRITE_HISTORY] == h) {
+                report_rewrites(ctx, "rewrite loop", k, rule);
+                return 1;
+            }
+        }
+    }
+    if (ctx->rewrites >= rewrite_budget) {
+        uint16_t seen = ctx->rewrites >= REWRITE_WATCH ? ctx->rewrites - REWRITE_WATCH + 1 : 1;
+        report_rewrites(ctx, "rewrite budget spent", seen < REWRITE_HISTORY ? seen : REWRITE_HISTORY, rule);
+        return 1;
+    }
+    if (ctx->rewrites >= REWRITE_WATCH) {
+        ctx->rewrite_hash[ctx->rewrites % REWRITE_HISTORY] = h;
+        ctx->rewrite_rule[ctx->rewrites % REWRITE_HISTORY] = rule;
+    }
+    return 0;
+}
+
+int8_t optimize(OptimizerContext* ctx, int8_t in_fd, int8_t out_fd, uint8_t max_window_size) {
+    ctx->in_fd = in_fd;
+    ctx->out_fd = out_fd;
+    ctx->max_window_size = max_window_size;
+    reserve_window(ctx, max_window_size + (longest_replacement > max_window_size ? longest_replacement : max_window_size));
+    uint16_t words = (uint16_t)(rule_count / 32 + 1);
+    if (words > ctx->no_match_words) {
+        free(ctx->no_match);
+        ctx->no_match = malloc(words * sizeof(uint32_t));
+        if (ctx->no_match == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+        ctx->no_match_words = words;
+    }
+    ctx->window_size = 0;
+    ctx->window_head = 0;
+    ctx->optimize_enabled = 1;
+    ctx->lines_read = 0;
+    ctx->bytes_out = 0;
+    ctx->write_failed = 0;
+    ctx->rewrite_stops = 0;
+    values_reset(&ctx->values);
+    refill_window(ctx);
+
+    Binding bindings[10];
+    Rule* fired = NULL;
+
+    while (ctx->window_size > 0 && !ctx->write_failed) {
+#ifdef __ZXNEXT
+        zx_border(0);
+#endif      
+        int rule_applied;
+        /* If optimizations are disabled, bypass rule matching and just emit lines
+           to preserve original ordering until OPT_ON is seen. */
+        if (!ctx->optimize_enabled) {
+            emit_window_line(ctx);
+            /* Refill the window fully (handles directives and keeps window at
+               max_window_size instead of only replacing the single emitted line) */
+            refill_window(ctx);
+            continue;
+        }
+        if (ctx->on_sync && window_unmodified(ctx) && VALUES_NONE(&ctx->values))
+            ctx->on_sync(ctx, WINDOW_LINE(ctx, 0)->lineno);
+        ctx->rewrites = 0;
+        do {
+            rule_applied = 0;
+            WindowLine* head = WINDOW_LINE(ctx, 0);
+            index_line(head);
+            if (!head->memo) {
+                memset(ctx->no_match, 0, ctx->no_match_words * sizeof(uint32_t));
+                head->memo = 1;
+            }
+
+/* Try one RuleNode chain; jumps to rule_fired on success, else falls through.
+   A rule already known to fail on the head line is passed over without a
+   try, and so is one whose replacement would overrun the window slots;
+   only rewrites that keep growing the window at one position get there. */
+#define TRY_CHAIN(chain_head) \
+            for (RuleNode* node = (chain_head); node; node = node->next) { \
+                Rule* rule = node->rule; \
+                STAT_TIME_BEGIN(); \
+                if (!NO_MATCH(ctx, rule->id) && \
+                    rule->pattern_linecount <= ctx->window_size && \
+                    rule->replacement_linecount <= ctx->window_slots - ctx->window_size + rule->pattern_linecount) { \
+                    STAT_INC(rule, tries); \
+                    memset(bindings, 0, sizeof(bindings)); \
+                    if (match_rule(ctx, rule, bindings)) { \
+                        uint8_t constraints_ok = 1; \
+                        if (rule->constraint_expr) { \
+                            STAT_INC(rule, constraint_runs); \
+                            constraints_ok = eval_tokenized(rule->constraint_expr, bindings, ctx, rule->pattern_linecount, rule->lineno); \
+                            if (!constraints_ok) STAT_INC(rule, constraint_rejects); \
+                        } \
+                        if (constraints_ok) { \
+                            STAT_INC(rule, fires); \
+                            apply_replacement(ctx, rule, bindings); \
+                            STAT_TIME_END(rule); \
+                            refill_window(ctx); \
+                            rule_applied = 1; \
+                            fired = rule; \
+                            goto rule_fired; \
+                        } \
+                    } \
+                } \
+                STAT_TIME_END(rule); \
+            }
+
+            /* 1. Specific two-level key (mnemonic + second token) */
+            TRY_CHAIN(head->key_rules);
+            /* 2. Mnemonic-only fallback (second token was a pure wildcard) */
+            TRY_CHAIN(head->mnem_rules);
+            /* 3. Generic (first token itself was a wildcard) */
+            TRY_CHAIN(generic_rules);
+#undef TRY_CHAIN
+
+            rule_fired:;
+        } while (rule_applied && !rewrite_limit(ctx, fired));
+
+        // Only emit and decrement if we still have lines in the window
+        if (ctx->window_size > 0) {
+            emit_window_line(ctx);
+        }
+
+        /* Refill the window fully (handles directives and keeps window at
+           max_window_size instead of only replacing the single emitted line) */
+        refill_window(ctx);
+    }
+    if (ctx->rewrite_stops > 1)
+        printf("Warning: rewriting stopped at %lu positions in all\n", (unsigned long)ctx->rewrite_stops);
+    if (!ctx->label_counts) label_free(ctx->labels);
+    ctx->labels = NULL;
+    return ctx->write_failed ? -1 : 0;
+}
+
+/* Optimize one file in place, going through `tmpname`. Returns 0 on
+   success. */
+int optimize_file(OptimizerContext* ctx, const char* input_filename, char* tmpname, uint8_t window) {
+    strcpy(tmpname, input_filename);
+    strcat(tmpname, ".tmp");
+
+    int8_t in_fd = open_file(input_filename);
+    if (in_fd < 0) {
+        printf("Error opening input file %s\n", input_filename);
+        return 1;
+    }
+
+    int8_t out_fd = create_file(tmpname);
+    if (out_fd < 0) {
+        printf("Error creating output file %s\n", tmpname);
+        close_file(in_fd);
+        return 1;
+    }
+
+    if (label_rules) {
+        int8_t scan_fd = open_file(input_filename);
+        if (scan_fd >= 0) scan_labels(ctx, scan_fd);
+    }
+
+    printf("Optimizing %s\n", input_filename);
+    int8_t failed = optimize(ctx, in_fd, out_fd, window) < 0;
+
+    close_file(in_fd);
+    if (close_file(out_fd) < 0) failed = 1;
+
+    /* The input is only replaced by a complete output */
+    if (failed) {
+        printf("Error writing %s\n", tmpname);
+        delete_file(tmpname);
+        return 1;
+    }
+#ifndef PLATFORM_POSIX
+    /* esxDOS does not rename over an existing file; POSIX does, atomically */
+    delete_file(input_filename);
+#endif
+    rename_file(tmpname, input_filename);
+    return 0;
+}
+
+/* Lines a rule using `dead` wants to see past its match. Liveness stops
+   at the first label, jump or call anyway, so a few lines are enough. */
+#define LIVENESS_LOOKAHEAD 6
+
+static uint8_t is_liveness_op(TokenType t) {
+    return t == tokDead || t == tokRegsDead;
+}
+
+static uint8_t is_label_op(TokenType t) {
+    return t == tokRefs || t == tokTarget || t == tokIsRet;
+}
+
+static uint8_t is_value_op(TokenType t) {
+    return t == tokKnownVal || t == tokHolds;
+}
+
+static uint8_t expr_uses(const TokenizedExpr* e, uint8_t (*is_op)(TokenType)) {
+    if (e == NULL) return 0;
+    for (int i = 0; i < e->count; ++i) {
+        if (is_op(e->entries[i].type)) return 1;
+    }
+    return 0;
+}
+
+/* Whether the constraint or an $eval of the rule has one of the operators */
+static uint8_t rule_uses(const Rule* rule, uint8_t (*is_op)(TokenType)) {
+    if (expr_uses(rule->constraint_expr, is_op)) return 1;
+    for (uint8_t i = 0; i < rule->replacement_linecount; ++i) {
+        for (const ReplacementSegment* seg = rule->replacement_segments[i]; seg->type != segEnd; ++seg) {
+            if (seg->type == segEval && expr_uses(seg->expr, is_op)) return 1;
+        }
+    }
+    return 0;
+}
+
+void check_rule_features(const Rule* rules, int count) {
+    label_rules = 0;
+    value_rules = 0;
+    longest_replacement = 0;
+    for (int i = 0; i < count; ++i) {
+        if (!label_rules) label_rules = rule_uses(&rules[i], is_label_op);
+        if (!value_rules) value_rules = rule_uses(&rules[i], is_value_op);
+        if (rules[i].replacement_linecount > longest_replacement)
+            longest_replacement = rules[i].replacement_linecount;
+    }
+}
+
+void scan_labels(OptimizerContext* ctx, int8_t fd) {
+    label_free(ctx->labels);
+    ctx->labels = label_rules ? label_scan(fd) : NULL;
+    close_file(fd);
+}
+
+/* The window has to hold the longest pattern, plus the lookahead of the
+   rules that ask whether registers are dead after their match. */
+uint8_t max_pattern_lines(const Rule* rules, int count) {
+    uint8_t lines = 0;
+    for (int i = 0; i < count; ++i) {
+        uint16_t need = rules[i].pattern_linecount;
+        if (rule_uses(&rules[i], is_liveness_op)) {
+            need += LIVENESS_LOOKAHEAD;
+            if (need > MAX_RULE_LINES) need = MAX_RULE_LINES;
+        }
+        if (need > lines) lines = (uint8_t)need;
+    }
+    return lines;
+}
+
+/* Number of rules tried for `line` when it heads the window, or 0 for a
+   line the optimizer drops. Strips the comment from `line` in place. */
+uint16_t candidate_rules(char* line, linelen_t len) {
+    if (strip_asm_comment(line, len) == 0) return 0;
+    char key[32];
+    char mnem[16];
+    get_index_key(line, key, sizeof(key));
+    get_mnemonic(line, mnem);
+    return chain_length(index_lookup(&key_index, key)) +
+        chain_length(index_lookup(&mnemonic_index, mnem)) + chain_length(generic_rules);
+}
+
+/* Lines of a replacement expanded by check_rules; a line that would not
+   fit leaves its rule pair unchecked. */
+#define CHECK_LINE_LENGTH 256
+typedef char CheckLine[CHECK_LINE_LENGTH];
+
+/* Expand the replacement of `rule` into `out`. An unbound placeholder
+   stands for itself, "$1", and an $eval for "$eval", so that the next
+   pattern captures them as a whole. Returns 0 when a line does not fit. */
+static uint8_t expand_replacement(const Rule* rule, const Binding* bindings, CheckLine* out) {
+    for (uint8_t i = 0; i < rule->replacement_linecount; ++i) {
+        size_t n = 0;
+        for (const ReplacementSegment* seg = rule->replacement_segments[i]; seg->type != segEnd; ++seg) {
+            char name[3] = { '$', 0, 0 };
+            const char* s = "$eval";
+            size_t len = 5;
+            if (seg->type == segText) {
+                s = seg->text;
+                len = seg->len;
+            }
+            else if (seg->type == segCapture) {
+                const Binding* b = &bindings[seg->var];
+                if (b->str) {
+                    s = b->str;
+                    len = b->len;
+                }
+                else {
+                    name[1] = '0' + seg->var;
+                    s = name;
+                    len = 2;
+                }
+            }
+            if (n + len >= sizeof(CheckLine)) return 0;
+            memcpy(out[i] + n, s, len);
+            n += len;
+        }
+        out[i][n] = '\0';
+    }
+    return 1;
+}
+
+/* Whether the pattern of `rule` matches the first of `count` lines */
+static uint8_t pattern_matches(const Rule* rule, CheckLine* lines, uint8_t count, Binding* bindings) {
+    memset(bindings, 0, 10 * sizeof(Binding));
+    if (rule->pattern_linecount > count) return 0;
+    for (uint8_t i = 0; i < rule->pattern_linecount; ++i) {
+        if (!match_pattern_line(rule->pattern_segments[i], lines[i], bindings)) return 0;
+    }
+    return 1;
+}
+
+/* Whether `b` matches what `a` writes, and `a` what `b` writes in turn:
+   starting from a window holding a's output, `b` fires on it and `a`
+   fires on the result. With a == b a rule that matches its own output. */
+static uint8_t rewrites_back(const Rule* a, const Rule* b, CheckLine* first, CheckLine* second) {
+    Binding bindings[10];
+    memset(bindings, 0, sizeof(bindings));
+    if (!expand_replacement(a, bindings, first)) return 0;
+    if (!pattern_matches(b, first, a->replacement_linecount, bindings)) return 0;
+    if (a == b) return 1;
+    if (!expand_replacement(b, bindings, second)) return 0;
+    uint8_t count = b->replacement_linecount;
+    for (uint8_t i = b->pattern_linecount; i < a->replacement_linecount; ++i)
+        memcpy(second[count++], first[i], sizeof(CheckLine));
+    return pattern_matches(a, second, count, bindings);
+}
+
+/* Constraints are not evaluated. A pair where one of the rules has a
+   constraint is listed apart, as the constraint may well be what stops
+   the loop, and is not counted. */
+int check_rules(const Rule* rules, int count) {
+    /* `second` holds one replacement and the rest of another */
+    uint16_t lines = 1;
+    for (int i = 0; i < count; ++i) {
+        if (rules[i].replacement_linecount > lines) lines = rules[i].replacement_linecount;
+    }
+    CheckLine* first = malloc(3 * lines * sizeof(CheckLine));
+    if (first == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    CheckLine* second = first + lines;
+    int found = 0;
+    for (int i = 0; i < count; ++i) {
+        for (int j = i; j < count; ++j) {
+            const Rule* a = &rules[i];
+            const Rule* b = &rules[j];
+            if (!rewrites_back(a, b, first, second) && !rewrites_back(b, a, first, second)) continue;
+            uint8_t guarded = a->constraint_expr || b->constraint_expr;
+            if (a == b) printf("Rule at line %d matches its own replacement", a->lineno);
+            else printf("Rules at lines %d and %d rewrite each other's replacement", a->lineno, b->lineno);
+            printf(guarded ? ", unless a constraint stops it\n" : "\n");
+            if (!guarded) ++found;
+        }
+    }
+    free(first);
+    return found;
+}
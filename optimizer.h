@@ -0,0 +1,128 @@
+#ifndef OPTIMIZER_H_
+#define OPTIMIZER_H_
+
+#include <stdint.h>
+
+#include "fileio.h"
+#include "dataarea.h"
+#include "rules.h"
+#include "liveness.h"
+
+/* Rule loading. load_rules resolves the file name against the search
+   path and prefers a current precompiled image; parse_rules_from reads
+   rule source from an open handle and closes it. The returned rules and
+   their index are released with free_rules. */
+char* probe_rules(const char* filename);
+char* rule_cache_filename(const char* filename);
+Rule* parse_rules(const char* filename);
+Rule* parse_rules_from(int8_t fp);
+Rule* load_rules(const char* filename);
+void free_rules(Rule* rules);
+
+/* Set by check_rule_features, which the loaders call. label_rules is set
+   while a loaded rule uses a label operator (refs, target, isret); only
+   then is an input worth a label pre-pass. value_rules is set while one
+   uses knownval or holds; only then are register values followed. */
+extern uint8_t label_rules;
+extern uint8_t value_rules;
+/* Lines of the longest replacement, also set by check_rule_features */
+extern uint8_t longest_replacement;
+void check_rule_features(const Rule* rules, int count);
+
+/* Rewrites allowed at one window position before it is written out as it
+   is, however the rules go on; see optimize(). */
+#define REWRITE_BUDGET 1000
+extern uint16_t rewrite_budget;
+
+/* Window states remembered at one position to find a rewrite loop */
+#define REWRITE_HISTORY 16
+
+/*
+ * Everything an optimization job writes to: the line window, the
+ * replacement arena, the label table of its input and the known register
+ * values. Captured operands
+ * are slices of the window lines (see Binding), so matching allocates
+ * nothing. The loaded rules, their
+ * index and the global string table are only read while optimizing, so
+ * jobs with separate contexts can run on separate threads. A context
+ * starts zeroed (init_context) and keeps its buffers between jobs until
+ * free_context.
+ */
+typedef struct OptimizerContext {
+    WindowLine* window;
+    uint16_t window_slots;      /* a power of two */
+    uint16_t window_mask;
+    uint16_t window_head;
+    uint16_t window_size;
+    uint8_t max_window_size;
+    uint8_t optimize_enabled;
+    int8_t in_fd;
+    int8_t out_fd;
+    char* repl_arena;
+    size_t repl_used;
+    size_t repl_cap;
+    uint16_t repl_live;
+    /* Rules, by id, whose first pattern line failed to match the line
+       at the head of the window; only valid while that line's `memo` is
+       set. A rule marked here is skipped until the head line changes. */
+    uint32_t* no_match;
+    uint16_t no_match_words;
+    uint32_t lines_read;
+    uint32_t bytes_out;
+    uint8_t write_failed;   /* a line could not be written: optimize() stops */
+    /* Label table (labels.h) of the input, from scan_labels. NULL leaves
+       the label operators without an answer: refs gives -1. */
+    struct LabelTable* labels;
+    /* Set when `labels` is shared with other jobs (batch.c): the job's
+       own reference counts, and optimize() leaves the table alone */
+    struct LabelCounts* label_counts;
+    /* Register values known before the head of the window, stepped over
+       each line as it is written out when value_rules is set */
+    RegValues values;
+    /* Rewrites at the current head position, with the window states and
+       the rules of the latest of them, and the positions where rewriting
+       was stopped */
+    uint16_t rewrites;
+    uint32_t rewrite_hash[REWRITE_HISTORY];
+    const Rule* rewrite_rule[REWRITE_HISTORY];
+    uint32_t rewrite_stops;
+    /* Optional hook, called at the top of the main loop whenever the
+       window is filled to max_window_size with unmodified input lines
+       and optimization is on and no register value is known. From such a
+       point the output depends only on the input that follows `line`, the
+       input line at the head. */
+    void (*on_sync)(struct OptimizerContext* ctx, uint32_t line);
+    void* sync_data;
+} OptimizerContext;
+
+void init_context(OptimizerContext* ctx);
+void free_context(OptimizerContext* ctx);
+
+/* Run the peephole optimizer over in_fd, writing to out_fd, with a window
+   of max_window_size lines (see max_pattern_lines). Rules that rewrite
+   each other's output forever are caught: when the window comes back to
+   a state it had at the same position, or the position uses up
+   rewrite_budget, the head line is written out as it is and a warning
+   names the rules involved. Returns 0, or -1 when writing failed, which
+   ends the run with the output incomplete. */
+int8_t optimize(OptimizerContext* ctx, int8_t in_fd, int8_t out_fd, uint8_t max_window_size);
+
+/* Label pre-pass: read the input on `fd` to the end and close it, keeping
+   its label table for the next optimize() of the same input, which
+   releases it. Does nothing else unless label_rules is set. */
+void scan_labels(OptimizerContext* ctx, int8_t fd);
+uint8_t max_pattern_lines(const Rule* rules, int count);
+
+/* Optimize a file in place through a temporary file whose name is built
+   in `tmpname` (strlen(input_filename) + 5 bytes). Returns 0 on success. */
+int optimize_file(OptimizerContext* ctx, const char* input_filename, char* tmpname, uint8_t window);
+
+/* Print the pairs of rules, or single rules, that may rewrite each
+   other's output back and forth; returns how many of them have no
+   constraint that could stop them. */
+int check_rules(const Rule* rules, int count);
+
+linelen_t strip_asm_comment(char* s, linelen_t len);
+uint16_t candidate_rules(char* line, linelen_t len);
+
+#endif //OPTIMIZER_H_
@@ -7,4 +7,13 @@
 #define MYCC
 #endif
 
-#endif //PLATFORM_H__
\ No newline at end of file
+/* Build target selection. The ZX Spectrum Next build talks to esxDOS
+   (fileio.c); every other build runs natively on the host against
+   POSIX (fileio_posix.c). */
+#ifdef __ZXNEXT
+#define PLATFORM_ZXN
+#else
+#define PLATFORM_POSIX
+#endif
+
+#endif //PLATFORM_H__
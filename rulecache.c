@@ -0,0 +1,415 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "platform.h"
+#include "dataarea.h"
+#include "fileio.h"
+#include "rules.h"
+#include "rulecache.h"
+#include "ruleindex.h"
+#include "optimizer.h"
+
+/*
+ * Precompiled rule image (.optc)
+ *
+ * The parsed rule set is laid out in one block: header, Rule array,
+ * per-rule line tables, compiled pattern and replacement segments,
+ * constraint and $eval bytecode, the rule index and finally
+ * the interned string table. Every pointer in the block is stored as an
+ * offset from the start of the image and listed in a relocation table, so
+ * loading is a single bulk read followed by one pass that adds the load
+ * address to each listed field. Offset 0 (the header) encodes NULL.
+ *
+ * An image is only valid for the build that wrote it. The header records
+ * the format version and the sizes of the serialized structures; on any
+ * mismatch the loader refuses the image and the caller parses the text.
+ * It also records the timestamp and size of the rule file, so an image
+ * is refused once the rule file is edited, even within the same second
+ * as the image was written.
+ */
+
+#define RULE_CACHE_MAGIC   0x43504F5AUL   /* "ZOPC" */
+#define RULE_CACHE_VERSION 12
+
+#define IMAGE_ALIGN sizeof(void*)
+
+typedef struct ImageHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t ptr_size;
+    uint8_t slot_size;
+    uint16_t rule_size;
+    uint16_t segment_size;
+    uint16_t repl_segment_size;
+    uint16_t token_size;
+    uint16_t node_size;
+    uint32_t source_time;
+    uint32_t source_size;
+    int rule_count;
+    size_t image_size;
+    size_t reloc_offset;
+    size_t reloc_count;
+    size_t strings_offset;
+    size_t strings_size;
+    Rule* rules;
+    RuleIndex key_index;
+    RuleIndex mnemonic_index;
+    RuleNode* generic_rules;
+} ImageHeader;
+
+static uint8_t* cache_image = NULL;
+static uint32_t cache_size = 0;
+
+static int8_t image_compatible(const ImageHeader* h, uint32_t size) {
+    return size >= sizeof(ImageHeader) &&
+        h->magic == RULE_CACHE_MAGIC &&
+        h->version == RULE_CACHE_VERSION &&
+        h->ptr_size == sizeof(void*) &&
+        h->slot_size == sizeof(IndexSlot) &&
+        h->rule_size == sizeof(Rule) &&
+        h->segment_size == sizeof(PatternSegment) &&
+        h->repl_segment_size == sizeof(ReplacementSegment) &&
+        h->token_size == sizeof(TokenEntry) &&
+        h->node_size == sizeof(RuleNode) &&
+        h->image_size == size &&
+        h->reloc_offset + h->reloc_count * sizeof(size_t) <= size &&
+        h->strings_offset + h->strings_size <= size;
+}
+
+Rule* load_rule_cache(const char* filename, uint32_t source_time, uint32_t source_size) {
+    uint32_t size = 0;
+    uint8_t* image = load_file(filename, &size);
+    if (!image) return NULL;
+
+    ImageHeader* h = (ImageHeader*)image;
+    if (!image_compatible(h, size) || h->source_time != source_time || h->source_size != source_size) {
+        unload_file(image, size);
+        return NULL;
+    }
+
+    const size_t* relocs = (const size_t*)(image + h->reloc_offset);
+    for (size_t i = 0; i < h->reloc_count; ++i) {
+        size_t field = relocs[i];
+        size_t value;
+        if (field + sizeof(size_t) > size) {
+            unload_file(image, size);
+            return NULL;
+        }
+        memcpy(&value, image + field, sizeof(size_t));
+        value += (size_t)image;
+        memcpy(image + field, &value, sizeof(size_t));
+    }
+
+    /* Make the image strings the canonical interned copies so later
+       hash() calls return the same pointers as the rule text. */
+    char* s = (char*)image + h->strings_offset;
+    char* end = s + h->strings_size;
+    while (s < end) {
+        hash_static(s);
+        s += strlen(s) + 1;
+    }
+
+    key_index = h->key_index;
+    mnemonic_index = h->mnemonic_index;
+    generic_rules = h->generic_rules;
+    rule_count = h->rule_count;
+    index_mnemonics();
+    check_rule_features(h->rules, rule_count);
+
+    cache_image = image;
+    cache_size = size;
+    return h->rules;
+}
+
+int rule_cache_loaded(void) {
+    return cache_image != NULL;
+}
+
+/* The index installed by load_rule_cache lives inside the image, so it is
+   detached here rather than freed node by node. */
+void free_rule_cache(void) {
+    memset(&key_index, 0, sizeof(key_index));
+    memset(&mnemonic_index, 0, sizeof(mnemonic_index));
+    memset(mnemonic_chains, 0, sizeof(mnemonic_chains));
+    generic_rules = NULL;
+    unload_file(cache_image, cache_size);
+    cache_image = NULL;
+    cache_size = 0;
+}
+
+/* ---- Image writer ---- */
+
+typedef struct ImageWriter {
+    uint8_t* buf;
+    size_t size;
+    size_t capacity;
+    size_t* relocs;
+    size_t reloc_count;
+    size_t reloc_capacity;
+    /* interned strings are collected separately and appended last */
+    char* strings;
+    size_t strings_size;
+    size_t strings_capacity;
+    size_t* string_fields;
+    size_t string_field_count;
+    size_t string_field_capacity;
+    /* interned pointer -> offset in `strings` (open addressing) */
+    const char** string_keys;
+    size_t* string_offsets;
+    size_t string_slots;
+    size_t string_count;
+} ImageWriter;
+
+static void* grow(void* p, size_t* capacity, size_t needed, size_t elem) {
+    if (needed <= *capacity) return p;
+    size_t cap = *capacity ? *capacity : 64;
+    while (cap < needed) cap *= 2;
+    p = realloc(p, cap * elem);
+    if (!p) error(ERROR_OUT_OF_MEMORY, 0);
+    *capacity = cap;
+    return p;
+}
+
+static size_t image_alloc(ImageWriter* w, size_t size) {
+    size_t off = (w->size + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+    w->buf = grow(w->buf, &w->capacity, off + size, 1);
+    memset(w->buf + w->size, 0, off + size - w->size);
+    w->size = off + size;
+    return off;
+}
+
+static size_t image_put(ImageWriter* w, const void* src, size_t size) {
+    size_t off = image_alloc(w, size);
+    memcpy(w->buf + off, src, size);
+    return off;
+}
+
+/* Store `target` (an image offset) into the pointer field at `field`. */
+static void image_set_ptr(ImageWriter* w, size_t field, size_t target) {
+    memcpy(w->buf + field, &target, sizeof(size_t));
+    if (!target) return;
+    w->relocs = grow(w->relocs, &w->reloc_capacity, w->reloc_count + 1, sizeof(size_t));
+    w->relocs[w->reloc_count++] = field;
+}
+
+static size_t hash_ptr(const void* p, size_t slots) {
+    size_t h = (size_t)p;
+    h ^= h >> 7;
+    return (h * 31) & (slots - 1);
+}
+
+static size_t string_offset(ImageWriter* w, const char* s) {
+    if (w->string_count * 2 >= w->string_slots) {
+        size_t slots = w->string_slots ? w->string_slots * 2 : 256;
+        const char** keys = calloc(slots, sizeof(char*));
+        size_t* offsets = malloc(slots * sizeof(size_t));
+        if (!keys || !offsets) error(ERROR_OUT_OF_MEMORY, 0);
+        for (size_t i = 0; i < w->string_slots; ++i) {
+            if (!w->string_keys[i]) continue;
+            size_t j = hash_ptr(w->string_keys[i], slots);
+            while (keys[j]) j = (j + 1) & (slots - 1);
+            keys[j] = w->string_keys[i];
+            offsets[j] = w->string_offsets[i];
+        }
+        free(w->string_keys);
+        free(w->string_offsets);
+        w->string_keys = keys;
+        w->string_offsets = offsets;
+        w->string_slots = slots;
+    }
+    size_t j = hash_ptr(s, w->string_slots);
+    while (w->string_keys[j]) {
+        if (w->string_keys[j] == s) return w->string_offsets[j];
+        j = (j + 1) & (w->string_slots - 1);
+    }
+    size_t len = strlen(s) + 1;
+    w->strings = grow(w->strings, &w->strings_capacity, w->strings_size + len, 1);
+    memcpy(w->strings + w->strings_size, s, len);
+    w->string_keys[j] = s;
+    w->string_offsets[j] = w->strings_size;
+    w->strings_size += len;
+    ++w->string_count;
+    return w->string_offsets[j];
+}
+
+/* String fields hold an offset into the string table until it is placed. */
+static void image_set_string(ImageWriter* w, size_t field, const char* s) {
+    if (!s) return;
+    size_t off = string_offset(w, s);
+    memcpy(w->buf + field, &off, sizeof(size_t));
+    w->string_fields = grow(w->string_fields, &w->string_field_capacity, w->string_field_count + 1, sizeof(size_t));
+    w->string_fields[w->string_field_count++] = field;
+}
+
+static size_t image_lines(ImageWriter* w, char** lines, uint8_t count) {
+    if (!lines) return 0;
+    size_t off = image_alloc(w, count * sizeof(char*));
+    for (uint8_t i = 0; i < count; ++i)
+        image_set_string(w, off + i * sizeof(char*), lines[i]);
+    return off;
+}
+
+static size_t image_segments(ImageWriter* w, PatternSegment** lines, uint8_t count) {
+    if (!lines) return 0;
+    size_t off = image_alloc(w, count * sizeof(PatternSegment*));
+    for (uint8_t i = 0; i < count; ++i) {
+        uint8_t n = 1;
+        while (lines[i][n - 1].type != segEnd) ++n;
+        size_t segs = image_put(w, lines[i], n * sizeof(PatternSegment));
+        image_set_ptr(w, off + i * sizeof(PatternSegment*), segs);
+        for (uint8_t j = 0; j < n; ++j)
+            image_set_string(w, segs + j * sizeof(PatternSegment) + offsetof(PatternSegment, text), lines[i][j].text);
+    }
+    return off;
+}
+
+static size_t image_expr(ImageWriter* w, const TokenizedExpr* e) {
+    if (!e) return 0;
+    size_t off = image_put(w, e, sizeof(TokenizedExpr));
+    size_t entries = image_put(w, e->entries, e->count * sizeof(TokenEntry));
+    ((TokenizedExpr*)(w->buf + off))->capacity = e->count;
+    image_set_ptr(w, off + offsetof(TokenizedExpr, entries), entries);
+    for (int i = 0; i < e->count; ++i)
+        image_set_string(w, entries + i * sizeof(TokenEntry) + offsetof(TokenEntry, strval), e->entries[i].strval);
+    return off;
+}
+
+static size_t image_sigs(ImageWriter* w, const LineSig* sigs, uint8_t count) {
+    if (!sigs) return 0;
+    size_t off = image_put(w, sigs, count * sizeof(LineSig));
+    for (uint8_t i = 0; i < count; ++i)
+        image_set_string(w, off + i * sizeof(LineSig) + offsetof(LineSig, lit), sigs[i].lit);
+    return off;
+}
+
+static size_t image_replacements(ImageWriter* w, ReplacementSegment** lines, uint8_t count) {
+    if (!lines) return 0;
+    size_t off = image_alloc(w, count * sizeof(ReplacementSegment*));
+    for (uint8_t i = 0; i < count; ++i) {
+        uint8_t n = 1;
+        while (lines[i][n - 1].type != segEnd) ++n;
+        size_t segs = image_put(w, lines[i], n * sizeof(ReplacementSegment));
+        image_set_ptr(w, off + i * sizeof(ReplacementSegment*), segs);
+        for (uint8_t j = 0; j < n; ++j) {
+            size_t seg = segs + j * sizeof(ReplacementSegment);
+            image_set_string(w, seg + offsetof(ReplacementSegment, text), lines[i][j].text);
+            image_set_ptr(w, seg + offsetof(ReplacementSegment, expr), image_expr(w, lines[i][j].expr));
+        }
+    }
+    return off;
+}
+
+static size_t image_chain(ImageWriter* w, const RuleNode* node, const Rule* rules, size_t rules_off) {
+    size_t head = 0;
+    size_t prev = 0;
+    for (; node; node = node->next) {
+        size_t off = image_alloc(w, sizeof(RuleNode));
+        image_set_ptr(w, off + offsetof(RuleNode, rule), rules_off + (size_t)(node->rule - rules) * sizeof(Rule));
+        if (prev) image_set_ptr(w, prev + offsetof(RuleNode, next), off);
+        else head = off;
+        prev = off;
+    }
+    return head;
+}
+
+/* Serialize an index into the RuleIndex at image offset `field`. The
+   perfect hash layout is stored as built, so loading needs no rehashing. */
+static void image_index(ImageWriter* w, size_t field, const RuleIndex* ix, const Rule* rules, size_t rules_off) {
+    memcpy(w->buf + field, ix, sizeof(RuleIndex));
+    image_set_ptr(w, field + offsetof(RuleIndex, disp), 0);
+    image_set_ptr(w, field + offsetof(RuleIndex, slots), 0);
+    if (!ix->size) return;
+    size_t disp = image_put(w, ix->disp, ix->buckets * sizeof(uint16_t));
+    size_t slots = image_alloc(w, ix->size * sizeof(IndexSlot));
+    for (uint16_t i = 0; i < ix->size; ++i) {
+        size_t slot = slots + i * sizeof(IndexSlot);
+        image_set_string(w, slot + offsetof(IndexSlot, key), ix->slots[i].key);
+        image_set_ptr(w, slot + offsetof(IndexSlot, rules), image_chain(w, ix->slots[i].rules, rules, rules_off));
+    }
+    image_set_ptr(w, field + offsetof(RuleIndex, disp), disp);
+    image_set_ptr(w, field + offsetof(RuleIndex, slots), slots);
+}
+
+int8_t save_rule_cache(const char* filename, Rule* rules, int count, uint32_t source_time, uint32_t source_size) {
+    ImageWriter w;
+    memset(&w, 0, sizeof(w));
+
+    size_t header = image_alloc(&w, sizeof(ImageHeader));
+    size_t rules_off = image_put(&w, rules, count * sizeof(Rule));
+    image_set_ptr(&w, header + offsetof(ImageHeader, rules), rules_off);
+
+    for (int i = 0; i < count; ++i) {
+        size_t r = rules_off + i * sizeof(Rule);
+        image_set_ptr(&w, r + offsetof(Rule, pattern_lines),
+            image_lines(&w, rules[i].pattern_lines, rules[i].pattern_linecount));
+        image_set_ptr(&w, r + offsetof(Rule, pattern_segments),
+            image_segments(&w, rules[i].pattern_segments, rules[i].pattern_linecount));
+        image_set_ptr(&w, r + offsetof(Rule, pattern_sigs),
+            image_sigs(&w, rules[i].pattern_sigs, rules[i].pattern_linecount));
+        image_set_ptr(&w, r + offsetof(Rule, replacement_lines),
+            image_lines(&w, rules[i].replacement_lines, rules[i].replacement_linecount));
+        image_set_ptr(&w, r + offsetof(Rule, replacement_segments),
+            image_replacements(&w, rules[i].replacement_segments, rules[i].replacement_linecount));
+        image_set_ptr(&w, r + offsetof(Rule, constraint_expr), image_expr(&w, rules[i].constraint_expr));
+    }
+
+    image_index(&w, header + offsetof(ImageHeader, key_index), &key_index, rules, rules_off);
+    image_index(&w, header + offsetof(ImageHeader, mnemonic_index), &mnemonic_index, rules, rules_off);
+    image_set_ptr(&w, header + offsetof(ImageHeader, generic_rules), image_chain(&w, generic_rules, rules, rules_off));
+
+    /* Place the string table and turn string fields into real relocations */
+    size_t strings_off = image_put(&w, w.strings, w.strings_size);
+    for (size_t i = 0; i < w.string_field_count; ++i) {
+        size_t field = w.string_fields[i];
+        size_t value;
+        memcpy(&value, w.buf + field, sizeof(size_t));
+        image_set_ptr(&w, field, strings_off + value);
+    }
+
+    size_t reloc_off = image_alloc(&w, w.reloc_count * sizeof(size_t));
+    memcpy(w.buf + reloc_off, w.relocs, w.reloc_count * sizeof(size_t));
+
+    ImageHeader* h = (ImageHeader*)(w.buf + header);
+    h->magic = RULE_CACHE_MAGIC;
+    h->version = RULE_CACHE_VERSION;
+    h->ptr_size = sizeof(void*);
+    h->slot_size = sizeof(IndexSlot);
+    h->rule_size = sizeof(Rule);
+    h->segment_size = sizeof(PatternSegment);
+    h->repl_segment_size = sizeof(ReplacementSegment);
+    h->token_size = sizeof(TokenEntry);
+    h->node_size = sizeof(RuleNode);
+    h->source_time = source_time;
+    h->source_size = source_size;
+    h->rule_count = count;
+    h->image_size = w.size;
+    h->reloc_offset = reloc_off;
+    h->reloc_count = w.reloc_count;
+    h->strings_offset = strings_off;
+    h->strings_size = w.strings_size;
+
+    int8_t result = 0;
+    int8_t fd = create_file(filename);
+    if (fd < 0) {
+        result = -1;
+    }
+    else {
+        for (size_t done = 0; done < w.size && result == 0; ) {
+            uint16_t chunk = (w.size - done) > 0x4000 ? 0x4000 : (uint16_t)(w.size - done);
+            if (write_block(fd, w.buf + done, chunk) != (int16_t)chunk) result = -1;
+            done += chunk;
+        }
+        if (close_file(fd) < 0) result = -1;
+    }
+
+    free(w.buf);
+    free(w.relocs);
+    free(w.strings);
+    free(w.string_fields);
+    free(w.string_keys);
+    free(w.string_offsets);
+    return result;
+}
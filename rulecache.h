@@ -0,0 +1,16 @@
+#ifndef RULECACHE_H_
+#define RULECACHE_H_
+
+#include "rules.h"
+
+/* Precompiled rule images (.optc). An image records the timestamp and
+   size of the rule file it was compiled from. save_rule_cache returns 0
+   on success. load_rule_cache returns NULL if the image is missing, was
+   written by an incompatible build or from a rule file with another
+   timestamp or size, in which case the caller parses the source. */
+int8_t save_rule_cache(const char* filename, Rule* rules, int count, uint32_t source_time, uint32_t source_size);
+Rule* load_rule_cache(const char* filename, uint32_t source_time, uint32_t source_size);
+int rule_cache_loaded(void);
+void free_rule_cache(void);
+
+#endif //RULECACHE_H_
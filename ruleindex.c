@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "platform.h"
+#include "dataarea.h"
+#include "rules.h"
+#include "ruleindex.h"
+
+RuleIndex key_index;
+RuleIndex mnemonic_index;
+RuleNode* generic_rules = NULL;
+RuleNode* mnemonic_chains[MNEM_COUNT + 1];
+
+static uint16_t key_hash(const char* s, uint16_t seed) {
+    uint16_t h = 2166U ^ seed;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h += (h << 1) + (h << 4);   /* approx * 19, avoids true multiply */
+    }
+    return h;
+}
+
+/* Slot of a key under displacement d. The shifts scramble the hash so
+   that each displacement gives an unrelated placement of a bucket. */
+static uint16_t index_slot(uint16_t h, uint16_t d, uint16_t size) {
+    h ^= (uint16_t)(d * 0x9E37U);
+    h ^= h >> 8;
+    h += h << 3;
+    h ^= h >> 5;
+    return h % size;
+}
+
+/* Keys may only be added before index_build. */
+void index_add(RuleIndex* ix, const char* key, Rule* rule) {
+    char* k = hash(key);
+    uint16_t i = 0;
+    while (i < ix->size && ix->slots[i].key != k) ++i;
+    if (i == ix->size) {
+        /* the slot array doubles whenever it is full */
+        if (ix->size == 0 || (ix->size >= 8 && (ix->size & (ix->size - 1)) == 0)) {
+            IndexSlot* slots = realloc(ix->slots, (ix->size ? ix->size * 2 : 8) * sizeof(IndexSlot));
+            if (slots == NULL) error(ERROR_OUT_OF_MEMORY, rule->lineno);
+            ix->slots = slots;
+        }
+        ix->slots[i].key = k;
+        ix->slots[i].rules = NULL;
+        ++ix->size;
+    }
+    RuleNode* node = malloc(sizeof(RuleNode));
+    if (node == NULL) error(ERROR_OUT_OF_MEMORY, rule->lineno);
+    node->rule = rule;
+    node->next = ix->slots[i].rules;
+    ix->slots[i].rules = node;
+}
+
+/* Try to place every key for one seed. Keys are grouped into buckets by
+   hash and the buckets are placed largest first, each one trying
+   displacements until all of its keys land in free slots. */
+static uint8_t index_layout(RuleIndex* ix, uint16_t seed, uint16_t buckets,
+                            uint16_t* hashes, uint16_t* counts, uint16_t* members, IndexSlot* placed) {
+    uint16_t n = ix->size;
+    uint16_t largest = 0;
+    for (uint16_t b = 0; b < buckets; ++b) counts[b] = 0;
+    for (uint16_t i = 0; i < n; ++i) {
+        hashes[i] = key_hash(ix->slots[i].key, seed);
+        uint16_t c = ++counts[hashes[i] % buckets];
+        if (c > largest) largest = c;
+        placed[i].key = NULL;
+    }
+
+    for (uint16_t size = largest; size > 0; --size) {
+        for (uint16_t b = 0; b < buckets; ++b) {
+            if (counts[b] != size) continue;
+            uint16_t m = 0;
+            for (uint16_t i = 0; i < n; ++i)
+                if (hashes[i] % buckets == b) members[m++] = i;
+
+            uint32_t d = 0;
+            for (; d <= 0xFFFF; ++d) {
+                uint16_t j = 0;
+                for (; j < m; ++j) {
+                    uint16_t slot = index_slot(hashes[members[j]], (uint16_t)d, n);
+                    if (placed[slot].key) break;
+                    placed[slot] = ix->slots[members[j]];
+                }
+                if (j == m) break;
+                while (j--) placed[index_slot(hashes[members[j]], (uint16_t)d, n)].key = NULL;
+            }
+            if (d > 0xFFFF) return 0;
+            ix->disp[b] = (uint16_t)d;
+        }
+    }
+    return 1;
+}
+
+/* Replace the insertion-ordered slot array with its perfect hash layout.
+   A seed that leaves some bucket unplaceable is retried with the next
+   one, and every eight failures the number of buckets doubles; with one
+   key per bucket a layout always exists. */
+void index_build(RuleIndex* ix) {
+    uint16_t n = ix->size;
+    if (n == 0) return;
+
+    uint16_t* hashes = malloc(n * sizeof(uint16_t));
+    uint16_t* counts = malloc(n * sizeof(uint16_t));
+    uint16_t* members = malloc(n * sizeof(uint16_t));
+    IndexSlot* placed = malloc(n * sizeof(IndexSlot));
+    ix->disp = malloc(n * sizeof(uint16_t));
+    if (!hashes || !counts || !members || !placed || !ix->disp) error(ERROR_OUT_OF_MEMORY, 0);
+
+    uint16_t buckets = (n + 1) / 2;
+    uint16_t seed = 0;
+    while (!index_layout(ix, seed, buckets, hashes, counts, members, placed)) {
+        ++seed;
+        if ((seed & 7) == 0 && buckets < n) {
+            buckets *= 2;
+            if (buckets > n) buckets = n;
+        }
+    }
+    memcpy(ix->slots, placed, n * sizeof(IndexSlot));
+    ix->seed = seed;
+    ix->buckets = buckets;
+
+    free(hashes);
+    free(counts);
+    free(members);
+    free(placed);
+}
+
+RuleNode* index_lookup(const RuleIndex* ix, const char* key) {
+    if (ix->size == 0) return NULL;
+    uint16_t h = key_hash(key, ix->seed);
+    const IndexSlot* s = &ix->slots[index_slot(h, ix->disp[h % ix->buckets], ix->size)];
+    return strcmp(s->key, key) == 0 ? s->rules : NULL;
+}
+
+/* Copy the chains of mnemonic_index whose key is a known mnemonic into
+   mnemonic_chains, after the index is built or loaded. */
+void index_mnemonics(void) {
+    memset(mnemonic_chains, 0, sizeof(mnemonic_chains));
+    for (uint16_t i = 0; i < mnemonic_index.size; ++i) {
+        const IndexSlot* s = &mnemonic_index.slots[i];
+        mnemonic_chains[mnemonic_id(s->key, (uint8_t)strlen(s->key))] = s->rules;
+    }
+    mnemonic_chains[MNEM_NONE] = NULL;
+}
+
+void index_free(RuleIndex* ix) {
+    for (uint16_t i = 0; i < ix->size; ++i) {
+        RuleNode* n = ix->slots[i].rules;
+        while (n) { RuleNode* next = n->next; free(n); n = next; }
+    }
+    free(ix->slots);
+    free(ix->disp);
+    memset(ix, 0, sizeof(RuleIndex));
+}
+
+uint16_t chain_length(const RuleNode* n) {
+    uint16_t len = 0;
+    for (; n; n = n->next) ++len;
+    return len;
+}
+
+/* Print slot occupancy and chain lengths; the chain is the list of
+   candidate rules tried for a line with that key. */
+void index_stats(const RuleIndex* ix, const char* name) {
+    uint16_t used = 0;
+    uint16_t rules = 0;
+    uint16_t longest = 0;
+    for (uint16_t i = 0; i < ix->size; ++i) {
+        uint16_t len = chain_length(ix->slots[i].rules);
+        if (len) ++used;
+        rules += len;
+        if (len > longest) longest = len;
+    }
+    uint16_t avg = ix->size ? (uint16_t)((uint32_t)rules * 100 / ix->size) : 0;
+    printf("%-9s %3u keys, %3u/%3u slots used, %2u buckets, %3u rules, longest chain %u, average %u.%02u\n",
+        name, (unsigned)ix->size, (unsigned)used, (unsigned)ix->size, (unsigned)ix->buckets,
+        (unsigned)rules, (unsigned)longest, (unsigned)(avg / 100), (unsigned)(avg % 100));
+}
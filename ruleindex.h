@@ -0,0 +1,46 @@
+#ifndef RULEINDEX_H_
+#define RULEINDEX_H_
+
+#include <stdint.h>
+
+#include "rules.h"
+#include "opcodes.h"
+
+/*
+ * Rule index keyed by the leading tokens of a rule's first pattern line.
+ * Keys are added while the rules are loaded and index_build then lays
+ * them out with a minimal perfect hash: every key owns exactly one slot
+ * and a lookup costs one key hash plus one string compare, however many
+ * keys there are. Each slot holds the chain of rules for its key only.
+ */
+typedef struct IndexSlot {
+    char* key;          /* interned */
+    RuleNode* rules;
+} IndexSlot;
+
+typedef struct RuleIndex {
+    uint16_t seed;      /* key hash seed that made the layout collision free */
+    uint16_t size;      /* number of keys, and of slots */
+    uint16_t buckets;   /* number of displacement entries */
+    uint16_t* disp;
+    IndexSlot* slots;
+} RuleIndex;
+
+/* Specific index: "mnemonic_secondtoken" keys */
+extern RuleIndex key_index;
+/* Fallback index: mnemonic keys of rules whose second token is a wildcard */
+extern RuleIndex mnemonic_index;
+/* Rules whose first token is itself a wildcard */
+extern RuleNode* generic_rules;
+/* mnemonic_index chains by mnemonic id (opcodes.h), set by index_mnemonics */
+extern RuleNode* mnemonic_chains[MNEM_COUNT + 1];
+
+void index_add(RuleIndex* ix, const char* key, Rule* rule);
+void index_build(RuleIndex* ix);
+RuleNode* index_lookup(const RuleIndex* ix, const char* key);
+void index_mnemonics(void);
+void index_free(RuleIndex* ix);
+void index_stats(const RuleIndex* ix, const char* name);
+uint16_t chain_length(const RuleNode* n);
+
+#endif //RULEINDEX_H_
@@ -0,0 +1,134 @@
+#ifndef RULES_H_
+#define RULES_H_
+
+#include <stdint.h>
+
+#include "dataarea.h"
+#include "fileio.h"
+
+// Define the various token types.
+typedef enum {
+    tokNone,
+    tokNumber,
+    tokVariable,
+    tokLiteral,
+    tokLParen,
+    tokRParen,
+    tokIsNumeric,
+    tokStartsWith,
+    tokPlus,
+    tokMinus,
+    tokTimes,
+    tokDivide,
+    tokMod,
+    tokLt,
+    tokGt,
+    tokLe,
+    tokGe,
+    tokEq,
+    tokNe,
+    tokAnd,
+    tokOr,
+    tokXor,
+    tokBand,
+    tokBor,
+    tokBxor,
+    tokShl,
+    tokShr,
+    tokDead,
+    tokRefs,
+    tokTarget,
+    tokIsRet,
+    tokKnownVal,
+    tokHolds,
+    tokEos,
+    tokVarIsNumeric,    /* "$n isnumeric", fused by compile_expression */
+    tokRegsDead,        /* "'reg' dead", register bits in intval */
+} TokenType;
+
+// Tokenized expression representation for compiled constraints
+typedef struct {
+    TokenType type;
+    char* strval; /* interned string for literals */
+    int intval;   /* numeric value, variable index or literal length */
+} TokenEntry;
+
+/* A compiled expression is verified when it is loaded: the RPN is well
+   formed, fits the evaluation stack and leaves one value that is not a
+   string literal. Constant subexpressions are folded. */
+typedef struct TokenizedExpr {
+    TokenEntry* entries;
+    int count;
+    int capacity;
+} TokenizedExpr;
+
+/*
+ * A placeholder bound while matching a rule. The capture is a slice of
+ * the window line it was matched in, not a terminated string, so a match
+ * attempt allocates nothing. The text is classified and, when numeric,
+ * parsed the first time an expression reads it; later reads in the same
+ * match attempt use the cached value.
+ */
+typedef enum { bindUnknown, bindString, bindInt } BindingType;
+
+typedef struct Binding {
+    const char* str;    /* start of the capture, NULL while unbound */
+    linelen_t len;
+    uint8_t type;       /* BindingType */
+    int intval;         /* valid when type is bindInt */
+} Binding;
+
+/*
+ * Pattern lines are compiled into segments when the rules are loaded.
+ * segText holds literal text with the spaces removed; spaces in the input
+ * line are skipped before each character, as in the original text
+ * pattern. segCapture binds placeholder `var` to the input up to the
+ * first occurrence of `text` (verbatim, spaces included), or to the rest
+ * of the line when `len` is 0. Each line's array ends with segEnd.
+ */
+typedef enum { segEnd, segText, segCapture, segEval } SegmentType;
+
+typedef struct PatternSegment {
+    uint8_t type;
+    uint8_t var;
+    char first;     /* text[0], checked before anything else */
+    uint16_t len;   /* strlen(text) */
+    char* text;     /* interned */
+} PatternSegment;
+
+/*
+ * Replacement lines are compiled the same way. segText is copied
+ * verbatim, segCapture inserts the text bound to `var` and segEval
+ * inserts the value of a $eval(...) expression, compiled to bytecode.
+ */
+typedef struct ReplacementSegment {
+    uint8_t type;
+    uint8_t var;
+    uint16_t len;           /* strlen(text) */
+    char* text;             /* interned */
+    TokenizedExpr* expr;    /* segEval */
+} ReplacementSegment;
+
+/* Note: pattern/replacement line counts are always <= MAX_RULE_LINES (255)
+   so use uint8_t to save space and help the optimizer. */
+typedef struct Rule {
+    int lineno;
+    uint16_t id;            /* index in the rule array */
+    char** pattern_lines;
+    PatternSegment** pattern_segments;
+    LineSig* pattern_sigs;
+    uint8_t pattern_linecount;
+    char** replacement_lines;
+    ReplacementSegment** replacement_segments;
+    uint8_t replacement_linecount;
+    TokenizedExpr* constraint_expr;
+} Rule;
+
+typedef struct RuleNode {
+    Rule* rule;
+    struct RuleNode* next;
+} RuleNode;
+
+extern int rule_count;
+
+#endif //RULES_H_
@@ -0,0 +1,193 @@
+#include "platform.h"
+
+#ifdef RULE_STATS
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dataarea.h"
+#include "fileio.h"
+#include "rules.h"
+#include "rulestats.h"
+
+#ifdef RULE_STATS_CLOCK
+#include <time.h>
+#define STATS_TIME_COLUMN(s) s
+#else
+#define STATS_TIME_COLUMN(s) ""
+#endif
+
+RuleStats* rule_stats = NULL;
+Rule* rule_stats_base = NULL;
+static int stats_count = 0;
+
+void stats_init(Rule* rules, int count) {
+    rule_stats = calloc(count ? count : 1, sizeof(RuleStats));
+    if (rule_stats == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    rule_stats_base = rules;
+    stats_count = count;
+}
+
+void stats_free(void) {
+    free(rule_stats);
+    rule_stats = NULL;
+    rule_stats_base = NULL;
+    stats_count = 0;
+}
+
+#ifdef RULE_STATS_CLOCK
+uint64_t stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+/* Most expensive rules first: by time where it is measured, then tries */
+static int compare_stats(const void* a, const void* b) {
+    const RuleStats* sa = &rule_stats[*(const int*)a];
+    const RuleStats* sb = &rule_stats[*(const int*)b];
+#ifdef RULE_STATS_CLOCK
+    if (sa->nanoseconds != sb->nanoseconds) return sa->nanoseconds < sb->nanoseconds ? 1 : -1;
+#endif
+    if (sa->tries != sb->tries) return sa->tries < sb->tries ? 1 : -1;
+    return rule_stats_base[*(const int*)a].lineno - rule_stats_base[*(const int*)b].lineno;
+}
+
+/* First pattern line without its indentation, for display. The table
+   shows up to LABEL_WIDTH characters of it, CSV and JSON as much as fits
+   in a row. */
+#define LABEL_WIDTH 128
+
+static const char* rule_label(const Rule* rule) {
+    const char* s = rule->pattern_lines[0];
+    while (*s == ' ') ++s;
+    return s;
+}
+
+/* Report rows are formatted here and written either to stdout or, via
+   the regular file backend, to the report file. */
+static char row[LABEL_WIDTH * 4];
+static int8_t report_fd;
+
+static void emit_row(int len) {
+    if (report_fd < 0) printf("%s\n", row);
+    else write_line(report_fd, row, (linelen_t)len);
+}
+
+/* Append to the row at `len` as snprintf would, cutting the text short
+   at the end of the row. Returns the new length. */
+static int append(int len, const char* format, ...) {
+    size_t room = sizeof(row) - len;
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(row + len, room, format, args);
+    va_end(args);
+    if (n < 0) return len;
+    return (size_t)n < room ? len + n : (int)sizeof(row) - 1;
+}
+
+/* Room kept after a quoted field for the text that closes a JSON row */
+#define ROW_TAIL 3
+
+/* Append `s` quoted for CSV (doubled quotes) or JSON (backslash escapes),
+   cut short so that the quotes and ROW_TAIL more characters fit */
+static int quote(int len, const char* s, char escape) {
+    if (len > (int)sizeof(row) - ROW_TAIL - 3) return len;
+    char* p = row + len;
+    char* end = row + sizeof(row) - ROW_TAIL - 2;
+    *p++ = '"';
+    for (; *s && p + 2 < end; ++s) {
+        if (*s == '"' || (escape == '\\' && *s == '\\')) *p++ = escape;
+        *p++ = *s;
+    }
+    *p++ = '"';
+    *p = '\0';
+    return (int)(p - row);
+}
+
+static uint8_t has_suffix(const char* s, const char* suffix) {
+    size_t len = strlen(s);
+    size_t slen = strlen(suffix);
+    return len >= slen && strcmp(s + len - slen, suffix) == 0;
+}
+
+/* Print the table to stdout when filename is NULL; otherwise write CSV or
+   JSON according to the extension (a table for anything else). */
+int8_t stats_report(const char* filename) {
+    uint8_t csv = filename && has_suffix(filename, ".csv");
+    uint8_t json = filename && has_suffix(filename, ".json");
+    report_fd = -1;
+    if (filename) {
+        report_fd = create_file(filename);
+        if (report_fd < 0) return -1;
+    }
+
+    int* order = malloc((stats_count ? stats_count : 1) * sizeof(int));
+    if (order == NULL) error(ERROR_OUT_OF_MEMORY, 0);
+    for (int i = 0; i < stats_count; ++i) order[i] = i;
+    qsort(order, stats_count, sizeof(int), compare_stats);
+
+    if (csv) {
+        emit_row(append(0, "line,tries,fail_sig,fail_first,fail_last,fail_middle,constraint_runs,constraint_rejects,fires%s,pattern",
+            STATS_TIME_COLUMN(",nanoseconds")));
+    }
+    else if (json) {
+        emit_row(append(0, "["));
+    }
+    else {
+        emit_row(append(0, "%6s %9s %9s %9s %9s %9s %9s %9s %7s%s  pattern", "line", "tries", "fail@sig", "fail@0", "fail@end",
+            "fail@mid", "checked", "rejected", "fired", STATS_TIME_COLUMN("  time(us)")));
+    }
+
+    for (int i = 0; i < stats_count; ++i) {
+        const Rule* rule = &rule_stats_base[order[i]];
+        const RuleStats* st = &rule_stats[order[i]];
+        int len;
+        if (csv) {
+            len = append(0, "%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,", rule->lineno,
+                (unsigned long)st->tries, (unsigned long)st->fail_sig, (unsigned long)st->fail_first, (unsigned long)st->fail_last,
+                (unsigned long)st->fail_middle, (unsigned long)st->constraint_runs,
+                (unsigned long)st->constraint_rejects, (unsigned long)st->fires);
+#ifdef RULE_STATS_CLOCK
+            len = append(len, "%llu,", (unsigned long long)st->nanoseconds);
+#endif
+            len = quote(len, rule_label(rule), '"');
+        }
+        else if (json) {
+            len = append(0, "  {\"line\": %d, \"tries\": %lu, \"fail_sig\": %lu, \"fail_first\": %lu, \"fail_last\": %lu, "
+                "\"fail_middle\": %lu, \"constraint_runs\": %lu, \"constraint_rejects\": %lu, \"fires\": %lu, ",
+                rule->lineno, (unsigned long)st->tries, (unsigned long)st->fail_sig, (unsigned long)st->fail_first,
+                (unsigned long)st->fail_last, (unsigned long)st->fail_middle,
+                (unsigned long)st->constraint_runs, (unsigned long)st->constraint_rejects,
+                (unsigned long)st->fires);
+#ifdef RULE_STATS_CLOCK
+            len = append(len, "\"nanoseconds\": %llu, ", (unsigned long long)st->nanoseconds);
+#endif
+            len = append(len, "\"pattern\": ");
+            len = quote(len, rule_label(rule), '\\');
+            len = append(len, "}%s", i + 1 < stats_count ? "," : "");
+        }
+        else {
+            len = append(0, "%6d %9lu %9lu %9lu %9lu %9lu %9lu %9lu %7lu", rule->lineno,
+                (unsigned long)st->tries, (unsigned long)st->fail_sig, (unsigned long)st->fail_first, (unsigned long)st->fail_last,
+                (unsigned long)st->fail_middle, (unsigned long)st->constraint_runs,
+                (unsigned long)st->constraint_rejects, (unsigned long)st->fires);
+#ifdef RULE_STATS_CLOCK
+            len = append(len, " %9llu", (unsigned long long)(st->nanoseconds / 1000));
+#endif
+            len = append(len, "  %.*s", LABEL_WIDTH, rule_label(rule));
+        }
+        emit_row(len);
+    }
+    if (json) emit_row(append(0, "]"));
+
+    int8_t result = report_fd >= 0 && close_file(report_fd) < 0 ? -1 : 0;
+    free(order);
+    return result;
+}
+
+#endif //RULE_STATS
@@ -0,0 +1,65 @@
+#ifndef RULESTATS_H_
+#define RULESTATS_H_
+
+#include <stdint.h>
+
+#include "platform.h"
+#include "rules.h"
+
+/*
+ * Per-rule profiling counters, built only with -DRULE_STATS (make
+ * STATS=1). Without it every STAT_ macro expands to nothing and the
+ * optimizer is unchanged. Host builds also accumulate the time spent on
+ * each rule: matching, constraint and replacement, excluding the refill
+ * that follows a rewrite. -DRULE_STATS_NO_CLOCK keeps the counters but
+ * drops the timing, which the benchmark uses to stay close to full speed.
+ * Nothing is counted until stats_init, so the batch mode, whose worker
+ * threads would share the counters, leaves them off.
+ */
+#ifdef RULE_STATS
+
+#if defined(PLATFORM_POSIX) && !defined(RULE_STATS_NO_CLOCK)
+#define RULE_STATS_CLOCK
+#endif
+
+typedef struct RuleStats {
+    uint32_t tries;             /* match_rule calls */
+    uint32_t fail_sig;          /* rejected by the line signatures */
+    uint32_t fail_first;        /* failed on the first pattern line */
+    uint32_t fail_last;         /* failed on the last pattern line */
+    uint32_t fail_middle;       /* failed on a line in between */
+    uint32_t constraint_runs;
+    uint32_t constraint_rejects;
+    uint32_t fires;
+#ifdef RULE_STATS_CLOCK
+    uint64_t nanoseconds;
+#endif
+} RuleStats;
+
+extern RuleStats* rule_stats;
+extern Rule* rule_stats_base;
+
+void stats_init(Rule* rules, int count);
+int8_t stats_report(const char* filename);
+void stats_free(void);
+
+#define STAT_INC(rule, field) (rule_stats ? ++rule_stats[(rule) - rule_stats_base].field : 0)
+
+#ifdef RULE_STATS_CLOCK
+uint64_t stats_clock(void);
+#define STAT_TIME_BEGIN() uint64_t stat_t0 = stats_clock()
+#define STAT_TIME_END(rule) (rule_stats ? rule_stats[(rule) - rule_stats_base].nanoseconds += stats_clock() - stat_t0 : 0)
+#else
+#define STAT_TIME_BEGIN()
+#define STAT_TIME_END(rule)
+#endif
+
+#else
+
+#define STAT_INC(rule, field)
+#define STAT_TIME_BEGIN()
+#define STAT_TIME_END(rule)
+
+#endif //RULE_STATS
+
+#endif //RULESTATS_H_
@@ -0,0 +1,9 @@
+  ld a,0
+  out ($fe),a
+  ld a,08
+  out ($fe),a
+  ld a,010
+  out ($fe),a
+  ld a,10
+  out ($fe),a
+  ret
@@ -0,0 +1,8 @@
+  jp L1
+  nop
+L1:
+ret
+  jp L9
+L9:
+  ld a,1
+  ret
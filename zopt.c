@@ -0,0 +1,106 @@
+#include "platform.h"
+
+#ifdef PLATFORM_POSIX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dataarea.h"
+#include "fileio.h"
+#include "rules.h"
+#include "optimizer.h"
+#include "zopt.h"
+
+/* The rules stay loaded between calls and the context keeps its window
+   and arena buffers, so a call costs only the optimization itself. */
+struct ZoptRules {
+    Rule* rules;
+    uint8_t window;
+    OptimizerContext ctx;
+};
+
+static uint8_t io_ready;
+static uint8_t rules_loaded;
+
+typedef struct Output {
+    zopt_write_fn fn;
+    void* user;
+    uint8_t failed;
+} Output;
+
+static int write_output(void* data, const char* buf, uint32_t size) {
+    Output* o = (Output*)data;
+    if (!o->failed && o->fn(o->user, buf, size) < 0) o->failed = 1;
+    return o->failed ? -1 : 0;
+}
+
+static ZoptRules* wrap_rules(Rule* rules) {
+    if (!rules) return NULL;
+    ZoptRules* r = malloc(sizeof(ZoptRules));
+    if (!r) {
+        free_strtbl();
+        free_rules(rules);
+        return NULL;
+    }
+    r->rules = rules;
+    r->window = max_pattern_lines(rules, rule_count);
+    init_context(&r->ctx);
+    rules_loaded = 1;
+    return r;
+}
+
+static uint8_t can_load(void) {
+    if (rules_loaded) return 0;
+    if (!io_ready) {
+        init_file_io();
+        io_ready = 1;
+    }
+    return 1;
+}
+
+ZoptRules* zopt_rules_load(const char* path) {
+    if (!can_load()) return NULL;
+    return wrap_rules(load_rules(path));
+}
+
+ZoptRules* zopt_rules_load_buffer(const char* text, size_t len) {
+    if (!can_load() || len > UINT32_MAX) return NULL;
+    int8_t fd = open_memory(text, (uint32_t)len);
+    if (fd < 0) return NULL;
+    return wrap_rules(parse_rules_from(fd));
+}
+
+int zopt_optimize_buffer(ZoptRules* rules, const char* in, size_t in_len, zopt_write_fn out, void* user) {
+    if (in_len > UINT32_MAX) return -1;
+    Output o;
+    o.fn = out;
+    o.user = user;
+    o.failed = 0;
+    if (label_rules) {
+        int8_t scan_fd = open_memory(in, (uint32_t)in_len);
+        if (scan_fd >= 0) scan_labels(&rules->ctx, scan_fd);
+    }
+    int8_t in_fd = open_memory(in, (uint32_t)in_len);
+    int8_t out_fd = in_fd < 0 ? -1 : open_writer(write_output, &o);
+    if (out_fd < 0) {
+        if (in_fd >= 0) close_file(in_fd);
+        return -1;
+    }
+    int failed = optimize(&rules->ctx, in_fd, out_fd, rules->window) < 0;
+    close_file(in_fd);
+    if (close_file(out_fd) < 0) failed = 1;
+    return failed || o.failed ? -1 : 0;
+}
+
+void zopt_rules_free(ZoptRules* rules) {
+    if (!rules) return;
+    free_context(&rules->ctx);
+    free_strtbl();
+    free_rules(rules->rules);
+    free(rules);
+    rules_loaded = 0;
+}
+
+#endif //PLATFORM_POSIX
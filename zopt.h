@@ -0,0 +1,37 @@
+#ifndef ZOPT_H_
+#define ZOPT_H_
+
+#include <stddef.h>
+
+/*
+ * Embedding API (libzopt, host only). A compiler driver loads the rules
+ * once and then optimizes each function's assembly in memory:
+ *
+ *   ZoptRules* rules = zopt_rules_load("rules.opt");
+ *   zopt_optimize_buffer(rules, asm_text, asm_len, emit, &out);
+ *   ...
+ *   zopt_rules_free(rules);
+ *
+ * The rules live in the optimizer's global tables, so one rule set can be
+ * loaded at a time. Calls on one ZoptRules must not overlap. A malformed
+ * rule file ends the process with a message, as the command line tool
+ * does; check new rule files with the tool first.
+ */
+typedef struct ZoptRules ZoptRules;
+
+/* Receives the optimized text a block at a time. Return a negative value
+   to abort; zopt_optimize_buffer then returns -1. */
+typedef int (*zopt_write_fn)(void* user, const char* data, size_t len);
+
+/* Load rules from a file, resolved and cached as by the zopt tool, or
+   from rule source in memory. Return NULL on failure. */
+ZoptRules* zopt_rules_load(const char* path);
+ZoptRules* zopt_rules_load_buffer(const char* text, size_t len);
+
+/* Optimize `in_len` bytes of assembly and pass the result to `out`.
+   Returns 0 on success. */
+int zopt_optimize_buffer(ZoptRules* rules, const char* in, size_t in_len, zopt_write_fn out, void* user);
+
+void zopt_rules_free(ZoptRules* rules);
+
+#endif //ZOPT_H_